@@ -30,7 +30,23 @@
 #define ND_PEERTAB_BUCKETS (1 << ND_PEERTAB_BUCKET_BITS)
 
 struct nd_sock;
+struct nd_pin_cache;
+struct nd_hpage_pool;
+
+/* priority queue; comp(a, b) is true when a should stay behind b */
+struct nd_pq {
+	struct rb_root_cached root;
+	int count;
+	bool (*comp)(const struct rb_node*, const struct rb_node*);
+};
+
+/* upper bound of nd_params.grant_overcommit */
+#define ND_MAX_GRANT_OVERCOMMIT	8
+/* longest matching iteration, in ns */
+#define ND_MAX_ITER_SIZE	(10 * NSEC_PER_MSEC)
 
+/* max number of priority classes */
+#define ND_MAX_PRIO	4
 
 enum {
 	/* Core State */
@@ -39,9 +55,30 @@ enum {
 	ND_ACTIVE,
 };
 
+/* who hands out credit beyond the initial window, see nd_params.grant_sched */
+enum {
+	ND_GRANT_WINDOW,
+	/* shortest remaining flows first, see nd_grant_sched_update() */
+	ND_GRANT_SRPT,
+	/* epoch-based RTS/GRANT/ACCEPT matching, see nd_matching.c */
+	ND_GRANT_PIM,
+};
+
+/* copy kernels of the dcopy workers, see nd_params.copy_engine */
+enum {
+	/* stock skb/iov_iter copy helpers */
+	ND_COPY_ENGINE_GENERIC,
+	ND_COPY_ENGINE_AVX2,
+	ND_COPY_ENGINE_AVX512,
+	/* the widest the cpu supports */
+	ND_COPY_ENGINE_AUTO,
+};
+
 enum {
 	SCHE_RR,
 	SCHE_SRC_PORT,
+	/* stay on one channel per flowlet; migrate only when it is safe for ordering */
+	SCHE_FLOWLET,
 };
 enum {
 	/* The initial state is TCP_CLOSE */
@@ -100,6 +137,8 @@ struct nd_params {
 	bool nd_debug;
 	int nd_add_host;
 	int nd_host_added;
+	/* write an element count to log an nd_pq benchmark, see nd_pq_bench() */
+	int pq_bench;
 
 	int ldcopy_tx_inflight_thre;
 	int ldcopy_rx_inflight_thre;
@@ -124,6 +163,36 @@ struct nd_params {
 
 	int rmem_default;
 	int wmem_default;
+	/* grow rcvbuf/default_win and sndbuf on demand, up to rmem_max/wmem_max */
+	int moderate_buf;
+	int rmem_max;
+	int wmem_max;
+	/* send the first window of data right behind the SYNC */
+	int zero_rtt;
+	/* ND_GRANT_*: receiver hands out credit in SRPT order or by matching instead of per-socket windows */
+	int grant_sched;
+	/* bytes a flow may send before its first grant */
+	int grant_unsched;
+	/* number of flows granted concurrently; also the matches per epoch of a host */
+	int grant_overcommit;
+	/* ND_COPY_ENGINE_*; resolved to what the cpu supports */
+	int copy_engine;
+	/* receive copies of recvmsg calls this large use streaming stores; 0: never */
+	int copy_nt_thresh;
+	/* pages a process may keep pinned for remote copy, within its RLIMIT_MEMLOCK;
+	 * 0, the default, disables the cache
+	 */
+	int pin_cache_pages;
+	/* pick the SO_REUSEPORT listener whose SO_INCOMING_CPU is the receiving cpu,
+	 * by flow hash if none is
+	 */
+	int reuseport_cpu;
+	/* bytes a socket copies per deficit round-robin turn on a dcopy core */
+	int dcopy_quantum;
+	/* unpin pages and free skbs of receive copies on the dcopy core, not in recvmsg */
+	int dcopy_release;
+	/* 2MB pages per sender buffer pool (socket or dcopy core); 0: page_frag only */
+	int hpage_pool;
 
         int nr_cpus;
         int nr_nodes;
@@ -137,12 +206,20 @@ struct nd_params {
 	int num_remote_hosts;
 	int data_cpy_core;
 	int total_channels;
-	/* for performance isolation */
-	int lat_channel_idx;
-	int num_lat_channels;
-	int thpt_channel_idx;
-	int num_thpt_channels;
+	/* for performance isolation: class i owns channels
+	 * [prio_channel_idx[i], prio_channel_idx[i] + prio_num_channels[i]);
+	 * a higher class is more urgent.
+	 */
+	int num_prio;
+	int prio_channel_idx[ND_MAX_PRIO];
+	int prio_num_channels[ND_MAX_PRIO];
+	/* lowest sk_priority that maps to class i */
+	int prio_min_skprio[ND_MAX_PRIO];
+	/* per-turn service weight of class i; 0 gives strict priority over weighted classes */
+	int prio_weight[ND_MAX_PRIO];
 	int nd_default_sche_policy;
+	/* idle gap (us) that exceeds the channel RTT skew and ends a flowlet */
+	int flowlet_gap_us;
 };
 
 static inline struct ndhdr *nd_hdr(const struct sk_buff *skb)
@@ -194,9 +271,10 @@ static inline void nd_set_doff(struct nd_data_hdr *h)
         h->common.doff = (sizeof(struct nd_data_hdr) - sizeof(struct data_segment)) << 2;
 }
 
+/* header bytes; the high 4 bits of doff count 4-byte words, the low bits carry ND_DOFF_* flags */
 static inline unsigned int __nd_hdrlen(const struct ndhdr *dh)
 {
-	return dh->doff * 4;
+	return (dh->doff & ~ND_DOFF_EOR) >> 2;
 }
 
 static inline struct ndhdr *inner_nd_hdr(const struct sk_buff *skb)
@@ -222,6 +300,11 @@ struct nd_sack_block {
 	u32	end_seq;
 };
 
+/* Fields are grouped by the cores that write them: the app core (sendmsg/recvmsg,
+ * under the socket lock), the channel cores (incoming packets, grants, channel
+ * wakeups) and the dcopy cores (copy completions). Each group starts a cacheline
+ * so one role's stores don't invalidate another's; see the asserts below.
+ */
 struct nd_sock {
 	/* inet_sock has to be the first member */
 	struct inet_sock inet;
@@ -229,193 +312,174 @@ struct nd_sock {
 #define nd_portaddr_hash	inet.sk.__sk_common.skc_u16hashes[1]
 #define nd_portaddr_node	inet.sk.__sk_common.skc_portaddr_node
 
+	/* read-mostly: set up by bind/listen/connect and setsockopt */
 	struct inet_bind_bucket	  *icsk_bind_hash;
 	struct hlist_node         icsk_listen_portaddr_node;
 	struct request_sock_queue icsk_accept_queue;
 
-	// int		 pending;	/* Any pending frames ? */
-	// unsigned int	 corkflag;	/* Cork is required */
-	// __u8		 encap_type;	/* Is this an Encapsulation socket? */
-	// unsigned char	 no_check6_tx:1,/* Send zero ND6 checksums on TX? */
-	// 		 no_check6_rx:1,/* Allow zero ND6 checksums on RX? */
-	// 		 encap_enabled:1, /* This socket enabled encap
-	// 				   * processing; ND tunnels and
-	// 				   * different encapsulation layer set
-	// 				   * this
-	// 				   */
-	// 		 gro_enabled:1;	/* Can accept GRO packets */
-	/*
-	 * Following member retains the information to create a ND header
-	 * when the socket is uncorked.
-	 */
-	// __u16		 len;		/* total length of pending frames */
-	__u16		 gso_size;
-	/*
-	 * Fields specific to ND-Lite.
-	 */
-	// __u16		 pcslen;
-	// __u16		 pcrlen;
-/* indicator bits used by pcflag: */
-// #define NDLITE_BIT      0x1  		/* set by ndlite proto init function */
-// #define NDLITE_SEND_CC  0x2  		/* set via ndlite setsockopt         */
-// #define NDLITE_RECV_CC  0x4		/* set via ndlite setsocktopt        */
-// 	__u8		 pcflag;        /* marks socket as ND-Lite if > 0    */
-// 	__u8		 unused[3];
-	/*
-	 * For encapsulation sockets.
-	 */
-	int (*encap_rcv)(struct sock *sk, struct sk_buff *skb);
-	int (*encap_err_lookup)(struct sock *sk, struct sk_buff *skb);
-	void (*encap_destroy)(struct sock *sk);
-
-	/* GRO functions for ND socket */
-	struct sk_buff *	(*gro_receive)(struct sock *sk,
-					       struct list_head *head,
-					       struct sk_buff *skb);
-	int			(*gro_complete)(struct sock *sk,
-						struct sk_buff *skb,
-						int nhoff);
-
-	/* nd_recvmsg try to use this before splicing sk_receive_queue */
-	struct sk_buff_head	reader_queue ____cacheline_aligned_in_smp;
-
-	/* This field is dirtied by nd_recvmsg() */
-	int		forward_deficit;
-	
-	/**
-	 * flow id
-	 */
-    int core_id;
-
-	struct rb_root	out_of_order_queue;
-	/**
-	 * size of flow in bytes
-	 */
-    // uint32_t total_length;
-	
-	/*protected by entry scheduling lock */
-	// uint32_t grant_nxt;
-	// uint32_t prev_grant_nxt;
-
-	/* protected by socket user lock*/
-	// uint32_t new_grant_nxt;
-    // uint32_t num_sacks;
-	struct nd_sack_block selective_acks[16]; /* The SACKS themselves*/
-
-    // ktime_t start_time;
-	// struct list_head match_link;
-
 	uint32_t default_win;
-
-	struct page_frag_cache	pf_cache;
-
-	/* flow control due to the stuck of channel */
-	struct list_head tx_wait_list;
-	struct work_struct tx_work;
-
 	int sche_policy;
+	/* per-socket knobs, see the SOL_VIRTUAL_SOCK options in uapi_linux_nd.h */
+	int copy_mode;
+	int pdu_size;
+	int chan_first;
+	int chan_count;
+	/* ND_DGRAM: each sendmsg/recvmsg is one message to/from any peer */
+	int dgram;
+	/* ND_MSG_MODE: keep MSG_EOR boundaries on recvmsg */
+	int msg_mode;
+	/* pinned user pages of the owning mm, taken on first remote copy */
+	struct nd_pin_cache *pin_cache;
+	/* huge pages for the skbs of local sender copies, allocated on first use */
+	struct nd_hpage_pool *hpool;
+	/* nd ctrl */
+	void* nd_ctrl;
+
+	/* app: headers of outgoing requests */
+	struct page_frag_cache	pf_cache ____cacheline_aligned_in_smp;
 
     /* sender */
     struct nd_sender {
+		/* app */
 	    /* next sequence from the user; Also equals total bytes written by user. */
 	    uint32_t write_seq;
 	    /* the next sequence will be sent (at the first time)*/
 	    uint32_t snd_nxt;
-		/* sender side grant nxt from the receiver*/
-		uint32_t sd_grant_nxt;
 		int pending_queue;
-	    /* the last unack byte.*/
-	    uint32_t snd_una;
-
 		/* for data copy */
 		struct nd_conn_request* pending_req;
 		uint32_t nxt_dcopy_cpu;
-		struct llist_head	response_list;
-		atomic_t in_flight_copy_bytes;
-
+		/* copied skbs waiting for transmission; slot = (seq >> ND_SND_RING_SHIFT) & mask,
+		 * skbs sharing one slot are chained by skb->next in seq order.
+		 */
+		struct sk_buff **snd_ring;
+		uint32_t snd_ring_mask;
 		/* for ND conns */
 		int con_queue_id;
 		// for batching
 		int con_accumu_count;
-	    // uint32_t total_bytes_sent;
-	    // uint32_t bytes_from_user;
-	    // int remaining_pkts_at_sender;
-	
+		/* flowlet: ticket of the last request queued on con_queue_id and when */
+		int con_last_ticket;
+		u64 con_last_ns;
+		/* priority class of the sendmsg in progress */
+		int msg_prio;
+		/* id of the next MSG_ND_ASYNC sendmsg */
+		u32 async_id;
+		/* bytes ever handed to the dcopy workers; less copy_done is in flight */
+		u32 copy_issued;
+		/* last sndbuf expansion */
+		u64 sndbuf_time;
+
+		/* channel cores */
+		/* matching: on the RTS list while blocked; in the grant queue after a GRANT */
+		struct list_head match_link ____cacheline_aligned_in_smp;
+		struct rb_node match_node;
+		uint32_t match_remaining;
+		uint32_t match_tag;
+		/* local epoch this flow was last accepted in */
+		uint32_t match_epoch;
+		/* sender side grant nxt from the receiver*/
+		uint32_t sd_grant_nxt;
+	    /* the last unack byte.*/
+	    uint32_t snd_una;
 		/* bookkeeping the waiting channel info and state */
 		int wait_cpu;
 		bool wait_on_nd_conns;
 		void* wait_queue;
-		/* ND metric */
-	    // uint64_t first_byte_send_time;
 
-	    // uint64_t start_time;
-	    // uint64_t finish_time;
-	    // double latest_data_pkt_sent_time;
+		/* dcopy cores */
+		struct llist_head	response_list ____cacheline_aligned_in_smp;
+		/* bytes ever copied, published in batches, see nd_dcopy_done() */
+		atomic_t copy_done;
     } sender;
-    struct nd_receiver {
-		/**
-		 * size of message in bytes
-		 */
-		bool is_ready;
-		/* short flow and hasn't reached timeout yet */
-		bool free_flow;
-
-	    bool flow_sync_received;
 
-		/* protected by user lock */
-	 	bool finished_at_receiver;
-		bool flow_finish_wait;
-		int rmem_exhausted;
-		/* short flow waiting timer or long flow waiting timer; after all tokens arer granted */
-		// struct hrtimer flow_wait_timer;
-	    // ktime_t last_rtx_time;
+	/* channel cores: flow control due to the stuck of channel */
+	struct list_head tx_wait_list ____cacheline_aligned_in_smp;
+	struct work_struct tx_work;
+	struct rb_root	out_of_order_queue;
 
+    struct nd_receiver {
+		/* app */
 		atomic_t copied_seq;
-	    uint32_t bytes_received;
-	    // uint32_t received_count;
-	    // uint32_t max_gso_data;
-	    // uint32_t max_grant_batch;
-		uint32_t grant_nxt;
 		uint32_t nxt_dcopy_cpu;
-	    /* current received bytes + 1*/
-	    atomic_t rcv_nxt;
-	    uint32_t last_ack;
-	    // struct nd_sack_block duplicate_sack[1]; /* D-SACK block */
-	    // uint32_t max_seq_no_recv;
-		/** @priority: Priority level to include in future GRANTS. */
-		int priority;
-		/* ND metric */
-	    // uint64_t latest_token_sent_time;
-	    // uint64_t first_byte_receive_time;
-
-		// struct list_head ready_link;
-
-		/* protected by entry lock */
-		// bool in_pq;
-		// link for ND matching table
-		// struct list_head match_link;
-		atomic_t in_flight_copy_bytes;
-		/* protected by the entry lock */
-		uint32_t grant_batch;
-		int prev_grant_bytes;
-		struct llist_head	clean_page_list;
+		/* rcvbuf autotuning: bytes copied per rtt in the last measure */
+		struct {
+			u32 space;
+			u32 seq;
+			u64 time;
+		} rcvq_space;
+		bool flow_finish_wait;
+		/* bytes ever handed to the dcopy workers; less copy_done is in flight */
+		u32 copy_issued;
 		uint64_t free_skb_num;
-		// atomic_t backlog_len;
-		// atomic_t in_flight_bytes;
 
-		// struct work_struct token_xmit_struct;
+		/* channel cores */
+	    /* current received bytes + 1*/
+	    atomic_t rcv_nxt ____cacheline_aligned_in_smp;
+	    uint32_t bytes_received;
+		uint32_t grant_nxt;
+		/* grant scheduler: link in the SRPT queue, sender's write_seq and bytes left */
+		struct rb_node grant_link;
+		uint32_t adv_seq;
+		uint32_t grant_remaining;
+		/* matching: in the RTS queue of this iteration; local epoch of the last accept */
+		struct rb_node match_node;
+		uint32_t match_remaining;
+		uint32_t match_epoch;
 		/* this queue is for HOL blocking */
 		struct sk_buff_head	sk_hol_queue;
 		struct list_head  hol_channel_list;
 
-    } receiver;
+		/* dcopy cores */
+		atomic_t copy_done ____cacheline_aligned_in_smp;
+		struct llist_head	clean_page_list;
+    } receiver ____cacheline_aligned_in_smp;
+};
 
-	/* nd ctrl */
-	void* nd_ctrl;
-	// atomic64_t next_outgoing_id;
+#ifdef CONFIG_SMP
+#define ND_SK_LINE(field)	(offsetof(struct nd_sock, field) / SMP_CACHE_BYTES)
+/* no cacheline is written by two roles; UP builds do not pad the groups */
+static_assert(ND_SK_LINE(pf_cache) > ND_SK_LINE(nd_ctrl));
+static_assert(ND_SK_LINE(sender.match_link) > ND_SK_LINE(sender.sndbuf_time));
+static_assert(ND_SK_LINE(sender.response_list) > ND_SK_LINE(sender.wait_queue));
+static_assert(ND_SK_LINE(tx_wait_list) > ND_SK_LINE(sender.copy_done));
+static_assert(ND_SK_LINE(receiver) > ND_SK_LINE(out_of_order_queue));
+static_assert(ND_SK_LINE(receiver.rcv_nxt) > ND_SK_LINE(receiver.free_skb_num));
+static_assert(ND_SK_LINE(receiver.copy_done) > ND_SK_LINE(receiver.hol_channel_list));
+#endif
+
+/* bytes of a socket the dcopy workers have not copied yet. The owner counts
+ * them in under the socket lock with plain stores, the workers count them out
+ * with one atomic per batch, so the owner's read is exact up to the batches
+ * still held by a worker, which it flushes before going idle. Lockless readers
+ * (poll, the window) race with the owner and get a value clamped at 0.
+ */
+static inline int nd_snd_inflight_exact(struct nd_sock *nsk)
+{
+	return nsk->sender.copy_issued - atomic_read_acquire(&nsk->sender.copy_done);
+}
 
-	int unsolved;
-};
+static inline int nd_rcv_inflight_exact(struct nd_sock *nsk)
+{
+	return nsk->receiver.copy_issued - atomic_read_acquire(&nsk->receiver.copy_done);
+}
+
+static inline int nd_copy_inflight_approx(const u32 *issued, const atomic_t *done)
+{
+	int n = READ_ONCE(*issued) - (u32)atomic_read(done);
+
+	return max(n, 0);
+}
+
+static inline int nd_snd_inflight_approx(const struct nd_sock *nsk)
+{
+	return nd_copy_inflight_approx(&nsk->sender.copy_issued, &nsk->sender.copy_done);
+}
+
+static inline int nd_rcv_inflight_approx(const struct nd_sock *nsk)
+{
+	return nd_copy_inflight_approx(&nsk->receiver.copy_issued, &nsk->receiver.copy_done);
+}
 
 struct nd_request_sock {
 	struct inet_request_sock 	req;
@@ -437,6 +501,18 @@ struct nd_request_sock {
 
 #define ND_MAX_SEGMENTS	(1 << 6UL)
 
+/*
+ * each sender completion ring slot covers ND_MIN_PDU_SIZE of sequence space, so a
+ * slot starts at most one full PDU; only short message tails share a slot.
+ * MAX_SLOTS (a 512KB array) bounds the in-flight window at 256MB.
+ */
+#define ND_SND_RING_SHIFT	12
+#define ND_SND_RING_MIN_SLOTS	64
+#define ND_SND_RING_MAX_SLOTS	(1 << 16)
+
+/* initial rcvbuf with buffer moderation; small so that idle sockets hold little */
+#define ND_RCVBUF_INIT	(16 * ND_MAX_SKB_LEN)
+
 static inline struct nd_sock *nd_sk(const struct sock *sk)
 {
 	return (struct nd_sock *)sk;
@@ -51,6 +51,7 @@
 #include <linux/static_key.h>
 #include <trace/events/skb.h>
 #include <net/busy_poll.h>
+#include <linux/errqueue.h>
 #include "nd_impl.h"
 #include <net/sock_reuseport.h>
 #include <net/addrconf.h>
@@ -84,6 +85,8 @@ EXPORT_SYMBOL(nd_hashinfo);
 #define PORTS_PER_CHAIN (MAX_ND_PORTS / ND_HTABLE_SIZE_MIN)
 
 #define MAX_PIN_PAGES 48
+/* pages handed to release_pages() and buffers to kfree_bulk() at a time */
+#define ND_RELEASE_BATCH 16
 
 static inline bool page_is_mergeable(const struct bio_vec *bv,
 		struct page *page, unsigned int len, unsigned int off,
@@ -122,11 +125,12 @@ bool __nd_try_merge_page(struct bio_vec *bv_arr, int nr_segs,  struct page *page
 	return false;
 }
 
-static ssize_t nd_dcopy_iov_init(struct msghdr *msg, struct iov_iter *iter, struct bio_vec *vec_p,
-	u32 bytes, int max_segs) {
-	ssize_t copied, offset, left;
+static ssize_t nd_dcopy_iov_init(struct sock *sk, struct msghdr *msg, struct iov_iter *iter,
+	struct bio_vec *vec_p, u32 bytes, int max_segs, struct nd_pin_region **region) {
+	ssize_t copied, left;
+	size_t offset, cached = bytes;
 	struct bio_vec *bv_arr;
-	struct page *pages[MAX_PIN_PAGES];
+	struct page *page_arr[MAX_PIN_PAGES], **pages = page_arr;
 	unsigned nr_segs = 0, i, len = 0;
 	bool same_page = false;
 
@@ -139,7 +143,13 @@ static ssize_t nd_dcopy_iov_init(struct msghdr *msg, struct iov_iter *iter, stru
 	bv_arr = vec_p;
 	// pr_info("reach here:%d\n",  __LINE__);
 
-	copied = iov_iter_get_pages(&msg->msg_iter, pages, bytes, max_segs,
+	/* buffers reused across calls stay pinned in the per-mm cache */
+	*region = nd_pin_cache_get_pages(sk, &msg->msg_iter, &pages, &cached,
+					&offset, max_segs);
+	if (*region)
+		copied = cached;
+	else
+		copied = iov_iter_get_pages(&msg->msg_iter, pages, bytes, max_segs,
 					    &offset);
 	// pr_info("reach here:%d\n",  __LINE__);
 	if(copied < 0)
@@ -150,7 +160,7 @@ static ssize_t nd_dcopy_iov_init(struct msghdr *msg, struct iov_iter *iter, stru
 		len = min_t(size_t, PAGE_SIZE - offset, left);
 
 		if (__nd_try_merge_page(bv_arr, nr_segs, page, len, offset, &same_page)) {
-			if (same_page)
+			if (same_page && !*region)
 				put_page(page);
 			// pr_info("merge page\n");
 		} else {
@@ -185,16 +195,32 @@ static inline bool nd_next_segment(struct bio_vec* bv_arr,
 #define nd_for_each_segment_all(bvl, bv_arr, iter, max_segs) \
 	for (bvl = bvec_init_iter_all(&iter); nd_next_segment((bv_arr), &iter, max_segs); )
 
-void nd_release_pages(struct bio_vec* bv_arr, bool mark_dirty, int max_segs)
+void nd_release_pages(struct bio_vec* bv_arr, struct nd_pin_region *region,
+	bool mark_dirty, int max_segs)
 {
 	struct bvec_iter_all iter_all;
 	struct bio_vec *bvec;
+	struct page *batch[ND_RELEASE_BATCH];
+	int nr = 0;
 
 	nd_for_each_segment_all(bvec, bv_arr, iter_all, max_segs) {
-		if (mark_dirty && !PageCompound(bvec->bv_page))
+		/* a buffer reused across calls is mostly dirty already */
+		if (mark_dirty && !PageCompound(bvec->bv_page) &&
+			!PageDirty(bvec->bv_page))
 			set_page_dirty_lock(bvec->bv_page);
-		put_page(bvec->bv_page);
+		/* cached pages stay pinned until the cache lets them go */
+		if (region)
+			continue;
+		batch[nr++] = bvec->bv_page;
+		if (nr == ND_RELEASE_BATCH) {
+			release_pages(batch, nr);
+			nr = 0;
+		}
 	}
+	if (nr)
+		release_pages(batch, nr);
+	if (region)
+		nd_pin_region_put(region);
 }
 
 // u64 total_send_ack = 0;
@@ -223,22 +249,97 @@ void nd_release_pages(struct bio_vec* bv_arr, bool mark_dirty, int max_segs)
 
 void nd_clean_dcopy_pages(struct sock *sk) {
 	struct nd_sock *nsk = nd_sk(sk);
-	struct nd_dcopy_page *resp;
-	struct llist_node *node;
-	for (node = llist_del_all(&nsk->receiver.clean_page_list); node;) {
-		resp = llist_entry(node, struct nd_dcopy_page, lentry);
-		node = node->next;
+	struct nd_dcopy_page *resp, *tmp;
+	struct llist_node *node = llist_del_all(&nsk->receiver.clean_page_list);
+	struct sk_buff *skbs = NULL, **tail = &skbs;
+	void *frees[ND_RELEASE_BATCH];
+	size_t nr = 0;
+
+	llist_for_each_entry_safe(resp, tmp, node, lentry) {
 		if(resp->bv_arr) {
-			nd_release_pages(resp->bv_arr, true, resp->max_segs);
-			kfree(resp->bv_arr);
+			nd_release_pages(resp->bv_arr, resp->region, true, resp->max_segs);
+			frees[nr++] = resp->bv_arr;
 		}
-		if(resp->skb){
-			kfree_skb(resp->skb);
+		/* splice the chains and free every skb with one kfree_skb_list() */
+		for (*tail = resp->skb; *tail; tail = &(*tail)->next)
 			nsk->receiver.free_skb_num += 1;
+		frees[nr++] = resp;
+		if (nr >= ND_RELEASE_BATCH - 1) {
+			kfree_bulk(nr, frees);
+			nr = 0;
 		}
-		kfree(resp);
 	}
-	return;
+	if (nr)
+		kfree_bulk(nr, frees);
+	kfree_skb_list(skbs);
+}
+
+static inline struct sk_buff **nd_snd_ring_slot(struct nd_sock *nsk, u32 seq)
+{
+	return &nsk->sender.snd_ring[(seq >> ND_SND_RING_SHIFT) & nsk->sender.snd_ring_mask];
+}
+
+/*
+ * grow (or allocate) the completion ring so that seqs up to end_seq do not alias
+ * snd_una's slot; process context only, so completions never allocate
+ */
+static int nd_snd_ring_reserve(struct sock *sk, u32 end_seq)
+{
+	struct nd_sock *nsk = nd_sk(sk);
+	struct sk_buff **ring, *skb, *next, **pprev;
+	u32 dist, slots, i;
+
+	dist = ((end_seq >> ND_SND_RING_SHIFT) - (nsk->sender.snd_una >> ND_SND_RING_SHIFT)) &
+		((1U << (32 - ND_SND_RING_SHIFT)) - 1);
+	if (nsk->sender.snd_ring && dist <= nsk->sender.snd_ring_mask)
+		return 0;
+	if (dist >= ND_SND_RING_MAX_SLOTS)
+		return -ENOBUFS;
+	slots = max_t(u32, ND_SND_RING_MIN_SLOTS, (nsk->sender.snd_ring_mask + 1) * 2);
+	slots = max_t(u32, slots, roundup_pow_of_two(dist + 1));
+	slots = min_t(u32, slots, ND_SND_RING_MAX_SLOTS);
+	ring = kvcalloc(slots, sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+	/* rehash the old slots; chains stay sorted since seqs only move to later slots */
+	for (i = 0; nsk->sender.snd_ring && i <= nsk->sender.snd_ring_mask; i++) {
+		for (skb = nsk->sender.snd_ring[i]; skb; skb = next) {
+			next = skb->next;
+			pprev = &ring[(ND_SKB_CB(skb)->seq >> ND_SND_RING_SHIFT) & (slots - 1)];
+			while (*pprev && before(ND_SKB_CB(*pprev)->seq, ND_SKB_CB(skb)->seq))
+				pprev = &(*pprev)->next;
+			skb->next = *pprev;
+			*pprev = skb;
+		}
+	}
+	kvfree(nsk->sender.snd_ring);
+	nsk->sender.snd_ring = ring;
+	nsk->sender.snd_ring_mask = slots - 1;
+	return 0;
+}
+
+static void nd_snd_ring_insert(struct sock *sk, struct sk_buff *skb)
+{
+	struct sk_buff **pprev = nd_snd_ring_slot(nd_sk(sk), ND_SKB_CB(skb)->seq);
+
+	/* a slot only holds more than one skb when short message tails share it */
+	while (*pprev && before(ND_SKB_CB(*pprev)->seq, ND_SKB_CB(skb)->seq))
+		pprev = &(*pprev)->next;
+	skb->next = *pprev;
+	*pprev = skb;
+}
+
+/* the skb starting exactly at seq, if its copy has completed */
+static inline struct sk_buff *nd_snd_ring_peek(struct nd_sock *nsk, u32 seq)
+{
+	struct sk_buff *skb;
+
+	if (!nsk->sender.snd_ring)
+		return NULL;
+	skb = *nd_snd_ring_slot(nsk, seq);
+	if (skb && ND_SKB_CB(skb)->seq == seq)
+		return skb;
+	return NULL;
 }
 
 void nd_fetch_dcopy_response(struct sock *sk) {
@@ -247,8 +348,8 @@ void nd_fetch_dcopy_response(struct sock *sk) {
 	struct llist_node *node;
 	for (node = llist_del_all(&nsk->sender.response_list); node;) {
 		resp = llist_entry(node, struct nd_dcopy_response, lentry);
-		/* reuse tcp_rtx_queue due to the mess-up order */
-		nd_rbtree_insert(&sk->tcp_rtx_queue, resp->skb);
+		/* dcopy workers complete out of order; slot by seq */
+		nd_snd_ring_insert(sk, resp->skb);
 		node = node->next;
 		sk_wmem_queued_add(sk, resp->skb->truesize);
 		// sk_mem_charge(sk, resp->skb->len);
@@ -256,10 +357,10 @@ void nd_fetch_dcopy_response(struct sock *sk) {
 
 		nsk->sender.pending_queue -= resp->skb->len;
 		WARN_ON(nsk->sender.pending_queue < 0);
-		kfree(resp);
 		if(nd_params.nd_debug) {
 			pr_info("push seq:%d\n", ND_SKB_CB(resp->skb)->seq);
 		}
+		kfree(resp);
 	}
 	return;
 }
@@ -269,7 +370,7 @@ static int sk_wait_data_copy(struct sock *sk, long *timeo)
 	DEFINE_WAIT_FUNC(wait, woken_wake_function);
 	int rc = 0;
 	struct nd_sock* nsk = nd_sk(sk);
-	while(atomic_read(&nsk->receiver.in_flight_copy_bytes) != 0) {
+	while(nd_rcv_inflight_exact(nsk) != 0) {
 		nd_clean_dcopy_pages(sk);
 		schedule();
 		// schedule();
@@ -289,7 +390,7 @@ static int sk_wait_sender_data_copy(struct sock *sk, long *timeo)
 	DEFINE_WAIT_FUNC(wait, woken_wake_function);
 	int rc= 0;
 	struct nd_sock* nsk = nd_sk(sk);
-	while(atomic_read(&nsk->sender.in_flight_copy_bytes) != 0) {
+	while(nd_snd_inflight_exact(nsk) != 0) {
 		nd_push(sk, GFP_KERNEL);
 		// nd_fetch_dcopy_response(sk);
 		schedule();
@@ -303,6 +404,68 @@ static int sk_wait_sender_data_copy(struct sock *sk, long *timeo)
 	return rc;
 }
 
+/* fold id into the tail notification, as MSG_ZEROCOPY does, when it extends its range */
+static bool nd_async_notify_extend(struct sk_buff *tail, struct sock_exterr_skb *serr)
+{
+	struct sock_exterr_skb *tail_serr = SKB_EXT_ERR(tail);
+
+	if (tail_serr->ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY ||
+		tail_serr->ee.ee_code != serr->ee.ee_code)
+		return false;
+	if (serr->ee.ee_info != tail_serr->ee.ee_data + 1)
+		return false;
+	tail_serr->ee.ee_data = serr->ee.ee_info;
+	return true;
+}
+
+/* tell the application its MSG_ND_ASYNC buffer is free again */
+static void nd_async_send_complete(struct nd_async_send *as)
+{
+	struct sock *sk = as->sk;
+	struct sk_buff_head *q = &sk->sk_error_queue;
+	struct sk_buff *skb = as->skb, *tail;
+	struct sock_exterr_skb *serr;
+	unsigned long flags;
+
+	serr = SKB_EXT_ERR(skb);
+	memset(serr, 0, sizeof(*serr));
+	serr->ee.ee_origin = SO_EE_ORIGIN_ZEROCOPY;
+	serr->ee.ee_info = as->id;
+	serr->ee.ee_data = as->id;
+	if (as->copied)
+		serr->ee.ee_code |= SO_EE_CODE_ZEROCOPY_COPIED;
+
+	/* the skb was charged to optmem at sendmsg, so unlike sock_queue_err_skb()
+	 * this can't fail on a full rcvbuf and lose the id
+	 */
+	spin_lock_irqsave(&q->lock, flags);
+	tail = skb_peek_tail(q);
+	if (!tail || !nd_async_notify_extend(tail, serr)) {
+		__skb_queue_tail(q, skb);
+		skb = NULL;
+	}
+	spin_unlock_irqrestore(&q->lock, flags);
+	sk->sk_error_report(sk);
+	consume_skb(skb);
+	kfree(as);
+}
+
+void nd_async_send_put(struct nd_async_send *as)
+{
+	if (atomic_dec_and_test(&as->pending))
+		nd_async_send_complete(as);
+}
+
+/* a copy request of the call is done; called by the dcopy worker before it
+ * counts the request as copied, which nd_destroy_sock waits on
+ */
+void nd_async_send_done(struct nd_async_send *as)
+{
+	/* nobody waits in sendmsg to push the copied skbs */
+	nd_conn_kick_sock(nd_sk(as->sk), as->cpu);
+	nd_async_send_put(as);
+}
+
 void nd_rbtree_insert(struct rb_root *root, struct sk_buff *skb)
 {
         struct rb_node **p = &root->rb_node;
@@ -321,21 +484,24 @@ void nd_rbtree_insert(struct rb_root *root, struct sk_buff *skb)
         rb_insert_color(&skb->rbnode, root);
 }
 
-static void nd_rtx_queue_purge(struct sock *sk)
+static void nd_snd_ring_purge(struct sock *sk)
 {
-	struct rb_node *p = rb_first(&sk->tcp_rtx_queue);
-
-	// nd_sk(sk)->highest_sack = NULL;
-	while (p) {
-		struct sk_buff *skb = rb_to_skb(p);
-
-		p = rb_next(p);
-		/* Since we are deleting whole queue, no need to
-		 * list_del(&skb->tcp_tsorted_anchor)
-		 */
-		nd_rtx_queue_unlink(skb, sk);
-		nd_wmem_free_skb(sk, skb);
+	struct nd_sock *nsk = nd_sk(sk);
+	struct sk_buff *skb, *next;
+	u32 i;
+
+	if (!nsk->sender.snd_ring)
+		return;
+	for (i = 0; i <= nsk->sender.snd_ring_mask; i++) {
+		for (skb = nsk->sender.snd_ring[i]; skb; skb = next) {
+			next = skb->next;
+			skb->next = NULL;
+			nd_wmem_free_skb(sk, skb);
+		}
 	}
+	kvfree(nsk->sender.snd_ring);
+	nsk->sender.snd_ring = NULL;
+	nsk->sender.snd_ring_mask = 0;
 }
 
 static void nd_ofo_queue_purge(struct sock *sk)
@@ -364,7 +530,7 @@ void nd_write_queue_purge(struct sock *sk)
 	while ((skb = skb_dequeue(&sk->sk_write_queue)) != NULL) {
 		nd_wmem_free_skb(sk, skb);
 	}
-	nd_rtx_queue_purge(sk);
+	nd_snd_ring_purge(sk);
 	skb = sk->sk_tx_skb_cache;
 	if (skb) {
 		__kfree_skb(skb);
@@ -390,40 +556,29 @@ int nd_err(struct sk_buff *skb, u32 info)
 struct sk_buff* nd_dequeue_snd_q(struct sock *sk) {
 	struct sk_buff *skb = NULL;
 	struct nd_sock *nsk = nd_sk(sk);
-	/* only one queue can be non-empty */
-	WARN_ON(skb_peek(&sk->sk_write_queue) && rb_first(&sk->tcp_rtx_queue));
 	if(skb_peek(&sk->sk_write_queue)) {
 		skb = skb_peek(&sk->sk_write_queue);
 		ND_SKB_CB(skb)->seq = nsk->sender.write_seq;
 		nsk->sender.write_seq += skb->len;
 		skb_dequeue(&sk->sk_write_queue);
 
-	} else if(rb_first(&sk->tcp_rtx_queue)){
-		struct rb_node *p = rb_first(&sk->tcp_rtx_queue);
-		skb = rb_to_skb(p);
-		if(nsk->sender.snd_una == ND_SKB_CB(skb)->seq) {
+	} else {
+		skb = nd_snd_ring_peek(nsk, nsk->sender.snd_una);
+		if(skb) {
+			/* the head of a slot chain is always the lowest seq */
+			*nd_snd_ring_slot(nsk, nsk->sender.snd_una) = skb->next;
+			skb->next = NULL;
 			nsk->sender.snd_una += skb->len;
-			nd_rtx_queue_unlink(skb, sk);
-		} else
-			skb = NULL;
+		}
 	}
 	return skb;
 }
 
 bool nd_snd_q_ready(struct sock *sk) {
-	struct sk_buff *skb;
-
 	if(skb_peek(&sk->sk_write_queue)) {
 		return true;
 	}
-	if(rb_first(&sk->tcp_rtx_queue)) {
-		struct rb_node *p = rb_first(&sk->tcp_rtx_queue);
-		skb = rb_to_skb(p);
-		if(ND_SKB_CB(skb)->seq == nd_sk(sk)->sender.snd_nxt)
-			return true;
-
-	}
-	return false;
+	return nd_snd_ring_peek(nd_sk(sk), nd_sk(sk)->sender.snd_nxt) != NULL;
 }
 
 int nd_push(struct sock *sk, gfp_t flag) {
@@ -433,6 +588,8 @@ int nd_push(struct sock *sk, gfp_t flag) {
 	bool push_success;
 	struct nd_conn_request* req;
 	struct ndhdr* hdr;
+	/* hand the data to the channels in one go per channel */
+	struct nd_conn_batch batch = {};
 	int ret = 0;
 	u32 seq;
 	
@@ -451,7 +608,8 @@ int nd_push(struct sock *sk, gfp_t flag) {
 		skb = nd_dequeue_snd_q(sk);
 		/* out-of-order pkt */
 		if(skb == NULL) {
-			return  -EMSGSIZE;
+			ret = -EMSGSIZE;
+			break;
 		}
 		req = kzalloc(sizeof(*req), flag);
 		if(!req) {
@@ -461,7 +619,11 @@ int nd_push(struct sock *sk, gfp_t flag) {
 		if(skb->len == 0 || skb->data_len == 0) {
 			WARN_ON(true);
 		}
-		nd_init_request(sk, req);
+		nd_init_request(sk, req, flag);
+		req->prio_class = ND_SKB_CB(skb)->prio_class;
+		/* zero-RTT data must not overtake the SYNC; keep it on the SYNC's channel */
+		if(sk->sk_state == ND_SYNC_SENT)
+			req->queue = &nsk->nd_ctrl->queues[nsk->sender.con_queue_id];
 		req->state = ND_CONN_SEND_CMD_PDU;
 		// req->pdu_len = sizeof(struct ndhdr) + skb->len;
 		// req->data_len = skb->len;
@@ -486,7 +648,11 @@ int nd_push(struct sock *sk, gfp_t flag) {
 		hdr->dest = inet->inet_dport;
 		// hdr->check = 0;
 		hdr->doff = (sizeof(struct ndhdr)) << 2;
+		if (ND_SKB_CB(skb)->eor)
+			hdr->doff |= ND_DOFF_EOR;
 		hdr->seq = htonl(ND_SKB_CB(skb)->seq);
+		/* advertise the backlog so the receiver can schedule grants */
+		hdr->grant_seq = htonl(nsk->sender.write_seq);
 		// skb_dequeue(&sk->sk_write_queue);
 			// kfree_skb(skb);
 		sk_wmem_queued_add(sk, -skb->truesize);
@@ -516,9 +682,18 @@ queue_req:
 		// 	break;
 		// }
 		seq = ND_SKB_CB(skb)->seq + skb->len;
+		/* with the grant scheduler the receiver paces us; wait for the next ack */
+		if(nd_params.grant_sched && after(seq, nsk->sender.sd_grant_nxt)) {
+			WARN_ON(nsk->sender.pending_req);
+			nsk->sender.pending_req = req;
+			if(nd_params.grant_sched == ND_GRANT_PIM)
+				nd_match_request(sk);
+			ret = -EMSGSIZE;
+			break;
+		}
 		/* queue the request */
 		// req->queue = &nd_ctrl->queues[htons(inet->inet_sport) % nd_params.nd_num_queue];
-		push_success = nd_conn_queue_request(req, nsk, false, false, !nd_snd_q_ready(sk));
+		push_success = nd_conn_queue_request_batch(req, nsk, false, &batch);
 		if(!push_success) {
 			WARN_ON(nsk->sender.pending_req);
 			// pr_info("add to sleep sock:%d\n", __LINE__);
@@ -529,6 +704,7 @@ queue_req:
 		nsk->sender.snd_nxt = seq;
 		// printk(" dequeue forward alloc:%d\n", sk->sk_forward_alloc);
 	}
+	nd_conn_batch_flush(&batch);
 	return ret;
 }
 
@@ -567,22 +743,116 @@ static inline bool nd_stream_memory_free(const struct sock *sk, int pending)
 
 	return true;
 }
-/* copy from kcm sendmsg */
+/* the writer ran out of sndbuf while the channels kept up, i.e. the last push
+ * queued bytes and hit neither a full channel nor the grant: double sndbuf,
+ * once per rtt
+ */
+static void nd_sndbuf_expand(struct sock *sk)
+{
+	struct nd_sock *nsk = nd_sk(sk);
+	u64 now = ktime_get_ns();
+	int sndbuf;
+
+	if (!nd_params.moderate_buf || (sk->sk_userlocks & SOCK_SNDBUF_LOCK))
+		return;
+	if (now - nsk->sender.sndbuf_time < (u64)nd_params.rtt * NSEC_PER_USEC)
+		return;
+	nsk->sender.sndbuf_time = now;
+	sndbuf = min_t(u64, (u64)READ_ONCE(sk->sk_sndbuf) << 1, nd_params.wmem_max);
+	if (sndbuf > READ_ONCE(sk->sk_sndbuf))
+		WRITE_ONCE(sk->sk_sndbuf, sndbuf);
+}
+
+/* grow rcvbuf and the window when the reader drains more than the current window
+ * per rtt; modelled on tcp_rcv_space_adjust, with copied normalized to one rtt.
+ */
+static void nd_rcv_space_adjust(struct sock *sk)
+{
+	struct nd_sock *nsk = nd_sk(sk);
+	u32 copied_seq = (u32)atomic_read(&nsk->receiver.copied_seq);
+	u64 rtt = (u64)nd_params.rtt * NSEC_PER_USEC;
+	u64 now = ktime_get_ns(), elapsed;
+	u64 copied, rcvwin;
+
+	elapsed = now - nsk->receiver.rcvq_space.time;
+	if (elapsed < rtt || !rtt)
+		return;
+	copied = div64_u64((u64)(copied_seq - nsk->receiver.rcvq_space.seq) * rtt, elapsed);
+	if (copied <= nsk->receiver.rcvq_space.space)
+		goto new_measure;
+	if (nd_params.moderate_buf && !(sk->sk_userlocks & SOCK_RCVBUF_LOCK)) {
+		/* let the reader fall one rtt behind while one rtt of data is in flight */
+		rcvwin = min_t(u64, (copied << 1) + 2 * ND_MAX_SKB_LEN, nd_params.rmem_max);
+		if (rcvwin > READ_ONCE(sk->sk_rcvbuf))
+			WRITE_ONCE(sk->sk_rcvbuf, rcvwin);
+		if (rcvwin > READ_ONCE(nsk->default_win))
+			WRITE_ONCE(nsk->default_win, rcvwin);
+	}
+	nsk->receiver.rcvq_space.space = copied;
+new_measure:
+	nsk->receiver.rcvq_space.seq = copied_seq;
+	nsk->receiver.rcvq_space.time = now;
+}
+
+/* local or offloaded copy for the next chunk, per ND_COPY_MODE; offload still needs a free dcopy thread */
+static inline bool nd_copy_local(struct nd_sock *nsk, int inflight, int inflight_thre, size_t copied)
+{
+	if (nd_params.nd_num_dc_thread == 0)
+		return true;
+	switch (READ_ONCE(nsk->copy_mode)) {
+	case ND_COPY_LOCAL:
+		return true;
+	case ND_COPY_REMOTE:
+		return false;
+	}
+	return inflight > inflight_thre || copied < nd_params.ldcopy_min_thre;
+}
+
+/* zero-RTT: before SYNC_ACK, data up to the initial grant follows the SYNC */
+static inline bool nd_zero_rtt_ok(struct sock *sk)
+{
+	struct nd_sock *nsk = nd_sk(sk);
+
+	return nd_params.zero_rtt && sk->sk_state == ND_SYNC_SENT &&
+		before(nsk->sender.write_seq, nsk->sender.sd_grant_nxt);
+}
+
+/* frag for the local copy: the socket's huge-page pool, else its page_frag */
+static struct page_frag *nd_sender_page_frag(struct sock *sk)
+{
+	struct nd_sock *nsk = nd_sk(sk);
+	struct page_frag *pfrag;
+
+	if (READ_ONCE(nd_params.hpage_pool) > 0) {
+		if (!nsk->hpool)
+			nsk->hpool = kzalloc(sizeof(*nsk->hpool), sk->sk_allocation);
+		if (nsk->hpool) {
+			pfrag = nd_hpage_pool_refill(nsk->hpool, 32U, sk->sk_allocation);
+			if (pfrag)
+				return pfrag;
+		}
+	}
+	pfrag = sk_page_frag(sk);
+	return sk_page_frag_refill(sk, pfrag) ? pfrag : NULL;
+}
+
+/* copy from kcm sendmsg; eor marks the last skb as the end of a message */
 static int nd_sender_local_dcopy(struct sock* sk, struct msghdr *msg, 
-	int req_len, u32 seq, long timeo) {
+	int req_len, u32 seq, long timeo, bool eor) {
 	struct sk_buff *skb = NULL;
 	struct nd_sock *nsk = nd_sk(sk);
 	struct nd_dcopy_response *resp;
 	size_t copy;
+	u32 snd_nxt;
 	int err, i = 0;
 	while (req_len > 0) {
 		bool merge = true;
-		struct page_frag *pfrag = sk_page_frag(sk);
-		if (!sk_page_frag_refill(sk, pfrag))
+		struct page_frag *pfrag = nd_sender_page_frag(sk);
+		if (!pfrag)
 			goto wait_for_memory;
 		if(!skb) 
 			goto create_new_skb;
-		if(skb->len == ND_MAX_SKB_LEN)
+		if(skb->len >= nsk->pdu_size)
 			goto push_skb;
 		i = skb_shinfo(skb)->nr_frags;
 		if (!skb_can_coalesce(skb, i, pfrag->page,
@@ -592,7 +862,7 @@ static int nd_sender_local_dcopy(struct sock* sk, struct msghdr *msg,
 			}
 			merge = false;
 		}
-		copy = min_t(int, ND_MAX_SKB_LEN - skb->len, req_len);
+		copy = min_t(int, nsk->pdu_size - skb->len, req_len);
 		copy = min_t(int, copy,
 			     pfrag->size - pfrag->offset);
 		
@@ -620,15 +890,17 @@ static int nd_sender_local_dcopy(struct sock* sk, struct msghdr *msg,
 create_new_skb:
 		WARN_ON(skb != NULL);
 		skb = alloc_skb(0, sk->sk_allocation);
-		skb->ip_summed = CHECKSUM_PARTIAL;
 		// printk("create new skb\n");
 		if(!skb)
 			goto wait_for_memory;
+		skb->ip_summed = CHECKSUM_PARTIAL;
+		ND_SKB_CB(skb)->prio_class = nsk->sender.msg_prio;
 		continue;
 
 push_skb:
 		/* push the new skb */
 		ND_SKB_CB(skb)->seq = seq;
+		ND_SKB_CB(skb)->eor = eor && req_len == 0;
 		resp = kmalloc(sizeof(struct nd_dcopy_response), GFP_KERNEL);
 		resp->skb = skb;
 		llist_add(&resp->lentry, &nsk->sender.response_list);
@@ -640,6 +912,7 @@ push_skb:
 		resp = NULL;
 		continue;
 wait_for_memory:
+		snd_nxt = nsk->sender.snd_nxt;
 		/* wait for pending requests to be done */
 		sk_wait_sender_data_copy(sk, &timeo);
 		// nd_fetch_dcopy_response(sk);
@@ -650,7 +923,8 @@ wait_for_memory:
 		if(err == -EDQUOT){
 			// pr_info("add to sleep sock send msg\n");
 			nd_conn_add_sleep_sock(nsk->nd_ctrl, nsk);
-		} 
+		} else if (!err && nsk->sender.snd_nxt != snd_nxt)
+			nd_sndbuf_expand(sk);
 		err = sk_stream_wait_memory(sk, &timeo);
 		// pr_info("end wait \n");
 		if (err) {
@@ -684,17 +958,26 @@ static inline bool nd_wmem_schedule(struct sock *sk, int size)
 static int nd_sendmsg_new2_locked(struct sock *sk, struct msghdr *msg, size_t len)
 {
 	struct nd_sock *nsk = nd_sk(sk);
+	/* where the channels were before waiting for memory */
+	u32 snd_nxt;
 	// struct sk_buff *skb = NULL;
 	size_t copy, copied = 0;
 	long timeo = sock_sndtimeo(sk, msg->msg_flags & MSG_DONTWAIT);
+	/* sendmmsg sets MSG_BATCH on all but its last message; push once per batch */
 	int eor = (sk->sk_socket->type == SOCK_DGRAM) ?
-		  !(msg->msg_flags & MSG_MORE) : !!(msg->msg_flags & MSG_EOR);
+		  !(msg->msg_flags & (MSG_MORE | MSG_BATCH)) : !!(msg->msg_flags & MSG_EOR);
+	/* the last byte of this call ends a message */
+	bool msg_end = (msg->msg_flags & MSG_EOR) ||
+		(READ_ONCE(nsk->msg_mode) && !(msg->msg_flags & MSG_MORE));
+	/* return once the copies are queued, see MSG_ND_ASYNC */
+	struct nd_async_send *as = NULL;
 	int err = -EPIPE;
 	// int i = 0;
 	/* hardcode for now */
 	struct nd_dcopy_request *request;
 	struct iov_iter biter;
 	struct bio_vec *bv_arr = NULL;
+	struct nd_pin_region *region = NULL;
 	// ssize_t bremain = msg->iter->count, blen;
 	ssize_t blen;
 	int max_segs = MAX_PIN_PAGES;
@@ -702,7 +985,7 @@ static int nd_sendmsg_new2_locked(struct sock *sk, struct msghdr *msg, size_t le
 	int next_cpu = 0;
 	// int pending = 0;
 	WARN_ON(msg->msg_iter.count != len);
-	if ((1 << sk->sk_state) & ~(NDF_ESTABLISH)) {
+	if (((1 << sk->sk_state) & ~(NDF_ESTABLISH)) && !nd_zero_rtt_ok(sk)) {
 		err = nd_wait_for_connect(sk, &timeo);
 		if (err != 0)
 			goto out_error;
@@ -713,6 +996,27 @@ static int nd_sendmsg_new2_locked(struct sock *sk, struct msghdr *msg, size_t le
 	if (sk->sk_err)
 		goto out_error;
 
+	if (msg->msg_flags & MSG_ND_ASYNC) {
+		as = kmalloc(sizeof(*as), GFP_KERNEL);
+		if (!as) {
+			err = -ENOBUFS;
+			goto out_error;
+		}
+		/* the notification is allocated up front so it can't be lost later */
+		as->skb = sock_omalloc(sk, 0, GFP_KERNEL);
+		if (!as->skb) {
+			kfree(as);
+			as = NULL;
+			err = -ENOBUFS;
+			goto out_error;
+		}
+		as->sk = sk;
+		atomic_set(&as->pending, 1);
+		as->id = nsk->sender.async_id++;
+		as->cpu = raw_smp_processor_id();
+		as->copied = true;
+	}
+
 	/* intialize the nxt_dcopy_cpu */
 	nsk->sender.nxt_dcopy_cpu = nd_params.data_cpy_core;
 
@@ -725,18 +1029,32 @@ static int nd_sendmsg_new2_locked(struct sock *sk, struct msghdr *msg, size_t le
 
 		/* this part might need to change latter */
 		/* decide to do local or remote data copy */
-		copy = min_t(int, max_segs * PAGE_SIZE / ND_MAX_SKB_LEN * ND_MAX_SKB_LEN, msg_data_left(msg));
+		copy = min_t(int, max_segs * PAGE_SIZE / nsk->pdu_size * nsk->pdu_size, msg_data_left(msg));
 		if(copy == 0) {
 			WARN_ON(true);
 		}
+		if (sk->sk_state == ND_SYNC_SENT) {
+			if (!nd_zero_rtt_ok(sk)) {
+				/* the initial window is used up; flush it and wait for SYNC_ACK */
+				sk_wait_sender_data_copy(sk, &timeo);
+				nd_push(sk, GFP_KERNEL);
+				err = nd_wait_for_connect(sk, &timeo);
+				if (err != 0)
+					goto out_error;
+			} else
+				copy = min_t(size_t, copy, nsk->sender.sd_grant_nxt - nsk->sender.write_seq);
+		}
 
 		// if (!nd_wmem_schedule(sk, copy)) {
 		// 	WARN_ON_ONCE(true);
 		// 	goto wait_for_memory;
 
 		// } 
-		if(atomic_read(&nsk->sender.in_flight_copy_bytes) > nd_params.ldcopy_tx_inflight_thre || 
-			copied <  nd_params.ldcopy_min_thre || nd_params.nd_num_dc_thread == 0) {
+		/* the completion ring must cover this copy before any part of it completes */
+		if (nd_snd_ring_reserve(sk, nsk->sender.write_seq + copy))
+			goto wait_for_memory;
+		if(nd_copy_local(nsk, nd_snd_inflight_exact(nsk),
+			nd_params.ldcopy_tx_inflight_thre, copied)) {
 			goto local_sender_copy;
 		}
 		next_cpu = nd_dcopy_sche_rr(nsk->sender.nxt_dcopy_cpu);
@@ -748,7 +1066,7 @@ static int nd_sendmsg_new2_locked(struct sock *sk, struct msghdr *msg, size_t le
 		/* remote data copy */
 		/* construct biov and data copy request */
 		bv_arr = kmalloc(MAX_PIN_PAGES * sizeof(struct bio_vec), GFP_KERNEL);
-		blen = nd_dcopy_iov_init(msg, &biter, bv_arr, copy, max_segs);
+		blen = nd_dcopy_iov_init(sk, msg, &biter, bv_arr, copy, max_segs, &region);
 		nr_segs = biter.nr_segs;
 		nsk->sender.pending_queue += blen;
 		if(blen < copy) {
@@ -762,19 +1080,28 @@ static int nd_sendmsg_new2_locked(struct sock *sk, struct msghdr *msg, size_t le
 		request = kzalloc(sizeof(struct nd_dcopy_request) ,GFP_KERNEL);
 		request->state = ND_DCOPY_SEND;
 		request->sk = sk;
+		request->prio_class = nsk->sender.msg_prio;
 		request->io_cpu = nsk->sender.nxt_dcopy_cpu;
 		request->len = blen;
 		request->remain_len = blen;
 		request->seq = nsk->sender.write_seq;
 		request->iter = biter;
 		request->bv_arr = bv_arr;
+		request->region = region;
 		request->max_segs = nr_segs;
+		request->eor = msg_end && !msg_data_left(msg);
+		/* the worker may finish the request before we get it back */
+		if (as) {
+			atomic_inc(&as->pending);
+			as->copied = false;
+			request->async = as;
+		}
 		
 		nd_dcopy_queue_request(request);
 
 		bv_arr = NULL;
 		nr_segs = 0;
-		atomic_add(blen, &nsk->sender.in_flight_copy_bytes);
+		WRITE_ONCE(nsk->sender.copy_issued, nsk->sender.copy_issued + blen);
 		nsk->sender.write_seq += blen;
 		copied += blen;
 		continue;
@@ -790,7 +1117,8 @@ local_sender_copy:
 
 		// }
 // local_sender_copy_skip_schedule:
-		err = nd_sender_local_dcopy(sk, msg, copy, nsk->sender.write_seq, timeo);
+		err = nd_sender_local_dcopy(sk, msg, copy, nsk->sender.write_seq, timeo,
+			msg_end && copy == msg_data_left(msg));
 		if(err != 0)
 			goto out_error;
 		nsk->sender.write_seq += copy;
@@ -804,6 +1132,7 @@ local_sender_copy:
 		}
 		continue;
 wait_for_memory:
+		snd_nxt = nsk->sender.snd_nxt;
 		/* wait for pending requests to be done */
 		sk_wait_sender_data_copy(sk, &timeo);
 		// nd_fetch_dcopy_response(sk);
@@ -814,14 +1143,17 @@ wait_for_memory:
 		if(err == -EDQUOT){
 			// pr_info("add to sleep sock send msg\n");
 			nd_conn_add_sleep_sock(nsk->nd_ctrl, nsk);
-		} 
+		} else if (!err && nsk->sender.snd_nxt != snd_nxt)
+			nd_sndbuf_expand(sk);
 		err = sk_stream_wait_memory(sk, &timeo);
 		// pr_info("end wait \n");
 		if (err) {
 			goto out_error;
 		}
 	}
-	sk_wait_sender_data_copy(sk, &timeo);
+	/* async: the pages stay pinned and tx_work pushes what the workers copy */
+	if (!as)
+		sk_wait_sender_data_copy(sk, &timeo);
 	// nd_fetch_dcopy_response(sk);
 	if (eor) {
 		// if(!skb_queue_empty(&sk->sk_write_queue)) {
@@ -833,6 +1165,8 @@ wait_for_memory:
 		// }
 	}
 
+	if (as)
+		nd_async_send_put(as);
 	// ND_STATS_ADD(nsk->stats.tx_bytes, copied);
 	release_sock(sk);
 	return copied;
@@ -840,6 +1174,9 @@ wait_for_memory:
 out_error:
 	/* wait for pending requests to be done */
 	sk_wait_sender_data_copy(sk, &timeo);
+	/* the id is used up either way; report it so the ids stay in step */
+	if (as)
+		nd_async_send_put(as);
 	/* ToDo: might need to wait as well */
 	// nd_push(sk);
 
@@ -865,6 +1202,8 @@ out_error:
 static int nd_sendmsg_new_locked(struct sock *sk, struct msghdr *msg, size_t len)
 {
 	struct nd_sock *nsk = nd_sk(sk);
+	/* where the channels were before waiting for memory */
+	u32 snd_nxt;
 	// struct sk_buff *skb = NULL;
 	size_t copy, copied = 0;
 	long timeo = sock_sndtimeo(sk, msg->msg_flags & MSG_DONTWAIT);
@@ -877,6 +1216,7 @@ static int nd_sendmsg_new_locked(struct sock *sk, struct msghdr *msg, size_t len
 	struct nd_dcopy_request *request;
 	struct iov_iter biter;
 	struct bio_vec *bv_arr = NULL;
+	struct nd_pin_region *region = NULL;
 	// ssize_t bremain = msg->iter->count, blen;
 	ssize_t blen;
 	int max_segs = MAX_PIN_PAGES;
@@ -903,7 +1243,7 @@ static int nd_sendmsg_new_locked(struct sock *sk, struct msghdr *msg, size_t len
 		}
 
 		/* this part might need to change latter */
-		copy = min_t(int, max_segs * PAGE_SIZE / ND_MAX_SKB_LEN * ND_MAX_SKB_LEN, msg_data_left(msg));
+		copy = min_t(int, max_segs * PAGE_SIZE / nsk->pdu_size * nsk->pdu_size, msg_data_left(msg));
 		if(copy == 0) {
 			WARN_ON(true);
 		}
@@ -912,9 +1252,11 @@ static int nd_sendmsg_new_locked(struct sock *sk, struct msghdr *msg, size_t len
 			goto wait_for_memory;
 
 		}
+		if (nd_snd_ring_reserve(sk, nsk->sender.write_seq + copy))
+			goto wait_for_memory;
 		/* construct biov and data copy request */
 		bv_arr = kmalloc(MAX_PIN_PAGES * sizeof(struct bio_vec), GFP_KERNEL);
-		blen = nd_dcopy_iov_init(msg, &biter, bv_arr, copy, max_segs);
+		blen = nd_dcopy_iov_init(sk, msg, &biter, bv_arr, copy, max_segs, &region);
 		nr_segs = biter.nr_segs;
 		nsk->sender.pending_queue += blen;
 
@@ -922,19 +1264,21 @@ static int nd_sendmsg_new_locked(struct sock *sk, struct msghdr *msg, size_t len
 		request = kzalloc(sizeof(struct nd_dcopy_request) ,GFP_KERNEL);
 		request->state = ND_DCOPY_SEND;
 		request->sk = sk;
+		request->prio_class = nsk->sender.msg_prio;
 		request->io_cpu = nsk->sender.nxt_dcopy_cpu;
 		request->len = blen;
 		request->remain_len = blen;
 		request->seq = nsk->sender.write_seq;
 		request->iter = biter;
 		request->bv_arr = bv_arr;
+		request->region = region;
 		request->max_segs = nr_segs;
 		
 		nd_dcopy_queue_request(request);
 
 		bv_arr = NULL;
 		nr_segs = 0;
-		atomic_add(blen, &nsk->sender.in_flight_copy_bytes);
+		WRITE_ONCE(nsk->sender.copy_issued, nsk->sender.copy_issued + blen);
 		nsk->sender.write_seq += blen;
 
 		copied += blen;
@@ -945,6 +1289,7 @@ static int nd_sendmsg_new_locked(struct sock *sk, struct msghdr *msg, size_t len
 		continue;
 
 wait_for_memory:
+		snd_nxt = nsk->sender.snd_nxt;
 		/* wait for pending requests to be done */
 		sk_wait_sender_data_copy(sk, &timeo);
 		// nd_fetch_dcopy_response(sk);
@@ -955,7 +1300,8 @@ wait_for_memory:
 		if(err == -EDQUOT){
 			// pr_info("add to sleep sock send msg\n");
 			nd_conn_add_sleep_sock(nsk->nd_ctrl, nsk);
-		} 
+		} else if (!err && nsk->sender.snd_nxt != snd_nxt)
+			nd_sndbuf_expand(sk);
 		err = sk_stream_wait_memory(sk, &timeo);
 		// pr_info("end wait \n");
 		if (err) {
@@ -1148,12 +1494,137 @@ out_error:
 	return err;
 }
 
+/* priority class for this sendmsg: an ND_PRIO cmsg overrides sk_priority */
+static int nd_sendmsg_prio(struct sock *sk, struct msghdr *msg)
+{
+	struct cmsghdr *cmsg;
+	int prio = nd_prio_class(sk->sk_priority);
+
+	if (!msg->msg_controllen)
+		return prio;
+	for_each_cmsghdr(cmsg, msg) {
+		if (!CMSG_OK(msg, cmsg))
+			return -EINVAL;
+		if (cmsg->cmsg_level != SOL_VIRTUAL_SOCK || cmsg->cmsg_type != ND_PRIO)
+			continue;
+		if (cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+			return -EINVAL;
+		prio = *(int *)CMSG_DATA(cmsg);
+		if (prio < 0 || prio >= nd_params.num_prio)
+			return -EINVAL;
+	}
+	return prio;
+}
+
+/* ND_DGRAM: the message goes out whole as one DGRAM on a channel to the peer;
+ * no handshake and no grant window, so it is bounded by one skb.
+ */
+static int nd_sendmsg_dgram(struct sock *sk, struct msghdr *msg, size_t len)
+{
+	DECLARE_SOCKADDR(struct sockaddr_in *, usin, msg->msg_name);
+	struct inet_sock *inet = inet_sk(sk);
+	struct nd_sock *nsk = nd_sk(sk);
+	struct nd_conn_ctrl *nd_ctrl;
+	struct nd_conn_request *req;
+	struct page_frag *pfrag;
+	struct sk_buff *skb;
+	struct ndhdr *hdr;
+	size_t copied = 0;
+	int copy, err, i;
+	bool merge;
+
+	if (!usin)
+		return -EDESTADDRREQ;
+	if (msg->msg_namelen < sizeof(*usin))
+		return -EINVAL;
+	if (usin->sin_family != AF_INET)
+		return -EAFNOSUPPORT;
+	if (!len)
+		return -EINVAL;
+	if (len > ND_MAX_SKB_LEN)
+		return -EMSGSIZE;
+	nd_ctrl = nd_conn_find_nd_ctrl(usin->sin_addr.s_addr);
+	if (!nd_ctrl)
+		return -EHOSTUNREACH;
+
+	skb = alloc_skb(0, sk->sk_allocation);
+	if (!skb)
+		return -ENOBUFS;
+	skb->ip_summed = CHECKSUM_PARTIAL;
+	while (copied < len) {
+		pfrag = sk_page_frag(sk);
+		if (!sk_page_frag_refill(sk, pfrag)) {
+			err = -ENOBUFS;
+			goto free_skb;
+		}
+		i = skb_shinfo(skb)->nr_frags;
+		merge = skb_can_coalesce(skb, i, pfrag->page, pfrag->offset);
+		if (!merge && i == MAX_SKB_FRAGS) {
+			err = -EMSGSIZE;
+			goto free_skb;
+		}
+		copy = min_t(size_t, len - copied, pfrag->size - pfrag->offset);
+		err = nd_copy_to_page_nocache(sk, &msg->msg_iter, skb,
+					       pfrag->page, pfrag->offset, copy);
+		if (err)
+			goto free_skb;
+		if (merge) {
+			skb_frag_size_add(&skb_shinfo(skb)->frags[i - 1], copy);
+		} else {
+			skb_fill_page_desc(skb, i, pfrag->page, pfrag->offset, copy);
+			get_page(pfrag->page);
+		}
+		pfrag->offset += copy;
+		copied += copy;
+	}
+
+	req = kzalloc(sizeof(*req), sk->sk_allocation);
+	if (!req) {
+		err = -ENOBUFS;
+		goto free_skb;
+	}
+	err = nd_init_request(sk, req, sk->sk_allocation);
+	if (err)
+		goto free_req;
+	req->prio_class = nsk->sender.msg_prio;
+	/* like udp, a full channel drops rather than blocks */
+	req->queue = nd_conn_sche_dgram(nd_ctrl, nsk, req->prio_class, usin->sin_port);
+	if (!req->queue) {
+		page_frag_free(req->hdr);
+		err = -ENOBUFS;
+		goto free_req;
+	}
+	req->state = ND_CONN_SEND_CMD_PDU;
+	req->skb = skb;
+	hdr = req->hdr;
+	hdr->len = htons(len);
+	hdr->type = DGRAM;
+	hdr->source = inet->inet_sport;
+	hdr->dest = usin->sin_port;
+	hdr->doff = (sizeof(struct ndhdr)) << 2;
+	nd_conn_queue_request(req, nsk, false, true);
+	return len;
+free_req:
+	kfree(req);
+free_skb:
+	kfree_skb(skb);
+	return err;
+}
+
 int nd_sendmsg(struct sock *sk, struct msghdr *msg, size_t len)
 {
 	int ret = 0;
+	int prio = nd_sendmsg_prio(sk, msg);
+
+	if (prio < 0)
+		return prio;
 	lock_sock(sk);
 	// nd_rps_record_flow(sk);
-	ret = nd_sendmsg_new2_locked(sk, msg, len);
+	nd_sk(sk)->sender.msg_prio = prio;
+	if (nd_sk(sk)->dgram)
+		ret = nd_sendmsg_dgram(sk, msg, len);
+	else
+		ret = nd_sendmsg_new2_locked(sk, msg, len);
 	release_sock(sk);
 	return ret;
 }
@@ -1212,18 +1683,16 @@ int nd_init_sock(struct sock *sk)
 {
 	struct nd_sock* dsk = nd_sk(sk);
 	nd_set_state(sk, TCP_CLOSE);
-	skb_queue_head_init(&nd_sk(sk)->reader_queue);
-	dsk->core_id = raw_smp_processor_id();
 	// initialize the ready queue and its lock
 	sk->sk_destruct = nd_destruct_sock;
 	// sk->sk_write_space = sk_stream_write_space;
-	dsk->unsolved = 0;
 	// WRITE_ONCE(dsk->num_sacks, 0);
 
 
 	/* initialize the sndbuf and rcvbuf */
 	WRITE_ONCE(sk->sk_sndbuf, nd_params.wmem_default);
-	WRITE_ONCE(sk->sk_rcvbuf, nd_params.rmem_default);
+	WRITE_ONCE(sk->sk_rcvbuf, nd_params.moderate_buf ?
+		min_t(int, nd_params.rmem_default, ND_RCVBUF_INIT) : nd_params.rmem_default);
 	WRITE_ONCE(dsk->default_win , min_t(uint32_t, nd_params.bdp, READ_ONCE(sk->sk_rcvbuf)));
 
 	// INIT_LIST_HEAD(&dsk->match_link);
@@ -1238,25 +1707,50 @@ int nd_init_sock(struct sock *sk)
 	WRITE_ONCE(dsk->sender.pending_req, NULL);
 	WRITE_ONCE(dsk->sender.nxt_dcopy_cpu, -1);	
 	WRITE_ONCE(dsk->sender.pending_queue, 0);
+	WRITE_ONCE(dsk->sender.async_id, 0);
+	WRITE_ONCE(dsk->sender.copy_issued, 0);
+	atomic_set(&dsk->sender.copy_done, 0);
     init_llist_head(&dsk->sender.response_list);
-	WRITE_ONCE(dsk->sender.sd_grant_nxt, dsk->default_win);
+	/* allocated by the first sendmsg; nd_init_sock may run in softirq */
+	WRITE_ONCE(dsk->sender.snd_ring, NULL);
+	WRITE_ONCE(dsk->sender.snd_ring_mask, 0);
+	WRITE_ONCE(dsk->sender.sd_grant_nxt, nd_grant_init_win(dsk));
 	WRITE_ONCE(dsk->sender.con_queue_id, 0);
 	WRITE_ONCE(dsk->sender.con_accumu_count, 0);
+	WRITE_ONCE(dsk->sender.con_last_ticket, 0);
+	WRITE_ONCE(dsk->sender.con_last_ns, 0);
+	WRITE_ONCE(dsk->sender.msg_prio, 0);
+	WRITE_ONCE(dsk->sender.sndbuf_time, 0);
+	INIT_LIST_HEAD(&dsk->sender.match_link);
+	RB_CLEAR_NODE(&dsk->sender.match_node);
+	WRITE_ONCE(dsk->sender.match_epoch, 0);
 
 	atomic_set(&dsk->receiver.rcv_nxt, 0);
-	WRITE_ONCE(dsk->receiver.last_ack, 0);
 	atomic_set(&dsk->receiver.copied_seq, 0);
-	WRITE_ONCE(dsk->receiver.grant_nxt, dsk->default_win);
+	WRITE_ONCE(dsk->receiver.grant_nxt, nd_grant_init_win(dsk));
+	RB_CLEAR_NODE(&dsk->receiver.grant_link);
+	WRITE_ONCE(dsk->receiver.adv_seq, 0);
+	WRITE_ONCE(dsk->receiver.grant_remaining, 0);
+	RB_CLEAR_NODE(&dsk->receiver.match_node);
+	WRITE_ONCE(dsk->receiver.match_epoch, 0);
 	WRITE_ONCE(dsk->receiver.nxt_dcopy_cpu, nd_params.data_cpy_core);
-	WRITE_ONCE(dsk->receiver.rmem_exhausted, 0);
-	WRITE_ONCE(dsk->receiver.prev_grant_bytes, 0);
+	dsk->receiver.rcvq_space.space = 0;
+	dsk->receiver.rcvq_space.seq = 0;
+	dsk->receiver.rcvq_space.time = ktime_get_ns();
 	INIT_LIST_HEAD(&dsk->receiver.hol_channel_list);
 	skb_queue_head_init(&dsk->receiver.sk_hol_queue);
 
-	atomic_set(&dsk->receiver.in_flight_copy_bytes, 0);
+	WRITE_ONCE(dsk->receiver.copy_issued, 0);
+	atomic_set(&dsk->receiver.copy_done, 0);
 	dsk->receiver.free_skb_num = 0;
 	init_llist_head(&dsk->receiver.clean_page_list);
 	WRITE_ONCE(dsk->sche_policy, nd_params.nd_default_sche_policy);
+	WRITE_ONCE(dsk->copy_mode, ND_COPY_AUTO);
+	WRITE_ONCE(dsk->pdu_size, ND_MAX_SKB_LEN);
+	WRITE_ONCE(dsk->chan_first, 0);
+	WRITE_ONCE(dsk->chan_count, 0);
+	WRITE_ONCE(dsk->dgram, 0);
+	WRITE_ONCE(dsk->msg_mode, 0);
 
 	kfree_skb(sk->sk_tx_skb_cache);
 	sk->sk_tx_skb_cache = NULL;
@@ -1672,6 +2166,46 @@ EXPORT_SYMBOL(nd_ioctl);
 // // 	goto out;
 // }
 
+/* ND_DGRAM: one message per call, truncated like udp */
+static int nd_recvmsg_dgram(struct sock *sk, struct msghdr *msg, size_t len, int nonblock,
+		int flags, int *addr_len)
+{
+	DECLARE_SOCKADDR(struct sockaddr_in *, sin, msg->msg_name);
+	struct sk_buff *skb;
+	int copied, err;
+
+	skb = skb_recv_datagram(sk, flags, nonblock, &err);
+	if (!skb)
+		return err;
+	copied = min_t(size_t, len, skb->len);
+	if (copied < skb->len)
+		msg->msg_flags |= MSG_TRUNC;
+	err = skb_copy_datagram_msg(skb, 0, msg, copied);
+	if (err)
+		goto out;
+	if (sin) {
+		sin->sin_family = AF_INET;
+		sin->sin_port = ND_SKB_CB(skb)->sport;
+		sin->sin_addr.s_addr = ND_SKB_CB(skb)->saddr;
+		memset(sin->sin_zero, 0, sizeof(sin->sin_zero));
+		*addr_len = sizeof(*sin);
+	}
+	err = (flags & MSG_TRUNC) ? skb->len : copied;
+out:
+	skb_free_datagram(sk, skb);
+	return err;
+}
+
+/* hand a request of receive extents to its dcopy worker; the workers are
+ * kicked once per batch, see nd_dcopy_batch_flush()
+ */
+static void nd_dcopy_queue_recv(struct nd_sock *dsk, struct nd_dcopy_batch *batch,
+	struct nd_dcopy_request *request)
+{
+	WRITE_ONCE(dsk->receiver.copy_issued, dsk->receiver.copy_issued + request->len);
+	nd_dcopy_batch_add(batch, request);
+}
+
 int nd_recvmsg_new_2(struct sock *sk, struct msghdr *msg, size_t len, int nonblock,
 		int flags, int *addr_len)
 {
@@ -1685,17 +2219,32 @@ int nd_recvmsg_new_2(struct sock *sk, struct msghdr *msg, size_t len, int nonblo
 	int target;		/* Read at least this many bytes */
 	long timeo;
 	struct sk_buff *skb, *last, *tmp;
-	struct nd_dcopy_request *request;
+	struct nd_dcopy_request *request = NULL;
+	struct nd_dcopy_batch batch = {};
+	struct nd_dcopy_extent *ext;
 	/* hardcode for now */ 
 	struct iov_iter biter;
 	struct bio_vec *bv_arr = NULL;
+	struct nd_pin_region *region = NULL;
+	struct nd_dcopy_window *win = NULL;
 	ssize_t blen = 0;
 	int max_segs = MAX_PIN_PAGES;
 	int nr_segs = 0;
-	int qid;
 	int next_cpu;
+	/* every request of one pinned window goes to the same dcopy lane */
+	int win_prio = 0;
 	bool in_remote_cpy;
-	target = sock_rcvlowat(sk, flags & MSG_WAITALL, len);
+	bool msg_mode = READ_ONCE(dsk->msg_mode);
+	bool msg_end = false;
+	/* a buffer this large is not read back from the cache anyway */
+	bool stream = nd_params.copy_nt_thresh && len >= (size_t)nd_params.copy_nt_thresh;
+	/* MSG_ND_ASYNC completions */
+	if (unlikely(flags & MSG_ERRQUEUE))
+		return ip_recv_error(sk, msg, len, addr_len);
+	if (READ_ONCE(dsk->dgram))
+		return nd_recvmsg_dgram(sk, msg, len, nonblock, flags, addr_len);
+	/* message mode: fill the buffer or stop at the end of a message */
+	target = msg_mode ? len : sock_rcvlowat(sk, flags & MSG_WAITALL, len);
 
 	if (sk_can_busy_loop(sk) && skb_queue_empty_lockless(&sk->sk_receive_queue) &&
 	    (sk->sk_state == ND_ESTABLISH))
@@ -1750,6 +2299,13 @@ int nd_recvmsg_new_2(struct sock *sk, struct msghdr *msg, size_t len, int nonblo
 		}
 
 
+		/* no more data for now: let the workers start on what we have */
+		if (request) {
+			nd_dcopy_queue_recv(dsk, &batch, request);
+			request = NULL;
+		}
+		nd_dcopy_batch_flush(&batch);
+
 		/* ToDo: we have to check whether pending requests are done */
 		/* Well, if we have backlog, try to process it now yet. */
 
@@ -1825,8 +2381,8 @@ found_ok_skb:
 			}
 
 			/* check the current CPU util */
-			if(atomic_read(&dsk->receiver.in_flight_copy_bytes) > nd_params.ldcopy_rx_inflight_thre || 
-				copied <  nd_params.ldcopy_min_thre || nd_params.nd_num_dc_thread == 0){
+			if(nd_copy_local(dsk, nd_rcv_inflight_exact(dsk),
+				nd_params.ldcopy_rx_inflight_thre, copied)){
 				/* do local */
 				in_remote_cpy = false;
 				goto local_copy;
@@ -1845,39 +2401,59 @@ found_ok_skb:
 			// printk("dsk->receiver.nxt_dcopy_cpu:%d\n", dsk->receiver.nxt_dcopy_cpu);
 pin_user_page:
 			bv_arr = kmalloc(MAX_PIN_PAGES * sizeof(struct bio_vec), GFP_KERNEL);
-			blen = nd_dcopy_iov_init(msg, &biter, bv_arr, bsize, max_segs);
+			blen = nd_dcopy_iov_init(sk, msg, &biter, bv_arr, bsize, max_segs, &region);
 			nr_segs = biter.nr_segs;
+			win_prio = ND_SKB_CB(skb)->prio_class;
+			win = kmalloc(sizeof(*win), GFP_KERNEL);
+			win->bv_arr = bv_arr;
+			win->region = region;
+			win->max_segs = nr_segs;
+			atomic_set(&win->pending, 1);
 		} 
 
 		if(!in_remote_cpy || blen == 0) {
 			WARN_ON_ONCE(true);
+			if (win && nd_dcopy_window_put(win))
+				nd_dcopy_window_release(win);
+			win = NULL;
 			goto local_copy;
 		}
 		
 		/* do remote data copy */
 		if(blen < used && blen > 0)
 			used = blen;
-		/* construct data copy request */
-		request = kzalloc(sizeof(struct nd_dcopy_request) ,GFP_KERNEL);
-		request->state = ND_DCOPY_RECV;
-		request->sk = sk;
-		request->clean_skb = (used + offset == skb->len);
-		request->io_cpu = dsk->receiver.nxt_dcopy_cpu;
-		request->skb = skb;
-		request->offset = offset;
-		request->len = used;
-		request->remain_len = used;
-		// dup_iter(&request->iter, &biter, GFP_KERNEL);
-		request->iter = biter;
+		/* one request carries every extent of the pinned window */
+		if (!request) {
+			request = kzalloc(struct_size(request, ext, ND_DCOPY_MAX_EXTENTS), GFP_KERNEL);
+			request->state = ND_DCOPY_RECV;
+			request->sk = sk;
+			request->prio_class = win_prio;
+			request->nt = stream;
+			request->io_cpu = dsk->receiver.nxt_dcopy_cpu;
+			// dup_iter(&request->iter, &biter, GFP_KERNEL);
+			request->iter = biter;
+			request->win = win;
+			atomic_inc(&win->pending);
+		}
+		ext = &request->ext[request->nr_ext++];
+		ext->skb = skb;
+		ext->offset = offset;
+		ext->len = used;
+		ext->clean_skb = (used + offset == skb->len);
+		request->len += used;
+		request->remain_len += used;
 		// printk("queue_request:%d len:%d \n", dsk->receiver.nxt_dcopy_cpu, used);
 		/* update the biter */
 		iov_iter_advance(&biter, used);
 		blen -= used;
 
 		if(blen == 0) {
-			request->bv_arr = bv_arr;
-			request->max_segs = nr_segs;
+			/* the window is full; its last request releases it */
+			if (nd_dcopy_window_put(win))
+				nd_dcopy_window_release(win);
+			win = NULL;
 			bv_arr = NULL;
+			region = NULL;
 			nr_segs = 0;
 		}
 		atomic_set(&dsk->receiver.copied_seq, atomic_read(&dsk->receiver.copied_seq) + used);
@@ -1888,15 +2464,19 @@ pin_user_page:
 			goto queue_request;
 		// pr_info("copied_seq:%d\n", seq);
 		WARN_ON(used + offset > skb->len);
+		msg_end = msg_mode && ND_SKB_CB(skb)->eor;
 		__skb_unlink(skb, &sk->sk_receive_queue);
 		// atomic_sub(skb->truesize, &sk->sk_rmem_alloc);
 		// kfree_skb(skb);
 
 queue_request:
-		atomic_add(used, &dsk->receiver.in_flight_copy_bytes);
-		/* queue the data copy request */
-		
-		qid = nd_dcopy_queue_request(request);
+		/* the window is filled or the request is full; later extents
+		 * and the end of recvmsg flush it otherwise.
+		 */
+		if (blen == 0 || request->nr_ext == ND_DCOPY_MAX_EXTENTS) {
+			nd_dcopy_queue_recv(dsk, &batch, request);
+			request = NULL;
+		}
 		// if(dsk->receiver.nxt_dcopy_cpu == -1) {
 		// 	dsk->receiver.nxt_dcopy_cpu = qid;
 		// 	// printk("new qid:%d\n", qid);
@@ -1933,11 +2513,17 @@ local_copy:
 		len -= used;
 		if (used + offset < skb->len)
 			continue;
+		msg_end = msg_mode && ND_SKB_CB(skb)->eor;
 		__skb_unlink(skb, &sk->sk_receive_queue);
 		// atomic_sub(skb->truesize, &sk->sk_rmem_alloc);
 		kfree_skb(skb);
 		/* might need to call clean pages here */
-	} while (len > 0);
+	} while (len > 0 && !msg_end);
+	if (request)
+		nd_dcopy_queue_recv(dsk, &batch, request);
+	nd_dcopy_batch_flush(&batch);
+	if (msg_end)
+		msg->msg_flags |= MSG_EOR;
 	
 	/* free the bvec memory */
 
@@ -1948,10 +2534,13 @@ local_copy:
 	 	/* waiting data copy to be finishede */
 	// while(atomic_read(&nsk->receiver.in_flight_copy_bytes) != 0) {
 	sk_wait_data_copy(sk, &timeo);
-	if(bv_arr) {
-		nd_release_pages(bv_arr, true, nr_segs);
-		kfree(bv_arr);
-	}
+	/* a partly used window; every request copying into it is done */
+	if(win && nd_dcopy_window_put(win))
+		nd_dcopy_window_release(win);
+	nd_rcv_space_adjust(sk);
+	/* the window may have reopened */
+	if (nd_params.grant_sched == ND_GRANT_SRPT && copied > 0)
+		nd_grant_sched_update(sk);
 
 	// nd_try_send_ack(sk, copied);
 	release_sock(sk);
@@ -2348,6 +2937,14 @@ int nd_rcv(struct sk_buff *skb)
 		return nd_handle_ack_pkt(skb);
 	} else if (dh->type == SYNC_ACK) {
 		return nd_handle_sync_ack_pkt(skb);
+	} else if (dh->type == RTS) {
+		return nd_handle_rts_pkt(skb);
+	} else if (dh->type == GRANT) {
+		return nd_handle_grant_pkt(skb);
+	} else if (dh->type == ACCEPT) {
+		return nd_handle_accept_pkt(skb);
+	} else if (dh->type == DGRAM) {
+		return nd_handle_dgram_pkt(skb);
 	}
 
 drop:
@@ -2374,11 +2971,13 @@ void nd_destroy_sock(struct sock *sk)
 	// hrtimer_cancel(&up->receiver.flow_wait_timer);
 	// test_and_clear_bit(ND_WAIT_DEFERRED, &sk->sk_tsq_flags);
 	lock_sock(sk);
+	/* MSG_ND_ASYNC copies still reference the socket; flush them before the fin */
+	sk_wait_sender_data_copy(sk, NULL);
 	local_bh_disable();
 	bh_lock_sock(sk);
 	up->receiver.flow_finish_wait = false;
 	if(sk->sk_state == ND_ESTABLISH) {
-		nd_conn_queue_request(construct_fin_req(sk), up, false, true, true);
+		nd_conn_queue_request(construct_fin_req(sk), up, false, true);
 		// nd_xmit_control(construct_fin_pkt(sk), sk, inet->inet_dport); 
 	}      
 	// printk("reach here:%d", __LINE__);
@@ -2388,6 +2987,8 @@ void nd_destroy_sock(struct sock *sk)
 	// pr_info("up->receiver.grant_nxt:%u\n", up->receiver.grant_nxt);
 	// pr_info("up->receiver.free_skb_num:%llu\n", up->receiver.free_skb_num);
 	nd_set_state(sk, TCP_CLOSE);
+	nd_grant_sched_remove(sk);
+	nd_match_remove(sk);
 	// nd_flush_pendfing_frames(sk);
 	if(up->sender.pending_req) {
 		// pr_info("up->sender.pending_req seq:%u\n", ND_SKB_CB(up->sender.pending_req->skb)->seq);
@@ -2409,11 +3010,7 @@ void nd_destroy_sock(struct sock *sk)
 	
 	list_for_each_entry_safe(entry, temp, &up->receiver.hol_channel_list, list_link) {
 		queue = entry->queue;
-		if(ndt_conn_is_latency(queue)) {
-			queue_work_on(queue_cpu(queue), ndt_conn_wq_lat, &queue->io_work);
-		} else {
-			queue_work_on(queue_cpu(queue), ndt_conn_wq, &queue->io_work);
-		}
+		queue_work_on(queue_cpu(queue), ndt_conn_prio_wq(queue), &queue->io_work);
 		kfree(entry);
 	}
 	bh_unlock_sock(sk);
@@ -2422,6 +3019,12 @@ void nd_destroy_sock(struct sock *sk)
 	/* remove from sleep wait queue */
 	nd_conn_remove_sleep_sock(up->sender.wait_queue, up);
 	cancel_work_sync(&up->tx_work);
+	nd_pin_cache_release(sk);
+	if (up->hpool) {
+		nd_hpage_pool_destroy(up->hpool);
+		kfree(up->hpool);
+		up->hpool = NULL;
+	}
 	/*  */
 	// bh_unlock_sock(sk);
 	// local_bh_enable();
@@ -2445,21 +3048,115 @@ void nd_destroy_sock(struct sock *sk)
 }
 
 
+/* copy the per-socket knobs of a listener to a newly accepted socket */
+void nd_inherit_sockopts(struct sock *parent, struct sock *child)
+{
+	struct nd_sock *psk = nd_sk(parent), *csk = nd_sk(child);
+
+	WRITE_ONCE(csk->sche_policy, psk->sche_policy);
+	WRITE_ONCE(csk->copy_mode, psk->copy_mode);
+	WRITE_ONCE(csk->pdu_size, psk->pdu_size);
+	WRITE_ONCE(csk->chan_first, psk->chan_first);
+	WRITE_ONCE(csk->chan_count, psk->chan_count);
+	WRITE_ONCE(csk->msg_mode, psk->msg_mode);
+	WRITE_ONCE(csk->default_win, psk->default_win);
+	WRITE_ONCE(csk->sender.sd_grant_nxt, nd_grant_init_win(csk));
+	WRITE_ONCE(csk->receiver.grant_nxt, nd_grant_init_win(csk));
+}
+
+static int nd_lib_setsockopt_int(struct sock *sk, int optname, int val)
+{
+	struct nd_sock *nsk = nd_sk(sk);
+	int err;
+
+	switch (optname) {
+	case ND_SCHE_POLICY:
+		if (val != SCHE_RR && val != SCHE_SRC_PORT && val != SCHE_FLOWLET)
+			return -EINVAL;
+		/* a request parked on a channel keeps that channel */
+		WRITE_ONCE(nsk->sche_policy, val);
+		return 0;
+	case ND_COPY_MODE:
+		if (val != ND_COPY_AUTO && val != ND_COPY_LOCAL && val != ND_COPY_REMOTE)
+			return -EINVAL;
+		WRITE_ONCE(nsk->copy_mode, val);
+		return 0;
+	case ND_PDU_SIZE:
+		if (val < ND_MIN_PDU_SIZE || val > ND_MAX_SKB_LEN)
+			return -EINVAL;
+		WRITE_ONCE(nsk->pdu_size, val);
+		return 0;
+	case ND_GRANT_WIN:
+		/* set before the handshake: the receiver's initial grant derives from it and
+		 * travels in the SYNC_ACK; later grants are taken up to rmem_max, see
+		 * nd_grant_acceptable(), so the two ends need not agree on it.
+		 */
+		if (sk->sk_state != TCP_CLOSE && sk->sk_state != ND_LISTEN)
+			return -EISCONN;
+		if (val < ND_MAX_SKB_LEN || val > nd_params.rmem_max)
+			return -EINVAL;
+		/* the window is bounded by rcvbuf in nd_window_size */
+		if (val > READ_ONCE(sk->sk_rcvbuf))
+			WRITE_ONCE(sk->sk_rcvbuf, val);
+		WRITE_ONCE(nsk->default_win, val);
+		WRITE_ONCE(nsk->sender.sd_grant_nxt, nsk->sender.snd_una + nd_grant_init_win(nsk));
+		WRITE_ONCE(nsk->receiver.grant_nxt, (u32)atomic_read(&nsk->receiver.rcv_nxt) + nd_grant_init_win(nsk));
+		return 0;
+	case ND_MSG_MODE:
+		/* takes effect from the next sendmsg/recvmsg */
+		WRITE_ONCE(nsk->msg_mode, !!val);
+		return 0;
+	case ND_DGRAM:
+		if (!val)
+			return nsk->dgram ? -EINVAL : 0;
+		if (nsk->dgram)
+			return 0;
+		if (sk->sk_state != TCP_CLOSE)
+			return -EISCONN;
+		/* hashed like a listener so the port demuxes incoming messages */
+		WRITE_ONCE(nsk->dgram, 1);
+		err = nd_listen_start(sk, 0);
+		if (err)
+			WRITE_ONCE(nsk->dgram, 0);
+		return err;
+	}
+	return -ENOPROTOOPT;
+}
+
 int nd_setsockopt(struct sock *sk, int level, int optname,
 		   char __user *optval, unsigned int optlen)
 {
-	int val;
+	struct nd_sock *nsk = nd_sk(sk);
+	struct nd_channel_set set;
+	int val, err;
+
+	if (level == SOL_IP)
+		return ip_setsockopt(sk, level, optname, optval, optlen);
+	if (level != SOL_VIRTUAL_SOCK)
+		return -ENOPROTOOPT;
+	if (optname == ND_CHANNELS) {
+		if (optlen < sizeof(set))
+			return -EINVAL;
+		if (copy_from_user(&set, optval, sizeof(set)))
+			return -EFAULT;
+		if (set.count < 0 || (set.count > 0 && (set.first < 0 ||
+			set.first >= nd_params.total_channels ||
+			set.count > nd_params.total_channels - set.first)))
+			return -EINVAL;
+		lock_sock(sk);
+		WRITE_ONCE(nsk->chan_first, set.count ? set.first : 0);
+		WRITE_ONCE(nsk->chan_count, set.count);
+		release_sock(sk);
+		return 0;
+	}
+	if (optlen < sizeof(int))
+		return -EINVAL;
 	if (get_user(val, (int __user *)optval))
 		return -EFAULT;
-	printk(KERN_WARNING "unimplemented setsockopt invoked on ND socket:"
-			" level %d, optname %d, optlen %d\n",
-			level, optname, optlen);
-	return 0;
-	return -EINVAL;
-	// if (level == SOL_VIRTUAL_SOCK)
-	// 	return nd_lib_setsockopt(sk, level, optname, optval, optlen,
-	// 				  nd_push_pending_frames);
-	// return ip_setsockopt(sk, level, optname, optval, optlen);
+	lock_sock(sk);
+	err = nd_lib_setsockopt_int(sk, optname, val);
+	release_sock(sk);
+	return err;
 }
 
 // #ifdef CONFIG_COMPAT
@@ -2476,18 +3173,58 @@ int nd_setsockopt(struct sock *sk, int level, int optname,
 int nd_lib_getsockopt(struct sock *sk, int level, int optname,
 		       char __user *optval, int __user *optlen)
 {
-	printk(KERN_WARNING "unimplemented getsockopt invoked on ND socket:"
-			" level %d, optname %d\n", level, optname);
-	return -EINVAL;
+	struct nd_sock *nsk = nd_sk(sk);
+	struct nd_channel_set set;
+	int val, len;
+
+	if (get_user(len, optlen))
+		return -EFAULT;
+	if (len < 0)
+		return -EINVAL;
+	switch (optname) {
+	case ND_SCHE_POLICY:
+		val = READ_ONCE(nsk->sche_policy);
+		break;
+	case ND_COPY_MODE:
+		val = READ_ONCE(nsk->copy_mode);
+		break;
+	case ND_PDU_SIZE:
+		val = READ_ONCE(nsk->pdu_size);
+		break;
+	case ND_GRANT_WIN:
+		val = READ_ONCE(nsk->default_win);
+		break;
+	case ND_DGRAM:
+		val = READ_ONCE(nsk->dgram);
+		break;
+	case ND_MSG_MODE:
+		val = READ_ONCE(nsk->msg_mode);
+		break;
+	case ND_CHANNELS:
+		set.first = READ_ONCE(nsk->chan_first);
+		set.count = READ_ONCE(nsk->chan_count);
+		len = min_t(unsigned int, len, sizeof(set));
+		if (put_user(len, optlen) || copy_to_user(optval, &set, len))
+			return -EFAULT;
+		return 0;
+	default:
+		return -ENOPROTOOPT;
+	}
+	len = min_t(unsigned int, len, sizeof(int));
+	if (put_user(len, optlen) || copy_to_user(optval, &val, len))
+		return -EFAULT;
+	return 0;
 }
 EXPORT_SYMBOL(nd_lib_getsockopt);
 
 int nd_getsockopt(struct sock *sk, int level, int optname,
 		   char __user *optval, int __user *optlen)
 {
-	printk(KERN_WARNING "unimplemented getsockopt invoked on ND socket:"
-			" level %d, optname %d\n", level, optname);
-	return -EINVAL;
+	if (level == SOL_VIRTUAL_SOCK)
+		return nd_lib_getsockopt(sk, level, optname, optval, optlen);
+	if (level == SOL_IP)
+		return ip_getsockopt(sk, level, optname, optval, optlen);
+	return -ENOPROTOOPT;
 }
 
 // __poll_t nd_poll(struct file *file, struct socket *sock, poll_table *wait)
@@ -2538,7 +3275,7 @@ static inline bool nd_stream_is_readable(const struct nd_sock *nsk,
 					  int target, struct sock *sk)
 {
 	return  ((u32)atomic_read(&nsk->receiver.rcv_nxt) - (u32)atomic_read(&nsk->receiver.copied_seq))
-			 - (u32)atomic_read(&nsk->receiver.in_flight_copy_bytes);
+			 - (u32)nd_rcv_inflight_approx(nsk);
 }
 
 __poll_t nd_poll(struct file *file, struct socket *sock,
@@ -2549,6 +3286,13 @@ __poll_t nd_poll(struct file *file, struct socket *sock,
 		int state = smp_load_acquire(&sk->sk_state);
 		// int target = sock_rcvlowat(sk, 0, INT_MAX);	
 		sock_poll_wait(file, sock, wait);
+		if(READ_ONCE(nsk->dgram)) {
+			/* channels drop rather than block a datagram; always writable */
+			mask = EPOLLOUT | EPOLLWRNORM | EPOLLWRBAND;
+			if(!skb_queue_empty_lockless(&sk->sk_receive_queue))
+				mask |= EPOLLIN | EPOLLRDNORM;
+			return mask;
+		}
 		if(state == ND_LISTEN) {
 			if(!reqsk_queue_empty(&nsk->icsk_accept_queue)) 
 				return EPOLLIN | EPOLLRDNORM;
@@ -2556,6 +3300,8 @@ __poll_t nd_poll(struct file *file, struct socket *sock,
 				return 0;
 		}
 		/* copy from datagram poll*/
+		if (sk->sk_err || !skb_queue_empty_lockless(&sk->sk_error_queue))
+			mask |= EPOLLERR;
 		if (sk->sk_shutdown & RCV_SHUTDOWN)
 			mask |= EPOLLRDHUP | EPOLLIN | EPOLLRDNORM;
 		if (sk->sk_shutdown == SHUTDOWN_MASK)
@@ -0,0 +1,267 @@
+/*
+ * Copy kernels of the dcopy workers.
+ *
+ * The dcopy cores do nothing but copy between skbs and pinned user pages,
+ * so they use the widest vector stores the cpu has. Streaming stores are
+ * used when the destination is not read by the cpu soon (frag pages of
+ * outgoing skbs, large receive buffers), cached stores otherwise.
+ * nd_params.copy_engine selects the kernel; ND_COPY_ENGINE_GENERIC keeps
+ * the stock skb/iov_iter helpers.
+ */
+#include <linux/highmem.h>
+#include <linux/skbuff.h>
+#include <linux/uio.h>
+#ifdef CONFIG_X86_64
+#include <asm/fpu/api.h>
+#include <asm/simd.h>
+#endif
+
+#include "nd_data_copy.h"
+#include "nd_impl.h"
+
+/* below this the fpu save/restore costs more than the wide stores save */
+#define ND_COPY_ENGINE_MIN	512
+
+#ifdef CONFIG_X86_64
+static void nd_copy_avx2(void *dst, const void *src, size_t len, bool nt)
+{
+	u8 *d = dst;
+	const u8 *s = src;
+	size_t head;
+
+	if (nt) {
+		/* streaming stores need a 32-byte aligned destination */
+		head = min_t(size_t, -(unsigned long)d & 31, len);
+		memcpy(d, s, head);
+		d += head;
+		s += head;
+		len -= head;
+		for (; len >= 128; d += 128, s += 128, len -= 128)
+			asm volatile(
+				"vmovdqu    0(%[s]), %%ymm0\n\t"
+				"vmovdqu   32(%[s]), %%ymm1\n\t"
+				"vmovdqu   64(%[s]), %%ymm2\n\t"
+				"vmovdqu   96(%[s]), %%ymm3\n\t"
+				"vmovntdq  %%ymm0,  0(%[d])\n\t"
+				"vmovntdq  %%ymm1, 32(%[d])\n\t"
+				"vmovntdq  %%ymm2, 64(%[d])\n\t"
+				"vmovntdq  %%ymm3, 96(%[d])\n\t"
+				: : [d] "r" (d), [s] "r" (s) : "memory");
+		/* order the streaming stores before the data is handed on */
+		asm volatile("sfence" : : : "memory");
+	} else {
+		for (; len >= 128; d += 128, s += 128, len -= 128)
+			asm volatile(
+				"vmovdqu    0(%[s]), %%ymm0\n\t"
+				"vmovdqu   32(%[s]), %%ymm1\n\t"
+				"vmovdqu   64(%[s]), %%ymm2\n\t"
+				"vmovdqu   96(%[s]), %%ymm3\n\t"
+				"vmovdqu   %%ymm0,  0(%[d])\n\t"
+				"vmovdqu   %%ymm1, 32(%[d])\n\t"
+				"vmovdqu   %%ymm2, 64(%[d])\n\t"
+				"vmovdqu   %%ymm3, 96(%[d])\n\t"
+				: : [d] "r" (d), [s] "r" (s) : "memory");
+	}
+	memcpy(d, s, len);
+}
+
+#ifdef CONFIG_AS_AVX512
+static void nd_copy_avx512(void *dst, const void *src, size_t len, bool nt)
+{
+	u8 *d = dst;
+	const u8 *s = src;
+	size_t head;
+
+	if (nt) {
+		/* streaming stores need a 64-byte aligned destination */
+		head = min_t(size_t, -(unsigned long)d & 63, len);
+		memcpy(d, s, head);
+		d += head;
+		s += head;
+		len -= head;
+		for (; len >= 256; d += 256, s += 256, len -= 256)
+			asm volatile(
+				"vmovdqu64    0(%[s]), %%zmm0\n\t"
+				"vmovdqu64   64(%[s]), %%zmm1\n\t"
+				"vmovdqu64  128(%[s]), %%zmm2\n\t"
+				"vmovdqu64  192(%[s]), %%zmm3\n\t"
+				"vmovntdq   %%zmm0,   0(%[d])\n\t"
+				"vmovntdq   %%zmm1,  64(%[d])\n\t"
+				"vmovntdq   %%zmm2, 128(%[d])\n\t"
+				"vmovntdq   %%zmm3, 192(%[d])\n\t"
+				: : [d] "r" (d), [s] "r" (s) : "memory");
+		asm volatile("sfence" : : : "memory");
+	} else {
+		for (; len >= 256; d += 256, s += 256, len -= 256)
+			asm volatile(
+				"vmovdqu64    0(%[s]), %%zmm0\n\t"
+				"vmovdqu64   64(%[s]), %%zmm1\n\t"
+				"vmovdqu64  128(%[s]), %%zmm2\n\t"
+				"vmovdqu64  192(%[s]), %%zmm3\n\t"
+				"vmovdqu64  %%zmm0,   0(%[d])\n\t"
+				"vmovdqu64  %%zmm1,  64(%[d])\n\t"
+				"vmovdqu64  %%zmm2, 128(%[d])\n\t"
+				"vmovdqu64  %%zmm3, 192(%[d])\n\t"
+				: : [d] "r" (d), [s] "r" (s) : "memory");
+	}
+	memcpy(d, s, len);
+}
+#endif
+
+/* one page at most; called between kernel_fpu_begin() and kernel_fpu_end() */
+static inline void nd_copy_chunk(int engine, void *dst, const void *src,
+	size_t len, bool nt)
+{
+	switch (engine) {
+#ifdef CONFIG_AS_AVX512
+	case ND_COPY_ENGINE_AVX512:
+		nd_copy_avx512(dst, src, len, nt);
+		break;
+#endif
+	case ND_COPY_ENGINE_AVX2:
+		nd_copy_avx2(dst, src, len, nt);
+		break;
+	default:
+		memcpy(dst, src, len);
+	}
+}
+
+/* copy into the pages of a bvec iterator and advance it; preemption is only
+ * held off for one page at a time, and after the first page the fpu state is
+ * already saved, so each begin/end pair is cheap
+ */
+static size_t nd_copy_to_bvec(int engine, struct iov_iter *to,
+	const u8 *src, size_t len, bool nt)
+{
+	size_t done = 0, off, n;
+	u8 *vaddr;
+
+	while (done < len && iov_iter_count(to)) {
+		const struct bio_vec *bv = to->bvec;
+
+		off = bv->bv_offset + to->iov_offset;
+		n = min_t(size_t, len - done, bv->bv_len - to->iov_offset);
+		n = min_t(size_t, n, PAGE_SIZE - offset_in_page(off));
+		kernel_fpu_begin();
+		vaddr = kmap_atomic(bv->bv_page + (off >> PAGE_SHIFT));
+		nd_copy_chunk(engine, vaddr + offset_in_page(off), src + done, n, nt);
+		kunmap_atomic(vaddr);
+		kernel_fpu_end();
+		iov_iter_advance(to, n);
+		done += n;
+	}
+	return done;
+}
+
+/* copy out of the pages of a bvec iterator and advance it */
+static size_t nd_copy_from_bvec(int engine, u8 *dst, struct iov_iter *from,
+	size_t len, bool nt)
+{
+	size_t done = 0, off, n;
+	u8 *vaddr;
+
+	while (done < len && iov_iter_count(from)) {
+		const struct bio_vec *bv = from->bvec;
+
+		off = bv->bv_offset + from->iov_offset;
+		n = min_t(size_t, len - done, bv->bv_len - from->iov_offset);
+		n = min_t(size_t, n, PAGE_SIZE - offset_in_page(off));
+		kernel_fpu_begin();
+		vaddr = kmap_atomic(bv->bv_page + (off >> PAGE_SHIFT));
+		nd_copy_chunk(engine, dst + done, vaddr + offset_in_page(off), n, nt);
+		kunmap_atomic(vaddr);
+		kernel_fpu_end();
+		iov_iter_advance(from, n);
+		done += n;
+	}
+	return done;
+}
+#endif /* CONFIG_X86_64 */
+
+/**
+ * nd_copy_engine_select() - the copy engine to use for a requested one
+ * @want: one of ND_COPY_ENGINE_*
+ *
+ * Return: @want if the cpu supports it, otherwise the widest engine below
+ * it that does; ND_COPY_ENGINE_AUTO resolves to the widest available.
+ */
+int nd_copy_engine_select(int want)
+{
+	int best = ND_COPY_ENGINE_GENERIC;
+
+#ifdef CONFIG_X86_64
+	if (boot_cpu_has(X86_FEATURE_AVX2) &&
+		cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM, NULL))
+		best = ND_COPY_ENGINE_AVX2;
+#ifdef CONFIG_AS_AVX512
+	if (best == ND_COPY_ENGINE_AVX2 && boot_cpu_has(X86_FEATURE_AVX512F) &&
+		cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM |
+				  XFEATURE_MASK_AVX512, NULL))
+		best = ND_COPY_ENGINE_AVX512;
+#endif
+#endif
+	if (want < ND_COPY_ENGINE_GENERIC || want >= ND_COPY_ENGINE_AUTO)
+		return best;
+	return min(want, best);
+}
+
+/**
+ * nd_dcopy_skb_to_iter() - skb_copy_datagram_iter() for the dcopy workers
+ * @nt: use streaming stores; the destination is not read again soon
+ */
+int nd_dcopy_skb_to_iter(struct sk_buff *skb, int offset, struct iov_iter *to,
+	int len, bool nt)
+{
+#ifdef CONFIG_X86_64
+	int engine = READ_ONCE(nd_params.copy_engine);
+	struct skb_seq_state st;
+	unsigned int consumed = 0, n;
+	const u8 *data;
+
+	if (engine == ND_COPY_ENGINE_GENERIC || !iov_iter_is_bvec(to) ||
+		len < ND_COPY_ENGINE_MIN || !may_use_simd())
+		return skb_copy_datagram_iter(skb, offset, to, len);
+
+	skb_prepare_seq_read(skb, offset, offset + len, &st);
+	while (consumed < len && (n = skb_seq_read(consumed, &data, &st))) {
+		n = min_t(unsigned int, n, len - consumed);
+		if (nd_copy_to_bvec(engine, to, data, n, nt) != n)
+			break;
+		consumed += n;
+	}
+	skb_abort_seq_read(&st);
+	return consumed == len ? 0 : -EFAULT;
+#else
+	return skb_copy_datagram_iter(skb, offset, to, len);
+#endif
+}
+
+/**
+ * nd_dcopy_to_page() - nd_copy_to_page_nocache() for the dcopy workers
+ *
+ * The frag pages of outgoing skbs are read by the nic, not by the cpu, so
+ * they are always filled with streaming stores.
+ */
+int nd_dcopy_to_page(struct sock *sk, struct iov_iter *from, struct sk_buff *skb,
+	struct page *page, int off, int copy)
+{
+#ifdef CONFIG_X86_64
+	int engine = READ_ONCE(nd_params.copy_engine);
+	size_t done;
+
+	if (engine == ND_COPY_ENGINE_GENERIC || !iov_iter_is_bvec(from) ||
+		copy < ND_COPY_ENGINE_MIN || !may_use_simd())
+		return nd_copy_to_page_nocache(sk, from, skb, page, off, copy);
+
+	done = nd_copy_from_bvec(engine, page_address(page) + off, from, copy, true);
+	if (done != copy)
+		return -EFAULT;
+
+	skb->len	     += copy;
+	skb->data_len	     += copy;
+	skb->truesize	     += copy;
+	return 0;
+#else
+	return nd_copy_to_page_nocache(sk, from, skb, page, off, copy);
+#endif
+}
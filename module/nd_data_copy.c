@@ -6,9 +6,11 @@ static struct workqueue_struct *nd_dcopy_wq;
 static struct nd_dcopy_queue nd_dcopy_q[NR_CPUS];
 
 static inline void nd_dcopy_free_request(struct nd_dcopy_request *req) {
-    if(req->clean_skb && req->skb){
-		// pr_info("reach here:%d\n", __LINE__);
-        kfree_skb(req->skb);
+	int i;
+
+	for (i = 0; i < req->nr_ext; i++) {
+		if(req->ext[i].clean_skb && req->ext[i].skb)
+			kfree_skb(req->ext[i].skb);
 	}
 
 	if(req->bv_arr) {
@@ -16,6 +18,11 @@ static inline void nd_dcopy_free_request(struct nd_dcopy_request *req) {
 		kfree(req->bv_arr);
 		req->bv_arr = NULL;
 	}
+	if(req->win && nd_dcopy_window_put(req->win)) {
+		kfree(req->win->bv_arr);
+		kfree(req->win);
+	}
+	req->win = NULL;
 	// pr_info("reach here:%d\n", __LINE__);
     // kfree(req->iter.bvec);
 	// pr_info("reach here:%d\n", __LINE__);
@@ -33,34 +40,143 @@ static inline void nd_dcopy_free_request(struct nd_dcopy_request *req) {
 //     nd_dcopy_free_request(request);	
 // }
 
-static void nd_dcopy_process_req_list(struct nd_dcopy_queue *queue)
+static struct nd_dcopy_flow *nd_dcopy_flow_get(struct nd_dcopy_queue *queue,
+	struct sock *sk, int prio)
 {
-	struct nd_dcopy_request *req;
+	struct nd_dcopy_flow *flow;
+	unsigned long key = (unsigned long)sk + prio;
+
+	hash_for_each_possible(queue->flows, flow, hnode, key) {
+		if (flow->sk == sk && flow->prio_class == prio)
+			return flow;
+	}
+	/* the worker is on a reclaim workqueue */
+	flow = kmalloc(sizeof(*flow), GFP_NOWAIT);
+	if (!flow)
+		return &queue->fallback[prio];
+	flow->sk = sk;
+	flow->prio_class = prio;
+	INIT_LIST_HEAD(&flow->active);
+	INIT_LIST_HEAD(&flow->reqs);
+	hash_add(queue->flows, &flow->hnode, key);
+	return flow;
+}
+
+static void nd_dcopy_flow_retire(struct nd_dcopy_flow *flow)
+{
+	list_del_init(&flow->active);
+	if (!flow->sk)
+		return;
+	hash_del(&flow->hnode);
+	kfree(flow);
+}
+
+static void nd_dcopy_process_req_list(struct nd_dcopy_queue *queue, int prio)
+{
+	struct nd_dcopy_request *req, *tmp;
+	struct nd_dcopy_flow *flow;
 	struct llist_node *node;
 
-	for (node = llist_del_all(&queue->req_list); node; node = node->next) {
-		req = llist_entry(node, struct nd_dcopy_request, lentry);
-		list_add(&req->entry, &queue->copy_list);
+	node = llist_reverse_order(llist_del_all(&queue->req_list[prio]));
+	llist_for_each_entry_safe(req, tmp, node, lentry) {
+		flow = nd_dcopy_flow_get(queue, req->sk, prio);
+		list_add_tail(&req->entry, &flow->reqs);
+		if (list_empty(&flow->active)) {
+			flow->deficit = nd_params.dcopy_quantum;
+			list_add_tail(&flow->active, &queue->flow_ring[prio]);
+		}
 	}
 }
 
+/* next request of a lane: a socket copies up to dcopy_quantum bytes per turn,
+ * so one bulk receiver can't hold a small request of another socket back by
+ * more than one request. A flow leaves the ring once empty and out of debt.
+ */
+static struct nd_dcopy_request *
+nd_dcopy_lane_dequeue(struct nd_dcopy_queue *queue, int prio)
+{
+	struct list_head *ring = &queue->flow_ring[prio];
+	struct nd_dcopy_request *req;
+	struct nd_dcopy_flow *flow;
+
+	if (!llist_empty(&queue->req_list[prio]))
+		nd_dcopy_process_req_list(queue, prio);
+	while ((flow = list_first_entry_or_null(ring, struct nd_dcopy_flow, active))) {
+		if (flow->deficit <= 0) {
+			flow->deficit += READ_ONCE(nd_params.dcopy_quantum);
+			list_move_tail(&flow->active, ring);
+			continue;
+		}
+		req = list_first_entry_or_null(&flow->reqs, struct nd_dcopy_request, entry);
+		if (!req) {
+			nd_dcopy_flow_retire(flow);
+			continue;
+		}
+		list_del(&req->entry);
+		flow->deficit -= req->remain_len;
+		return req;
+	}
+	return NULL;
+}
+
+/* strict classes first, most urgent first; the weighted classes share the rest
+ * in weighted round-robin, refilling credits once no backlogged class has any left.
+ */
 static inline struct nd_dcopy_request *
 nd_dcopy_fetch_request(struct nd_dcopy_queue *queue)
 {
 	struct nd_dcopy_request *req;
+	int i, round;
 
-	req = list_first_entry_or_null(&queue->copy_list,
-			struct nd_dcopy_request, entry);
-	if (!req) {
-		nd_dcopy_process_req_list(queue);
-		req = list_first_entry_or_null(&queue->copy_list,
-				struct nd_dcopy_request, entry);
-		if (unlikely(!req))
-			return NULL;
+	for (i = ND_MAX_PRIO - 1; i >= 0; i--) {
+		if (!nd_prio_is_strict(i))
+			continue;
+		req = nd_dcopy_lane_dequeue(queue, i);
+		if (req)
+			return req;
 	}
+	for (round = 0; round < 2; round++) {
+		for (i = ND_MAX_PRIO - 1; i >= 0; i--) {
+			if (nd_prio_is_strict(i) || queue->prio_credit[i] <= 0)
+				continue;
+			req = nd_dcopy_lane_dequeue(queue, i);
+			if (req) {
+				queue->prio_credit[i]--;
+				return req;
+			}
+		}
+		for (i = 0; i < ND_MAX_PRIO; i++)
+			queue->prio_credit[i] = nd_params.prio_weight[i];
+	}
+	return NULL;
+}
 
-	list_del(&req->entry);
-	return req;
+/* publish the completions held back for one socket counter */
+static void nd_dcopy_done_flush(struct nd_dcopy_queue *queue)
+{
+	if (!queue->done_pending)
+		return;
+	/* the copied data and the response/clean lists before the count */
+	smp_mb__before_atomic();
+	atomic_add(queue->done_pending, queue->done_to);
+	queue->done_to = NULL;
+	queue->done_pending = 0;
+}
+
+/* @bytes of the socket counter @done are copied. Back-to-back requests of one
+ * socket, which the round-robin lanes hand out a quantum at a time, cost one
+ * atomic on the socket per ND_DCOPY_DONE_BATCH bytes rather than one each; the
+ * rest is flushed when another socket comes up or the worker runs dry.
+ */
+static void nd_dcopy_done(struct nd_dcopy_queue *queue, atomic_t *done, int bytes)
+{
+	WRITE_ONCE(queue->done_bytes, queue->done_bytes + bytes);
+	if (queue->done_to != done)
+		nd_dcopy_done_flush(queue);
+	queue->done_to = done;
+	queue->done_pending += bytes;
+	if (queue->done_pending >= ND_DCOPY_DONE_BATCH)
+		nd_dcopy_done_flush(queue);
 }
 
 /* round-robin */
@@ -76,7 +192,7 @@ int nd_dcopy_sche_rr(int last_qid) {
 		queue =  &nd_dcopy_q[qid * nd_params.nr_nodes + nd_params.data_cpy_core];
 		if(qid * nd_params.nr_nodes + nd_params.data_cpy_core == raw_smp_processor_id())
 			continue;
-		if(atomic_read(&queue->queue_size) >= queue->queue_threshold)
+		if(nd_dcopy_queue_len(queue) >= queue->queue_threshold)
 			continue;
 		find = true;
 		last_q = qid;
@@ -105,7 +221,7 @@ int nd_dcopy_sche_compact(void) {
 		queue =  &nd_dcopy_q[qid * nd_params.nr_nodes + nd_params.data_cpy_core];
 		// if(nd_params.nd_debug)
 		// 	pr_info("qid:%d queue size:%d \n",qid, atomic_read(&queue->queue_size));
-		if(atomic_read(&queue->queue_size) >= queue->queue_threshold) {
+		if(nd_dcopy_queue_len(queue) >= queue->queue_threshold) {
 			// pr_info(" queue size is larger than limit:%d %d\n", i, atomic_read(&queue->queue_size));
 			continue;
 		}
@@ -125,68 +241,127 @@ int nd_dcopy_sche_compact(void) {
 	// return -1;
 }
 
-int nd_dcopy_queue_request(struct nd_dcopy_request *req) {
-	int qid;
+/* bind a request to the queue of its io_cpu and account for it */
+static struct nd_dcopy_queue *nd_dcopy_prep_request(struct nd_dcopy_request *req)
+{
     struct nd_dcopy_queue* queue;  
-    bool empty = false;
 	if(req->io_cpu < 0) {
 		WARN_ON(true);
 	}
-	qid = req->io_cpu;
 	queue = &nd_dcopy_q[req->io_cpu];
-	atomic_add(req->remain_len, &queue->queue_size);
+	/* skbs that did not come through an nd channel carry no class */
+	if(unlikely(req->prio_class < 0 || req->prio_class >= ND_MAX_PRIO))
+		req->prio_class = 0;
+	atomic_add(req->remain_len, &queue->queued_bytes);
 	req->queue = queue;
-    empty = llist_add(&req->lentry, &queue->req_list) &&
-		list_empty(&queue->copy_list) && !queue->request;
-		
+	return queue;
+}
+
+/* the worker drains every lane, so only the first request of a lane rings */
+static inline void nd_dcopy_ring(struct nd_dcopy_queue *queue)
+{
 	queue_work_on(queue->io_cpu, nd_dcopy_wq, &queue->io_work);
-    return qid;
+}
+
+int nd_dcopy_queue_request(struct nd_dcopy_request *req) {
+    struct nd_dcopy_queue* queue = nd_dcopy_prep_request(req);
+
+	if (llist_add(&req->lentry, &queue->req_list[req->prio_class]))
+		nd_dcopy_ring(queue);
+    return req->io_cpu;
+}
+
+/* collect requests of one queue and lane; the first of another flushes */
+void nd_dcopy_batch_add(struct nd_dcopy_batch *batch, struct nd_dcopy_request *req)
+{
+	struct nd_dcopy_queue *queue = nd_dcopy_prep_request(req);
+
+	if (batch->queue != queue || batch->prio_class != req->prio_class)
+		nd_dcopy_batch_flush(batch);
+	batch->queue = queue;
+	batch->prio_class = req->prio_class;
+	/* newest first, the order llist_del_all() hands them back in */
+	req->lentry.next = batch->first;
+	batch->first = &req->lentry;
+	if (!batch->last)
+		batch->last = &req->lentry;
+}
+
+void nd_dcopy_batch_flush(struct nd_dcopy_batch *batch)
+{
+	if (!batch->first)
+		return;
+	if (llist_add_batch(batch->first, batch->last,
+			&batch->queue->req_list[batch->prio_class]))
+		nd_dcopy_ring(batch->queue);
+	batch->first = batch->last = NULL;
+}
+
+/* every request of the window is done; unpin its pages */
+void nd_dcopy_window_release(struct nd_dcopy_window *win)
+{
+	nd_release_pages(win->bv_arr, win->region, true, win->max_segs);
+	kfree(win->bv_arr);
+	kfree(win);
 }
 
 void nd_try_dcopy_receive(struct nd_dcopy_request *req) {
     struct nd_sock *nsk;
- 	int err, req_len;
+	struct nd_dcopy_window *win;
+	struct nd_dcopy_extent *ext;
+	struct sk_buff *clean = NULL, **tail = &clean;
+ 	int err, req_len, i;
 
 	nsk = nd_sk(req->sk);
-	err = skb_copy_datagram_iter(req->skb, req->offset, &req->iter, req->remain_len);
-    if (err) {
-    /* Exception. Bailout! */
-	    skb_dump(KERN_WARNING, req->skb, false);
-        // pr_info("msg->mssg_iter.type:%ld\n", req->iter.type &4);
-		// pr_info("msg->mssg_iter.count:%ld\n", req->iter.count);
-		// pr_info("msg->mssg_iter.iov_offset:%ld\n", req->iter.iov_offset);
-		// pr_info("msg->mssg_iter.iov_offset:%p\n", req->iter.iov);
-		// pr_info("msg->mssg_iter.nr_segs:%ld\n", req->iter.nr_segs);
-		// pr_info("msg->mssg_iter.iov_base:%p\n", req->iter.iov->iov_base);
-		// pr_info("msg->mssg_iter.iov_len:%ld\n", req->iter.iov->iov_len);
-        WARN_ON(true);
-    }
+	for (i = 0; i < req->nr_ext; i++) {
+		ext = &req->ext[i];
+		err = nd_dcopy_skb_to_iter(ext->skb, ext->offset, &req->iter, ext->len,
+			req->nt);
+		if (err) {
+			/* Exception. Bailout! */
+			skb_dump(KERN_WARNING, ext->skb, false);
+			WARN_ON(true);
+		}
+		/* chain the fully copied skbs; they are freed in one go */
+		if (ext->clean_skb) {
+			*tail = ext->skb;
+			tail = &ext->skb->next;
+			ext->skb = NULL;
+		}
+	}
+	*tail = NULL;
     // pr_info("err:%d\n", err);
 	req_len = req->remain_len;
 // clean:
     // nd_dcopy_free_request(req);
 	req->state = ND_DCOPY_DONE;
+	/* other requests may still be copying into the window */
+	win = req->win;
+	req->win = NULL;
+	if (win && !nd_dcopy_window_put(win))
+		win = NULL;
 	/* release the page before reducing the count */
-	if(req->bv_arr || req->clean_skb) {
+	if (READ_ONCE(nd_params.dcopy_release)) {
+		/* here rather than in recvmsg: keep the app core on the app */
+		if(win)
+			nd_dcopy_window_release(win);
+		kfree_skb_list(clean);
+	} else if(win || clean) {
 		struct nd_dcopy_page* resp = kmalloc(sizeof(struct nd_dcopy_page), GFP_KERNEL);
-		if(req->bv_arr) {
-			resp->max_segs = req->max_segs;
-			resp->bv_arr = req->bv_arr;
-			req->bv_arr = NULL;
+		if(win) {
+			resp->max_segs = win->max_segs;
+			resp->bv_arr = win->bv_arr;
+			resp->region = win->region;
+			kfree(win);
 		} else {
 			resp->bv_arr = NULL;
+			resp->region = NULL;
 		}
-		if(req->clean_skb) {
-			resp->skb = req->skb;
-			req->skb = NULL;
-		} else {
-			resp->skb = NULL;
-		}
+		resp->skb = clean;
 		llist_add(&resp->lentry, &nsk->receiver.clean_page_list);
 		// nd_release_pages(req->bv_arr, true, req->max_segs);
 	} 
-    atomic_sub_return(req_len, &nsk->receiver.in_flight_copy_bytes);
-	atomic_sub(req_len, &req->queue->queue_size);
+	nd_dcopy_done(req->queue, &nsk->receiver.copy_done, req_len);
 // done:
 // 	return ret;
 }
@@ -195,7 +370,7 @@ void nd_try_dcopy_send(struct nd_dcopy_request *req) {
     struct nd_sock *nsk;
  	int err, req_len, i;
 	size_t copy;
-	struct page_frag *pfrag = &current->task_frag;
+	struct page_frag *pfrag;
 	struct sk_buff *skb;
 	struct nd_dcopy_response *resp;
 	req_len = req->remain_len; 
@@ -203,13 +378,16 @@ void nd_try_dcopy_send(struct nd_dcopy_request *req) {
 	WARN_ON(req_len == 0);
 	while(req_len > 0) {
 		bool merge = true;
-		if (!skb_page_frag_refill(32U, pfrag, req->sk->sk_allocation)) {
-			goto wait_for_memory;
+		pfrag = nd_hpage_pool_refill(&req->queue->hpool, 32U, req->sk->sk_allocation);
+		if (!pfrag) {
+			pfrag = &current->task_frag;
+			if (!skb_page_frag_refill(32U, pfrag, req->sk->sk_allocation))
+				goto wait_for_memory;
 		}
 		skb = req->skb;
 		if(!skb) 
 			goto create_new_skb;
-		if(skb->len == ND_MAX_SKB_LEN)
+		if(skb->len >= nsk->pdu_size)
 			goto push_skb;
 		i = skb_shinfo(skb)->nr_frags;
 		if (!skb_can_coalesce(skb, i, pfrag->page,
@@ -219,13 +397,13 @@ void nd_try_dcopy_send(struct nd_dcopy_request *req) {
 			}
 			merge = false;
 		}
-		copy = min_t(int, ND_MAX_SKB_LEN - skb->len, req_len);
+		copy = min_t(int, nsk->pdu_size - skb->len, req_len);
 		copy = min_t(int, copy,
 			     pfrag->size - pfrag->offset);
-		err = nd_copy_to_page_nocache(req->sk, &req->iter, skb,
-					       pfrag->page,
-					       pfrag->offset,
-					       copy);
+		err = nd_dcopy_to_page(req->sk, &req->iter, skb,
+				       pfrag->page,
+				       pfrag->offset,
+				       copy);
 		/* ToDo: handle the err */
 		if(err)
 			WARN_ON(true);
@@ -251,6 +429,9 @@ void nd_try_dcopy_send(struct nd_dcopy_request *req) {
 		// printk("create new skb\n");
 		if(!skb)
 			goto wait_for_memory;
+		/* as in the local path: no software checksum of the payload */
+		skb->ip_summed = CHECKSUM_PARTIAL;
+		ND_SKB_CB(skb)->prio_class = req->prio_class;
 
 		// __skb_queue_tail(&sk->sk_write_queue, skb);
 		continue;
@@ -258,6 +439,7 @@ void nd_try_dcopy_send(struct nd_dcopy_request *req) {
 	push_skb:
 		/* push the new skb */
 		ND_SKB_CB(skb)->seq = req->seq;
+		ND_SKB_CB(skb)->eor = req->eor && req_len == 0;
 		resp = kmalloc(sizeof(struct nd_dcopy_response), GFP_KERNEL);
 		resp->skb = req->skb;
 		llist_add(&resp->lentry, &nsk->sender.response_list);
@@ -272,10 +454,11 @@ void nd_try_dcopy_send(struct nd_dcopy_request *req) {
 	}
 	if(req_len == 0) {
 		req->state = ND_DCOPY_DONE;
-		nd_release_pages(req->bv_arr, true, req->max_segs);
+		nd_release_pages(req->bv_arr, req->region, true, req->max_segs);
+		if (req->async)
+			nd_async_send_done(req->async);
 	}  
-	atomic_sub_return(req->remain_len - req_len, &nsk->sender.in_flight_copy_bytes);
-	atomic_sub(req->remain_len - req_len, &req->queue->queue_size);
+	nd_dcopy_done(req->queue, &nsk->sender.copy_done, req->remain_len - req_len);
 	req->remain_len = req_len;
 // done:
 // 	return ret;
@@ -290,8 +473,10 @@ int nd_try_dcopy(struct nd_dcopy_queue *queue)
 
 	if (!queue->request) {
 		queue->request = nd_dcopy_fetch_request(queue);
-		if (!queue->request)
+		if (!queue->request) {
+			nd_dcopy_done_flush(queue);
 			return 0;
+		}
 	} else {
 		WARN_ON(true);
 	}
@@ -356,38 +541,61 @@ void nd_dcopy_io_work(struct work_struct *w)
 
 void nd_dcopy_flush_req_list(struct nd_dcopy_queue *queue) {
     struct nd_dcopy_request *req, *temp;
-    list_for_each_entry_safe(req, temp, &queue->copy_list, entry) {
-        nd_dcopy_free_request(req);
-    }
-	INIT_LIST_HEAD(&queue->copy_list);
+	struct nd_dcopy_flow *flow, *ftmp;
+	int i;
+	for (i = 0; i < ND_MAX_PRIO; i++) {
+		list_for_each_entry_safe(flow, ftmp, &queue->flow_ring[i], active) {
+			list_for_each_entry_safe(req, temp, &flow->reqs, entry) {
+				nd_dcopy_free_request(req);
+			}
+			INIT_LIST_HEAD(&flow->reqs);
+			nd_dcopy_flow_retire(flow);
+		}
+	}
 }
 
 void nd_dcopy_free_queue(struct nd_dcopy_queue *queue)
 {
+	int i;
 	// struct nd_conn_queue *queue = &ctrl->queues[qid];
 
 	// if (!test_and_clear_bit(ND_CONN_Q_LIVE, &queue->flags))
 	// 	return;
 	cancel_work_sync(&queue->io_work);
     /* flush all pending request and clean the occupied memory of each req */
-    nd_dcopy_process_req_list(queue);
+	for (i = 0; i < ND_MAX_PRIO; i++)
+		nd_dcopy_process_req_list(queue, i);
     mutex_lock(&queue->copy_mutex);
     nd_dcopy_flush_req_list(queue);
+	nd_dcopy_done_flush(queue);
+	nd_hpage_pool_destroy(&queue->hpool);
     mutex_unlock(&queue->copy_mutex);
 
 }
 
 int nd_dcopy_alloc_queue(struct nd_dcopy_queue *queue, int io_cpu)
 {
-    init_llist_head(&queue->req_list);
-	INIT_LIST_HEAD(&queue->copy_list);
+	int i;
+	for (i = 0; i < ND_MAX_PRIO; i++) {
+		init_llist_head(&queue->req_list[i]);
+		INIT_LIST_HEAD(&queue->flow_ring[i]);
+		INIT_LIST_HEAD(&queue->fallback[i].active);
+		INIT_LIST_HEAD(&queue->fallback[i].reqs);
+		queue->fallback[i].sk = NULL;
+		queue->fallback[i].prio_class = i;
+		queue->prio_credit[i] = 0;
+	}
+	hash_init(queue->flows);
 	// spin_lock_init(&queue->lock);
     mutex_init(&queue->copy_mutex);
 	INIT_WORK(&queue->io_work, nd_dcopy_io_work);
     queue->io_cpu = io_cpu;
 	queue->queue_threshold = 10 * 65536;
 	// queue->queue_size = queue_size;
-	atomic_set(&queue->queue_size, 0);
+	atomic_set(&queue->queued_bytes, 0);
+	queue->done_bytes = 0;
+	queue->done_to = NULL;
+	queue->done_pending = 0;
 	return 0;
 }
 
@@ -418,6 +626,8 @@ int nd_dcopy_init(void)
 
 	if (!nd_dcopy_wq)
 		return -ENOMEM;
+	nd_params.copy_engine = nd_copy_engine_select(nd_params.copy_engine);
+	pr_info("nd data copy engine: %d\n", nd_params.copy_engine);
 	ret= nd_dcopy_alloc_queues(nd_dcopy_q);
 	// ndt_port = kzalloc(sizeof(*ndt_port), GFP_KERNEL);
 
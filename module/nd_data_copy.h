@@ -10,9 +10,11 @@
 #include <net/tcp.h>
 #include <linux/inet.h>
 #include <linux/llist.h>
+#include <linux/hashtable.h>
 #include <linux/spinlock.h>
 #include <crypto/hash.h>
 #include "uapi_linux_nd.h"
+#include "linux_nd.h"
 
 enum nd_conn_dcopy_state {
 	ND_DCOPY_SEND = 0,
@@ -26,37 +28,114 @@ struct nd_dcopy_response {
 	struct sk_buff *skb;
 };
 
+struct nd_pin_region;
+
+/* one MSG_ND_ASYNC sendmsg; reported once its last copy request is done */
+struct nd_async_send {
+	struct sock *sk;
+	/* one per queued copy request, one for the sendmsg call */
+	atomic_t pending;
+	u32 id;
+	/* the completion notification, charged to optmem */
+	struct sk_buff *skb;
+	/* where tx_work pushes the copied skbs */
+	int cpu;
+	/* nothing was offloaded, the call copied it all itself */
+	bool copied;
+};
+
 struct nd_dcopy_page {
 	struct llist_node	lentry;
 	struct bio_vec *bv_arr;
+	/* set when bv_arr points into the pinned-page cache */
+	struct nd_pin_region *region;
+	/* fully copied skbs, chained through skb->next */
 	struct sk_buff* skb;
 	int max_segs;
 };
 
+/* recv: a pinned user window; several requests may copy into it, in
+ * different lanes or on different workers, so its pages are released by
+ * whoever drops the last reference.
+ */
+struct nd_dcopy_window {
+	struct bio_vec *bv_arr;
+	struct nd_pin_region *region;
+	int max_segs;
+	/* one per request copying into it, one for recvmsg while it adds more */
+	atomic_t pending;
+};
+
+/* most skbs one receive request copies out of */
+#define ND_DCOPY_MAX_EXTENTS	16
+
+/* recv: @len bytes of @skb from @offset on */
+struct nd_dcopy_extent {
+	struct sk_buff *skb;
+	u32 offset;
+	u32 len;
+	/* the extent ends the skb; free it once copied */
+	bool clean_skb;
+};
+
 struct nd_dcopy_request {
 	enum nd_conn_dcopy_state state;
 
-	bool clean_skb;
 	int io_cpu;
     struct sock *sk;
+	/* send: the skb being filled */
 	struct sk_buff *skb;
 	struct iov_iter iter;
 	struct bio_vec *bv_arr;
+	struct nd_pin_region *region;
 	struct list_head	entry;
 	struct llist_node	lentry;
-	union{
-		u32 offset;
-		u32 seq;
-	};
+	u32 seq;
     int len;
 	int remain_len;
 	int max_segs;
+	int prio_class;
+	/* send: the request ends a message */
+	bool eor;
+	/* send: the MSG_ND_ASYNC call this request belongs to */
+	struct nd_async_send *async;
+	/* recv: the pinned window iter points into */
+	struct nd_dcopy_window *win;
+	/* recv: the destination is not read again soon, stream it */
+	bool nt;
 	struct nd_dcopy_queue *queue;
+	/* recv: copied into iter back to back */
+	int nr_ext;
+	/* recv only, ND_DCOPY_MAX_EXTENTS of them; sends allocate none */
+	struct nd_dcopy_extent ext[];
 };
 
+/* the requests of one socket in one lane of a dcopy queue */
+struct nd_dcopy_flow {
+	struct hlist_node	hnode;
+	/* on the lane's round-robin ring; stays there while in debt */
+	struct list_head	active;
+	struct list_head	reqs;
+	/* hash key only, never dereferenced; NULL for the lane's fallback flow */
+	struct sock *sk;
+	int prio_class;
+	/* bytes the socket may still copy this round */
+	int deficit;
+};
+
+#define ND_DCOPY_FLOW_HASH_BITS	6
+/* completed bytes a worker holds back from a socket's copy_done */
+#define ND_DCOPY_DONE_BATCH	(64 * 1024)
+
 struct nd_dcopy_queue {
-    struct llist_head	req_list;
-	struct list_head	copy_list;
+	/* one lane per priority class */
+    struct llist_head	req_list[ND_MAX_PRIO];
+	/* sockets of a lane share it in deficit round-robin, by bytes */
+	struct list_head	flow_ring[ND_MAX_PRIO];
+	DECLARE_HASHTABLE(flows, ND_DCOPY_FLOW_HASH_BITS);
+	/* used when a flow can't be allocated */
+	struct nd_dcopy_flow	fallback[ND_MAX_PRIO];
+	int			prio_credit[ND_MAX_PRIO];
     int io_cpu;
 	struct work_struct	io_work;
 	struct mutex		copy_mutex;
@@ -64,7 +143,34 @@ struct nd_dcopy_queue {
     struct nd_dcopy_request *request;
     size_t			offset;
 	int queue_threshold;
-	atomic_t	queue_size;
+	/* bytes ever queued, by the app cores */
+	atomic_t	queued_bytes;
+	/* frags of the skbs built by this core; under copy_mutex */
+	struct nd_hpage_pool	hpool;
+
+	/* worker only, under copy_mutex: bytes ever copied, and those of the
+	 * socket counter done_to not published to it yet
+	 */
+	int		done_bytes ____cacheline_aligned_in_smp;
+	atomic_t	*done_to;
+	int		done_pending;
+};
+
+/* bytes queued and not copied yet; lockless, so requests racing with the
+ * read may or may not be in it
+ */
+static inline int nd_dcopy_queue_len(struct nd_dcopy_queue *queue)
+{
+	int len = atomic_read(&queue->queued_bytes) - READ_ONCE(queue->done_bytes);
+
+	return max(len, 0);
+}
+
+/* requests of one queue and lane handed over with one llist_add_batch() */
+struct nd_dcopy_batch {
+	struct nd_dcopy_queue *queue;
+	int prio_class;
+	struct llist_node *first, *last;
 };
 
 // inline void nd_init_data_copy_request(struct nd_dcopy_request *request) {
@@ -72,8 +178,17 @@ struct nd_dcopy_queue {
 //     // INIT_LIST_HEAD();
 //     // init_llist_head
 // }
+/* true for the caller that dropped the window's last reference */
+static inline bool nd_dcopy_window_put(struct nd_dcopy_window *win)
+{
+	return atomic_dec_and_test(&win->pending);
+}
+
 int nd_dcopy_sche_rr(int last_qid);
+void nd_dcopy_window_release(struct nd_dcopy_window *win);
 int nd_dcopy_queue_request(struct nd_dcopy_request *req);
+void nd_dcopy_batch_add(struct nd_dcopy_batch *batch, struct nd_dcopy_request *req);
+void nd_dcopy_batch_flush(struct nd_dcopy_batch *batch);
 int nd_try_dcopy(struct nd_dcopy_queue *queue);
 void nd_dcopy_io_work(struct work_struct *w);
 void nd_dcopy_flush_req_list(struct nd_dcopy_queue *queue);
@@ -82,6 +197,13 @@ int nd_dcopy_alloc_queue(struct nd_dcopy_queue *queue, int io_cpu);
 int nd_dcopy_alloc_queues(struct nd_dcopy_queue *queues);
 int nd_dcopy_init(void);
 void nd_dcopy_exit(void);
+int nd_copy_engine_select(int want);
+void nd_async_send_put(struct nd_async_send *as);
+void nd_async_send_done(struct nd_async_send *as);
+int nd_dcopy_skb_to_iter(struct sk_buff *skb, int offset, struct iov_iter *to,
+	int len, bool nt);
+int nd_dcopy_to_page(struct sock *sk, struct iov_iter *from, struct sk_buff *skb,
+	struct page *page, int off, int copy);
 
 static inline int nd_copy_to_page_nocache(struct sock *sk, struct iov_iter *from,
 					   struct sk_buff *skb,
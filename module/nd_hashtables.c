@@ -358,6 +358,33 @@ static inline int compute_score(struct sock *sk, struct net *net,
 	return score;
 }
 
+/* steer to the listener whose accept loop runs on the current cpu, so the
+ * connection is accepted on the core that handled its SYNC. Accept loops
+ * announce their core with SO_INCOMING_CPU; NULL falls back to the hash.
+ * called with rcu_read_lock()
+ */
+static struct sock *nd_reuseport_select_cpu(struct sock *sk)
+{
+	struct sock_reuseport *reuse;
+	struct sock *sk2;
+	int cpu = raw_smp_processor_id();
+	u16 socks, i;
+
+	reuse = rcu_dereference(sk->sk_reuseport_cb);
+	/* leave an attached bpf program in charge */
+	if (!reuse || rcu_access_pointer(reuse->prog))
+		return NULL;
+	socks = READ_ONCE(reuse->num_socks);
+	/* paired with smp_wmb() in reuseport_add_sock() */
+	smp_rmb();
+	for (i = 0; i < socks; i++) {
+		sk2 = reuse->socks[i];
+		if (READ_ONCE(sk2->sk_incoming_cpu) == cpu)
+			return sk2;
+	}
+	return NULL;
+}
+
 /*
  * Here are some nice properties to exploit here. The BSD API
  * does not allow a listening sock to specify the remote port nor the
@@ -385,9 +412,13 @@ static struct sock *inet_lhash2_lookup(struct net *net,
 				      dif, sdif);
 		if (score > hiscore) {
 			if (sk->sk_reuseport) {
+				if (nd_params.reuseport_cpu) {
+					result = nd_reuseport_select_cpu(sk);
+					if (result)
+						return result;
+				}
 				phash = inet_ehashfn(net, daddr, hnum,
 						     saddr, sport);
-				printk("phash:%u\n", phash);
 				result = reuseport_select_sock(sk, phash,
 							       skb, doff);
 				if (result)
@@ -19,7 +19,7 @@ DECLARE_HASHTABLE(nd_conn_table, 8);
 
 static inline bool nd_conn_has_inline_data(struct nd_conn_request *req) {
 	struct ndhdr* hdr = req->hdr;
-	return hdr->type == DATA;
+	return hdr->type == DATA || hdr->type == DGRAM;
 }
 
 static inline int nd_conn_queue_id(struct nd_conn_queue *queue)
@@ -27,15 +27,16 @@ static inline int nd_conn_queue_id(struct nd_conn_queue *queue)
 	return queue - queue->ctrl->queues;
 }
 
-static inline bool nd_conn_queue_is_lat(struct nd_conn_queue *queue)
+/* strict classes run on the high-priority pool; weighted classes share the normal one */
+static inline struct workqueue_struct *nd_conn_prio_wq(int prio_class)
 {
-	return queue->prio_class == 1;
+	return nd_prio_is_strict(prio_class) ? nd_conn_wq_lat : nd_conn_wq;
 }
 
 static inline void nd_conn_done_send_req(struct nd_conn_queue *queue)
 {
 	struct ndhdr* hdr = queue->request->hdr;
-	if(hdr->type == DATA) 
+	if(hdr->type == DATA || hdr->type == DGRAM)
 		kfree_skb(queue->request->skb);
 	/* pdu doesn't have to be freed */
 	// kfree(queue->request->pdu);
@@ -143,11 +144,7 @@ void nd_conn_data_ready(struct sock *sk)
 	queue = sk->sk_user_data;
 	if (likely(queue && queue->rd_enabled) &&
 	    !test_bit(ND_CONN_Q_POLLING, &queue->flags)) {
-			if(nd_conn_queue_is_lat(queue)) {
-				queue_work_on(queue->io_cpu, nd_conn_wq_lat, &queue->io_work);
-			}else {
-				queue_work_on(queue->io_cpu, nd_conn_wq, &queue->io_work);
-			}
+			queue_work_on(queue->io_cpu, nd_conn_prio_wq(queue->prio_class), &queue->io_work);
 		}
 	read_unlock_bh(&sk->sk_callback_lock);
 }
@@ -161,11 +158,7 @@ void nd_conn_write_space(struct sock *sk)
 	if (likely(queue && sk_stream_is_writeable(sk))) {
 		// printk("write space invoke\n");
 		clear_bit(SOCK_NOSPACE, &sk->sk_socket->flags);
-			if(nd_conn_queue_is_lat(queue)) {
-				queue_work_on(queue->io_cpu, nd_conn_wq_lat, &queue->io_work);
-			}else {
-				queue_work_on(queue->io_cpu, nd_conn_wq, &queue->io_work);
-			}
+			queue_work_on(queue->io_cpu, nd_conn_prio_wq(queue->prio_class), &queue->io_work);
 	}
 	read_unlock_bh(&sk->sk_callback_lock);
 }
@@ -199,21 +192,25 @@ done:
 	read_unlock(&sk->sk_callback_lock);
 }
 
+/* channels a socket may use for a class: its pinned set (ND_CHANNELS) if any */
+static inline void nd_conn_sche_range(struct nd_sock *nsk, int prio_class,
+	int *lower_bound, int *num_queue)
+{
+	if(nsk->chan_count > 0) {
+		*lower_bound = nsk->chan_first;
+		*num_queue = nsk->chan_count;
+	} else {
+		*lower_bound = nd_params.prio_channel_idx[prio_class];
+		*num_queue = nd_params.prio_num_channels[prio_class];
+	}
+}
+
 /* round-robin; will not select the previous one except if there is only one channel. */
-int nd_conn_sche_rr(struct nd_conn_queue* queues, int last_q, int cur_count, int prio_class, bool avoid_check) {
+int nd_conn_sche_rr(struct nd_conn_queue* queues, int last_q, int cur_count, int lower_bound, int num_queue, bool avoid_check) {
 	struct nd_conn_queue *queue;
 	/* cur_count tracks how many skbs has been sent for the current queue before going to the next queue */
 	// static u32;
 	int i = 0, qid = last_q;
-	int lower_bound = 0;
-	int num_queue = 0;
-	if(prio_class) {
-		lower_bound = nd_params.lat_channel_idx;
-		num_queue = nd_params.num_lat_channels;
-	} else {
-		lower_bound = nd_params.thpt_channel_idx;
-		num_queue =  nd_params.num_thpt_channels;
-	}
 	// if(nd_params.nd_num_queue == 1)
 	// 	i = 0;
 	/* advance to the next queue */
@@ -227,8 +224,7 @@ int nd_conn_sche_rr(struct nd_conn_queue* queues, int last_q, int cur_count, int
 		queue =  &queues[qid];
 		// WARN_ON(cur_count >= queue->compact_low_thre);
 
-		if(atomic_read(&queue->cur_queue_size) 
-			>= queue->queue_size) {
+		if(nd_conn_queue_len_approx(queue) >= queue->queue_size) {
 			/* update the count */
 			// cur_count = 0;
 			continue;
@@ -251,20 +247,16 @@ int nd_conn_sche_rr(struct nd_conn_queue* queues, int last_q, int cur_count, int
 
 /* round-robin; will not select the previous one except if there is only one channel. */
 int nd_conn_sche_low_lat(void) {
-	return  raw_smp_processor_id() / nd_params.nr_nodes + nd_params.lat_channel_idx;
+	return  raw_smp_processor_id() / nd_params.nr_nodes + nd_params.prio_channel_idx[nd_params.num_prio - 1];
 }
 
 /* round-robin; will not select the previous one except if there is only one channel. */
-int nd_conn_sche_src_port(struct nd_conn_queue *queues, int src_port, bool avoid_check, int pri_class) {
+int nd_conn_sche_src_port(struct nd_conn_queue *queues, int src_port, bool avoid_check, int lower_bound, int num_queue) {
         struct nd_conn_queue *queue;
         int qid;
-        if(pri_class)
-                qid = src_port % nd_params.num_lat_channels + nd_params.lat_channel_idx;
-        else
-                qid = src_port % nd_params.num_thpt_channels + nd_params.thpt_channel_idx;
+        qid = src_port % num_queue + lower_bound;
         queue = &queues[qid];
-        if(atomic_read(&queue->cur_queue_size)
-                >= queue->queue_size && !avoid_check) {
+        if(nd_conn_queue_len_approx(queue) >= queue->queue_size && !avoid_check) {
                 /* update the count */
                 // cur_count = 0;
                 return -1;
@@ -275,6 +267,59 @@ int nd_conn_sche_src_port(struct nd_conn_queue *queues, int src_port, bool avoid
         return -1;
 }
 
+/* datagrams carry no per-peer state: spread by port pair within the socket's class range */
+struct nd_conn_queue *nd_conn_sche_dgram(struct nd_conn_ctrl *nd_ctrl, struct nd_sock *nsk,
+	int prio_class, __be16 dport)
+{
+	int lower_bound, num_queue, qid;
+
+	nd_conn_sche_range(nsk, prio_class, &lower_bound, &num_queue);
+	qid = nd_conn_sche_src_port(nd_ctrl->queues,
+		ntohs(inet_sk((struct sock *)nsk)->inet_sport) + ntohs(dport), false,
+		lower_bound, num_queue);
+	return qid < 0 ? NULL : &nd_ctrl->queues[qid];
+}
+
+/* mid-flowlet: requests are still queued on queue and the flowlet gap has not passed */
+static bool nd_conn_flowlet_pinned(struct nd_conn_queue *queue, struct nd_sock *nsk) {
+	return READ_ONCE(queue->done_tickets) - READ_ONCE(nsk->sender.con_last_ticket) < 0 &&
+		ktime_get_ns() - READ_ONCE(nsk->sender.con_last_ns) <=
+		(u64)nd_params.flowlet_gap_us * NSEC_PER_USEC;
+}
+
+/* flowlet: keep the socket on its channel while it still has requests in flight there,
+ * unless it has been idle longer than the channel skew; then move to the least loaded one.
+ */
+int nd_conn_sche_flowlet(struct nd_conn_queue *queues, struct nd_sock *nsk, int lower_bound, int num_queue, bool avoid_check) {
+	struct nd_conn_queue *queue;
+	int i, qid, best = -1, best_size = INT_MAX, size;
+	int last_q = nsk->sender.con_queue_id;
+	bool in_class;
+
+	in_class = last_q >= lower_bound && last_q < lower_bound + num_queue;
+	if(in_class) {
+		queue = &queues[last_q];
+		if(nd_conn_flowlet_pinned(queue, nsk)) {
+			/* mid-flowlet: switching now would reorder at the receiver */
+			if(nd_conn_queue_len_approx(queue) < queue->queue_size || avoid_check)
+				return last_q;
+			return -1;
+		}
+	}
+	for (i = 0; i < num_queue; i++) {
+		/* start from the current channel so that it wins ties */
+		qid = in_class ? (last_q - lower_bound + i) % num_queue + lower_bound : i + lower_bound;
+		size = nd_conn_queue_len_approx(&queues[qid]);
+		if(size >= queues[qid].queue_size || size >= best_size)
+			continue;
+		best = qid;
+		best_size = size;
+	}
+	if(best < 0 && avoid_check)
+		best = in_class ? last_q : lower_bound;
+	return best;
+}
+
 /* stick on one queue if the queue size is below than threshold; */
 // int nd_conn_sche_compact(bool avoid_check) {
 // 	struct nd_conn_queue *queue;
@@ -331,19 +376,19 @@ void* nd_conn_find_nd_ctrl(__be32 dst_addr) {
 	return NULL;
 }
 
-bool nd_conn_queue_request(struct nd_conn_request *req, struct nd_sock *nsk,
-		bool sync, bool avoid_check, bool last)
+/* pick the channel of a request and account for it; false if all are full */
+static bool nd_conn_select_queue(struct nd_conn_request *req, struct nd_sock *nsk,
+		bool avoid_check)
 {
     struct inet_sock *inet = inet_sk((struct sock*)nsk);
 	struct nd_conn_queue *queue = req->queue, *last_q;
 	struct nd_conn_ctrl *nd_ctrl = nsk->nd_ctrl;
 	// static u32 queue_id = 0;
-	bool empty;
-	// bool push = false;
-	int ret;
 	int qid = 0;
+	int lower_bound, num_queue;
 	WARN_ON(nsk == NULL);
 	if(queue == NULL) { 
+		nd_conn_sche_range(nsk, req->prio_class, &lower_bound, &num_queue);
 		/* hard code for now */
 		// queue_id = (smp_processor_id() - 16) / 4;
 		// if(req->prio_class)
@@ -351,26 +396,33 @@ bool nd_conn_queue_request(struct nd_conn_request *req, struct nd_sock *nsk,
 		// else
 	//		qid = nd_conn_sche_rr(nsk->sender.con_queue_id, nsk->sender.con_accumu_count, req->prio_class, avoid_check);
 		if(nsk->sche_policy == SCHE_SRC_PORT)
-			qid = nd_conn_sche_src_port(nd_ctrl->queues, ntohs(inet->inet_sport), avoid_check, req->prio_class);
+			qid = nd_conn_sche_src_port(nd_ctrl->queues, ntohs(inet->inet_sport), avoid_check, lower_bound, num_queue);
 		else if(nsk->sche_policy == SCHE_RR)
-			qid = nd_conn_sche_rr(nd_ctrl->queues, nsk->sender.con_queue_id, nsk->sender.con_accumu_count, req->prio_class, avoid_check);
+			qid = nd_conn_sche_rr(nd_ctrl->queues, nsk->sender.con_queue_id, nsk->sender.con_accumu_count, lower_bound, num_queue, avoid_check);
+		else if(nsk->sche_policy == SCHE_FLOWLET)
+			qid = nd_conn_sche_flowlet(nd_ctrl->queues, nsk, lower_bound, num_queue, avoid_check);
 		if(qid < 0) {
 			/* wake up previous queue */
 			if(nsk->sender.con_queue_id != - 1) {
 				last_q =  &nd_ctrl->queues[nsk->sender.con_queue_id];
-				if(nd_conn_queue_is_lat(last_q)) {
-					queue_work_on(last_q->io_cpu, nd_conn_wq_lat, &last_q->io_work);
-				}else {
-					queue_work_on(last_q->io_cpu, nd_conn_wq, &last_q->io_work);
-				}					
+				queue_work_on(last_q->io_cpu, nd_conn_prio_wq(last_q->prio_class), &last_q->io_work);
 			}
 			return false;
 		}
 		req->queue = &nd_ctrl->queues[qid];
 		// req->queue =  &nd_ctrl->queues[6];
 		queue = req->queue;
-		atomic_add(1, &queue->cur_queue_size);
 		/* update nsk state */
+		if(nsk->sche_policy == SCHE_FLOWLET) {
+			if(qid != nsk->sender.con_queue_id && nsk->sender.con_queue_id != - 1) {
+				/* flush the tail of the previous flowlet */
+				last_q =  &nd_ctrl->queues[nsk->sender.con_queue_id];
+				queue_work_on(last_q->io_cpu, nd_conn_prio_wq(last_q->prio_class), &last_q->io_work);
+			}
+			nsk->sender.con_last_ticket = atomic_inc_return(&queue->req_tickets);
+			nsk->sender.con_last_ns = ktime_get_ns();
+		} else
+			atomic_inc(&queue->req_tickets);
 		if(nsk->sche_policy == SCHE_RR) {
 			if(qid == nsk->sender.con_queue_id)
 				nsk->sender.con_accumu_count += 1;
@@ -379,11 +431,7 @@ bool nd_conn_queue_request(struct nd_conn_request *req, struct nd_sock *nsk,
 				// printk("wake up previous channel:%d\n", nsk->sender.con_queue_id);
 				if(nsk->sender.con_queue_id != - 1) {
 					last_q =  &nd_ctrl->queues[nsk->sender.con_queue_id];
-					if(nd_conn_queue_is_lat(last_q)) {
-						queue_work_on(last_q->io_cpu, nd_conn_wq_lat, &last_q->io_work);
-					}else {
-						queue_work_on(last_q->io_cpu, nd_conn_wq, &last_q->io_work);
-					}					
+					queue_work_on(last_q->io_cpu, nd_conn_prio_wq(last_q->prio_class), &last_q->io_work);
 				}
 				/* reinitalize the sk state */
 				nsk->sender.con_accumu_count = 1;
@@ -392,7 +440,7 @@ bool nd_conn_queue_request(struct nd_conn_request *req, struct nd_sock *nsk,
 		nsk->sender.con_queue_id = qid;
 		// queue_id += 1;
 	} else {
-		atomic_add(1, &queue->cur_queue_size);
+		atomic_inc(&queue->req_tickets);
 	}
 	// bytes_sent[qid] += 1;
 	WARN_ON(req->queue == NULL);
@@ -401,8 +449,28 @@ bool nd_conn_queue_request(struct nd_conn_request *req, struct nd_sock *nsk,
 	// 	== queue->queue_size)
 	// 		return false;
 	// }
-	empty = llist_add(&req->lentry, &queue->req_list) &&
-		list_empty(&queue->send_list) && !queue->request;
+	return true;
+}
+
+/* the worker drains req_list completely, so whoever finds it empty rings */
+static inline void nd_conn_ring(struct nd_conn_queue *queue)
+{
+	queue_work_on(queue->io_cpu, nd_conn_prio_wq(queue->prio_class), &queue->io_work);
+}
+
+bool nd_conn_queue_request(struct nd_conn_request *req, struct nd_sock *nsk,
+		bool sync, bool avoid_check)
+{
+	struct nd_conn_queue *queue;
+	bool first, empty;
+	// bool push = false;
+	int ret;
+
+	if (!nd_conn_select_queue(req, nsk, avoid_check))
+		return false;
+	queue = req->queue;
+	first = llist_add(&req->lentry, &queue->req_list);
+	empty = first && list_empty(&queue->send_list) && !queue->request;
 
 	/*
 	 * if we're the first on the send_list and we can try to send
@@ -411,23 +479,79 @@ bool nd_conn_queue_request(struct nd_conn_request *req, struct nd_sock *nsk,
 	 */
 	if (queue->io_cpu == smp_processor_id() &&
 	    sync && empty && mutex_trylock(&queue->send_mutex)) {
-		// queue->more_requests = !last;
 		ret = nd_conn_try_send(queue);
 		// if(ret == -EAGAIN)
 		// 	queue->more_requests = false;
 		mutex_unlock(&queue->send_mutex);
-	} else if(last){
+		/* requests queued behind ours found the list non-empty */
+		if (!llist_empty(&queue->req_list) || !list_empty(&queue->send_list) ||
+		    READ_ONCE(queue->request))
+			nd_conn_ring(queue);
+	} else if (first) {
 		/* data packets always go here */
 		// printk("wake up last channel:%d\n", nsk->sender.con_queue_id);
-		if(nd_conn_queue_is_lat(queue)) {
-			queue_work_on(queue->io_cpu, nd_conn_wq_lat, &queue->io_work);
-		}else {
-			queue_work_on(queue->io_cpu, nd_conn_wq, &queue->io_work);
-		}
+		nd_conn_ring(queue);
 	}
 	return true;
 }
 
+/**
+ * nd_conn_queue_ctrl_request() - queue a control packet on behalf of a socket
+ * it does not own, e.g. a grant of the scheduler or a matching packet
+ *
+ * The channel is picked by port within the class range, as for datagrams, and
+ * bound before queueing, so no channel-selection state of the socket's owner
+ * is touched. Grants are cumulative; the sender takes only forward ones, so
+ * they may overtake each other across channels.
+ *
+ * Return: false if @req is NULL; it is consumed otherwise.
+ */
+bool nd_conn_queue_ctrl_request(struct nd_conn_request *req, struct nd_sock *nsk)
+{
+	int lower_bound, num_queue, qid;
+
+	if (!req)
+		return false;
+	lower_bound = nd_params.prio_channel_idx[req->prio_class];
+	num_queue = nd_params.prio_num_channels[req->prio_class];
+	qid = nd_conn_sche_src_port(nsk->nd_ctrl->queues,
+		ntohs(inet_sk((struct sock *)nsk)->inet_sport), true, lower_bound, num_queue);
+	req->queue = &nsk->nd_ctrl->queues[qid];
+	return nd_conn_queue_request(req, nsk, false, true);
+}
+
+/**
+ * nd_conn_queue_request_batch() - nd_conn_queue_request() for a run of
+ * requests, e.g. the data of nd_push()
+ *
+ * Requests are collected per channel and handed over with one
+ * llist_add_batch() when the channel changes or at nd_conn_batch_flush().
+ */
+bool nd_conn_queue_request_batch(struct nd_conn_request *req, struct nd_sock *nsk,
+		bool avoid_check, struct nd_conn_batch *batch)
+{
+	if (!nd_conn_select_queue(req, nsk, avoid_check))
+		return false;
+	if (batch->queue != req->queue)
+		nd_conn_batch_flush(batch);
+	batch->queue = req->queue;
+	/* newest first, the order llist_del_all() hands them back in */
+	req->lentry.next = batch->first;
+	batch->first = &req->lentry;
+	if (!batch->last)
+		batch->last = &req->lentry;
+	return true;
+}
+
+void nd_conn_batch_flush(struct nd_conn_batch *batch)
+{
+	if (!batch->first)
+		return;
+	if (llist_add_batch(batch->first, batch->last, &batch->queue->req_list))
+		nd_conn_ring(batch->queue);
+	batch->first = batch->last = NULL;
+}
+
 void nd_conn_teardown_ctrl(struct nd_conn_ctrl *ctrl, bool shutdown)
 {
 	nd_conn_teardown_io_queues(ctrl, shutdown);
@@ -603,7 +727,7 @@ int nd_conn_try_send_data_pdu(struct nd_conn_request *req)
 			}
 			frag = &skb_shinfo(skb)->frags[fragidx];
 		}
-		if(fragidx == skb_shinfo(skb)->nr_frags - 1 && atomic_read(&queue->cur_queue_size) == 1) {
+		if(fragidx == skb_shinfo(skb)->nr_frags - 1 && nd_conn_queue_len_exact(queue) == 1) {
 			flags |= MSG_EOR;
 		} else {
 			flags |= MSG_MORE;
@@ -680,7 +804,7 @@ int nd_conn_try_send(struct nd_conn_queue *queue)
 	// }
 clean:
 	// printk("queue cpu:%d  size %d\n", queue->io_cpu, atomic_read(&queue->cur_queue_size));
-	atomic_dec(&queue->cur_queue_size);
+	WRITE_ONCE(queue->done_tickets, queue->done_tickets + 1);
 	nd_conn_done_send_req(queue);
 	// if (req->state == NVME_TCP_SEND_DDGST)
 	// 	ret = nvme_tcp_try_send_ddgst(req);
@@ -691,18 +815,44 @@ done:
 		pr_err("failed to send request %d\n", ret);
 		// if (ret != -EPIPE && ret != -ECONNRESET)
 		// 	nvme_tcp_fail_request(queue->request);
+		WRITE_ONCE(queue->done_tickets, queue->done_tickets + 1);
 		nd_conn_done_send_req(queue);
 	}
 	return ret;
 }
 uint32_t total_time = 0;
 
+/* a strict class above ours has requests waiting on the same cpu */
+static bool nd_conn_prio_preempted(struct nd_conn_queue *queue)
+{
+	struct nd_conn_ctrl *ctrl = queue->ctrl;
+	struct nd_conn_queue *q;
+	int i, idx;
+
+	for (i = queue->prio_class + 1; i < nd_params.num_prio; i++) {
+		if(!nd_prio_is_strict(i))
+			continue;
+		for (idx = nd_params.prio_channel_idx[i];
+			idx < nd_params.prio_channel_idx[i] + nd_params.prio_num_channels[i] &&
+			idx < ctrl->queue_count; idx++) {
+			q = &ctrl->queues[idx];
+			if(q->io_cpu == queue->io_cpu && !llist_empty(&q->req_list))
+				return true;
+		}
+	}
+	return false;
+}
+
 void nd_conn_io_work(struct work_struct *w)
 {
 	struct nd_conn_queue *queue =
 		container_of(w, struct nd_conn_queue, io_work);
 	unsigned long deadline = jiffies + msecs_to_jiffies(1);
+	/* weighted classes sharing a cpu take turns in proportion to their weight */
+	int quota = nd_prio_is_strict(queue->prio_class) ? INT_MAX :
+		nd_params.prio_weight[queue->prio_class] * ND_CONN_PRIO_QUANTUM;
 	bool pending;
+	int budget;
 	// int bufsize;
 	// int optlen = sizeof(bufsize);
 	// pr_info("queue size:%u\n", atomic_read(&queue->cur_queue_size));
@@ -726,22 +876,25 @@ void nd_conn_io_work(struct work_struct *w)
 		// 	return;
 		if (!pending)
 			break;
+		/* yield; pending requeues us behind the other classes */
+		if (--quota <= 0 || nd_conn_prio_preempted(queue))
+			break;
 	} while (!time_after(jiffies, deadline)); /* quota is exhausted */
 	// ret = kernel_getsockopt(queue->sock, SOL_SOCKET, SO_SNDBUF,
 	// 	(char *)&bufsize, &optlen);
 	// pr_info("ret value:%d\n", ret);
 	// pr_info("buffer size receive:%d\n", bufsize);
 	if(pending) {
-		if(nd_conn_queue_is_lat(queue)) {
-			queue_work_on(queue->io_cpu, nd_conn_wq_lat, &queue->io_work);
-		}else {
-			queue_work_on(queue->io_cpu, nd_conn_wq, &queue->io_work);
-		}
+		queue_work_on(queue->io_cpu, nd_conn_prio_wq(queue->prio_class), &queue->io_work);
 	}
 	// ret = queue_work_on(queue->io_cpu, nd_conn_wq, &queue->io_work);
-	/* To Do: only wake up all socks if there is available space */
-	if(atomic_read(&queue->cur_queue_size) < queue->queue_size)
-			nd_conn_wake_up_all_socks(queue);
+	/* only wake up as many socks as there are free slots */
+	budget = queue->queue_size - nd_conn_queue_len_approx(queue);
+	if(budget > 0) {
+		budget -= nd_conn_wake_up_socks(queue, budget);
+		if(budget > 0)
+			nd_conn_rehome_socks(queue, budget);
+	}
 }
 
 /* assume hold socket lock */
@@ -749,15 +902,13 @@ void nd_conn_add_sleep_sock(struct nd_conn_ctrl *ctrl, struct nd_sock *nsk) {
 	uint32_t qid = 0;
 	struct sock *sk = (struct sock*)(nsk);
 	struct inet_sock *inet = inet_sk(sk);
-	bool pri_class = sk->sk_priority == 0? 0 : 1;
 	struct nd_conn_queue *queue;
 	int src_port = ntohs(inet->inet_sport);
+	int lower_bound, num_queue;
 	if(nsk->sche_policy == SCHE_SRC_PORT) {
-		if(pri_class)
-			qid = src_port % nd_params.num_lat_channels + nd_params.lat_channel_idx;
-		else
-			qid = src_port % nd_params.num_thpt_channels + nd_params.thpt_channel_idx;
-	} else if(nsk->sche_policy == SCHE_RR){
+		nd_conn_sche_range(nsk, nd_prio_class(sk->sk_priority), &lower_bound, &num_queue);
+		qid = src_port % num_queue + lower_bound;
+	} else if(nsk->sche_policy == SCHE_RR || nsk->sche_policy == SCHE_FLOWLET){
 		/* for now pick the current sending queue */
 		qid = nsk->sender.con_queue_id;
 	}
@@ -775,11 +926,7 @@ void nd_conn_add_sleep_sock(struct nd_conn_ctrl *ctrl, struct nd_sock *nsk) {
 	spin_unlock_bh(&queue->sock_wait_lock);
 	/* wake up corresponding queue */
 queue_work:
-	if(nd_conn_queue_is_lat(queue)) {
-		queue_work_on(queue->io_cpu, nd_conn_wq_lat, &queue->io_work);
-	}else {
-		queue_work_on(queue->io_cpu, nd_conn_wq, &queue->io_work);
-	}
+	queue_work_on(queue->io_cpu, nd_conn_prio_wq(queue->prio_class), &queue->io_work);
 }
 
 // void nd_conn_add_sleep_sock(struct nd_conn_ctrl *ctrl, struct nd_sock* nsk) {
@@ -827,6 +974,84 @@ void nd_conn_wake_up_all_socks(struct nd_conn_queue *queue) {
 	spin_unlock_bh(&queue->sock_wait_lock);
 }
 
+/* run tx_work of a sock nobody is sending on, e.g. after async copies finish */
+void nd_conn_kick_sock(struct nd_sock *nsk, int cpu) {
+	queue_work_on(cpu, sock_wait_wq, &nsk->tx_work);
+}
+
+/* wake at most budget socks, oldest first; a sock that blocks again re-queues at the tail */
+int nd_conn_wake_up_socks(struct nd_conn_queue *queue, int budget) {
+	struct nd_sock *nsk, *tmp;
+	int woken = 0;
+	spin_lock_bh(&queue->sock_wait_lock);
+	list_for_each_entry_safe(nsk, tmp, &queue->sock_wait_list, tx_wait_list) {
+		if(woken >= budget)
+			break;
+		WARN_ON(!nsk->sender.wait_on_nd_conns);
+		list_del_init(&nsk->tx_wait_list);
+		queue_work_on(nsk->sender.wait_cpu, sock_wait_wq, &nsk->tx_work);
+		nsk->sender.wait_on_nd_conns = false;
+		nsk->sender.wait_queue = NULL;
+		woken++;
+	}
+	spin_unlock_bh(&queue->sock_wait_lock);
+	return woken;
+}
+
+/* queue has spare slots but no waiters of its own: pull waiters off full sibling
+ * channels of the same class. Only socks that are rescheduled per request can move;
+ * SCHE_SRC_PORT socks are pinned to their channel, flowlet socks until the flowlet drains.
+ */
+/* whether a waiter of the full sibling could put its next request on queue */
+static bool nd_conn_sock_movable(struct nd_conn_queue *queue, struct nd_conn_queue *sibling,
+	struct nd_sock *nsk) {
+	if(nsk->sche_policy == SCHE_SRC_PORT)
+		return false;
+	/* pinned socks only move within their channel set */
+	if(nsk->chan_count > 0 && (queue->qid < nsk->chan_first ||
+		queue->qid >= nsk->chan_first + nsk->chan_count))
+		return false;
+	/* would come straight back to the full sibling */
+	if(nsk->sche_policy == SCHE_FLOWLET && nd_conn_flowlet_pinned(sibling, nsk))
+		return false;
+	return true;
+}
+
+void nd_conn_rehome_socks(struct nd_conn_queue *queue, int budget) {
+	struct nd_conn_ctrl *ctrl = queue->ctrl;
+	struct nd_conn_queue *sibling;
+	struct nd_sock *nsk, *tmp;
+	int lower_bound = nd_params.prio_channel_idx[queue->prio_class];
+	int num_queue = nd_params.prio_num_channels[queue->prio_class];
+	int i, off;
+
+	if(queue->qid < lower_bound || queue->qid >= lower_bound + num_queue)
+		return;
+	for (i = 0; i < num_queue - 1 && budget > 0; i++) {
+		/* offsets 1..num_queue - 1, rotating where the scan starts */
+		off = (queue->rehome_next + i) % (num_queue - 1) + 1;
+		sibling = &ctrl->queues[(queue->qid - lower_bound + off) % num_queue + lower_bound];
+		if(nd_conn_queue_len_approx(sibling) < sibling->queue_size)
+			continue;
+		spin_lock_bh(&sibling->sock_wait_lock);
+		list_for_each_entry_safe(nsk, tmp, &sibling->sock_wait_list, tx_wait_list) {
+			if(budget <= 0)
+				break;
+			/* only socks that can make progress here count against the budget */
+			if(!nd_conn_sock_movable(queue, sibling, nsk))
+				continue;
+			list_del_init(&nsk->tx_wait_list);
+			queue_work_on(nsk->sender.wait_cpu, sock_wait_wq, &nsk->tx_work);
+			nsk->sender.wait_on_nd_conns = false;
+			nsk->sender.wait_queue = NULL;
+			budget--;
+		}
+		spin_unlock_bh(&sibling->sock_wait_lock);
+	}
+	if(num_queue > 1)
+		queue->rehome_next = (queue->rehome_next + 1) % (num_queue - 1);
+}
+
 int nd_conn_alloc_queue(struct nd_conn_ctrl *ctrl,
 		int qid)
 {
@@ -849,15 +1074,11 @@ int nd_conn_alloc_queue(struct nd_conn_ctrl *ctrl,
 	queue->queue_size = ctrl->opts->queue_size;
 	queue->compact_low_thre = ctrl->opts->compact_low_thre;
 	queue->compact_high_thre = ctrl->opts->compact_high_thre;
-	atomic_set(&queue->cur_queue_size, 0);
+	atomic_set(&queue->req_tickets, 0);
+	queue->done_tickets = 0;
 
 
-	if (qid >= ctrl->queue_count / 2) {
-		/* latency-sensitive channel */
-		queue->prio_class = 1;
-	} else
-		/* throughput-bound channel */
-		queue->prio_class = 0;
+	queue->prio_class = nd_channel_prio(qid);
 	// if (qid > 0)
 	// 	queue->cmnd_capsule_len = nctrl->ioccsz * 16;
 	// else
@@ -17,6 +17,8 @@
 extern struct nd_conn_ctrl* nd_ctrl;
 
 #define ND_CONN_AQ_DEPTH		32
+/* requests a weight-1 channel sends per io_work turn */
+#define ND_CONN_PRIO_QUANTUM	16
 enum hctx_type {
 	HCTX_TYPE_DEFAULT,
 	HCTX_TYPE_READ,
@@ -143,8 +145,13 @@ struct nd_conn_queue {
 	// unsigned int		nr_cqe;
 
 	/* send state */
-	struct nd_conn_request *request;
-	atomic_t	cur_queue_size;
+	struct nd_conn_request *request ____cacheline_aligned_in_smp;
+	/* requests ever completed, under send_mutex only; a socket's flowlet has
+	 * drained once done_tickets catches up with the ticket of its last request.
+	 */
+	int		done_tickets;
+	/* requests ever queued, by the app and sender cores */
+	atomic_t	req_tickets ____cacheline_aligned_in_smp;
 	int			queue_size;
 	int			compact_high_thre;
 	int 		compact_low_thre;
@@ -166,19 +173,47 @@ struct nd_conn_queue {
 	spinlock_t sock_wait_lock;
 	struct list_head sock_wait_list;
 	struct workqueue_struct *sock_wait_wq;
+	/* sibling io_work's next rehome scan starts from, so no sibling starves */
+	int rehome_next;
 	
 	void (*state_change)(struct sock *);
 	void (*data_ready)(struct sock *);
 	void (*write_space)(struct sock *);
 };
 
+/* requests queued and not sent yet. Lockless readers, the schedulers, may be
+ * off by the requests racing with the read; the owner of send_mutex only
+ * misses the ones queued after it.
+ */
+static inline int nd_conn_queue_len_approx(struct nd_conn_queue *queue)
+{
+	int len = atomic_read(&queue->req_tickets) - READ_ONCE(queue->done_tickets);
+
+	return max(len, 0);
+}
+
+static inline int nd_conn_queue_len_exact(struct nd_conn_queue *queue)
+{
+	lockdep_assert_held(&queue->send_mutex);
+	return atomic_read(&queue->req_tickets) - queue->done_tickets;
+}
+
 struct nd_conn_pdu {
 	struct ndhdr hdr;
 };
 
+/* requests of one sender bound for the same channel, see nd_conn_queue_request_batch() */
+struct nd_conn_batch {
+	struct nd_conn_queue *queue;
+	struct llist_node *first, *last;
+};
+
 void nd_conn_add_sleep_sock(struct nd_conn_ctrl *ctrl, struct nd_sock* nsk);
 void nd_conn_remove_sleep_sock(struct nd_conn_queue *queue, struct nd_sock* nsk);
 void nd_conn_wake_up_all_socks(struct nd_conn_queue *queue);
+int nd_conn_wake_up_socks(struct nd_conn_queue *queue, int budget);
+void nd_conn_rehome_socks(struct nd_conn_queue *queue, int budget);
+void nd_conn_kick_sock(struct nd_sock *nsk, int cpu);
 
 // int nd_conn_init_request(struct nd_conn_request *req, int queue_id);
 int nd_conn_try_send_cmd_pdu(struct nd_conn_request *req); 
@@ -203,8 +238,14 @@ void nd_conn_data_ready(struct sock *sk);
 int nd_conn_alloc_queue(struct nd_conn_ctrl *ctrl,
 		int qid);
 bool nd_conn_queue_request(struct nd_conn_request *req, struct nd_sock *nsk,
-		bool sync, bool avoid_check, bool last);
+		bool sync, bool avoid_check);
+bool nd_conn_queue_ctrl_request(struct nd_conn_request *req, struct nd_sock *nsk);
+bool nd_conn_queue_request_batch(struct nd_conn_request *req, struct nd_sock *nsk,
+		bool avoid_check, struct nd_conn_batch *batch);
+void nd_conn_batch_flush(struct nd_conn_batch *batch);
 void* nd_conn_find_nd_ctrl(__be32 dst_addr);
+struct nd_conn_queue *nd_conn_sche_dgram(struct nd_conn_ctrl *nd_ctrl, struct nd_sock *nsk,
+	int prio_class, __be16 dport);
 
 // void nd_conn_error_recovery_work(struct work_struct *work);
 void nd_conn_teardown_ctrl(struct nd_conn_ctrl *ctrl, bool shutdown);
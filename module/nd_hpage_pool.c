@@ -0,0 +1,81 @@
+/*
+ * Huge-page buffers for skb construction on the send side.
+ *
+ * A 62KB pdu filled from a 2MB page is one frag, and one kernel_sendpage()
+ * on the channel, instead of two or more from the 32KB page_frag refills;
+ * the pages are recycled by refcount rather than reallocated.
+ */
+#include <linux/gfp.h>
+#include <linux/mm.h>
+
+#include "nd_impl.h"
+#include "nd_hpage_pool.h"
+
+static void nd_hpage_pool_take(struct nd_hpage_pool *pool, int idx)
+{
+	struct page_frag *pfrag = &pool->frag;
+
+	pool->cur = idx;
+	pfrag->page = pool->pages[idx];
+	pfrag->offset = 0;
+	pfrag->size = PAGE_SIZE << ND_HPAGE_ORDER;
+}
+
+/**
+ * nd_hpage_pool_refill() - skb_page_frag_refill() from a huge-page pool
+ * @sz: minimum bytes left in the returned frag
+ *
+ * The caller serializes access to @pool.
+ *
+ * Return: the frag to copy into, or NULL if the pool is off, full of pages
+ * still in flight, or no huge page could be allocated; the caller then
+ * falls back to its regular page_frag.
+ */
+struct page_frag *nd_hpage_pool_refill(struct nd_hpage_pool *pool, unsigned int sz,
+	gfp_t gfp)
+{
+	struct page_frag *pfrag = &pool->frag;
+	int max = min_t(int, READ_ONCE(nd_params.hpage_pool), ND_HPAGE_POOL_MAX);
+	struct page *page;
+	int i, idx;
+
+	if (max <= 0)
+		return NULL;
+	if (pfrag->page) {
+		if (page_ref_count(pfrag->page) == 1) {
+			pfrag->offset = 0;
+			return pfrag;
+		}
+		if (pfrag->offset + sz <= pfrag->size)
+			return pfrag;
+	}
+	for (i = 1; i < pool->nr; i++) {
+		idx = (pool->cur + i) % pool->nr;
+		if (page_ref_count(pool->pages[idx]) == 1) {
+			nd_hpage_pool_take(pool, idx);
+			return pfrag;
+		}
+	}
+	if (pool->nr >= max)
+		return NULL;
+	/* no reclaim or compaction stalls for this; the caller has a fallback */
+	page = alloc_pages((gfp & ~__GFP_DIRECT_RECLAIM) | __GFP_COMP |
+			   __GFP_NOWARN | __GFP_NORETRY, ND_HPAGE_ORDER);
+	if (!page)
+		return NULL;
+	pool->pages[pool->nr] = page;
+	nd_hpage_pool_take(pool, pool->nr++);
+	return pfrag;
+}
+
+/* drop the pool's references; pages still in skbs go when those are freed */
+void nd_hpage_pool_destroy(struct nd_hpage_pool *pool)
+{
+	int i;
+
+	for (i = 0; i < pool->nr; i++)
+		put_page(pool->pages[i]);
+	pool->nr = 0;
+	pool->cur = 0;
+	pool->frag.page = NULL;
+}
@@ -0,0 +1,27 @@
+#ifndef _ND_HPAGE_POOL_H
+#define _ND_HPAGE_POOL_H
+
+#include <linux/mm.h>
+#include <linux/sizes.h>
+
+/* 2MB compound pages */
+#define ND_HPAGE_ORDER		get_order(SZ_2M)
+#define ND_HPAGE_POOL_MAX	8
+
+/* huge pages carved into skb frags of outgoing payload. A page is reused
+ * from the start once the skbs holding frags of it are all freed, i.e. the
+ * pool's reference is the only one left.
+ */
+struct nd_hpage_pool {
+	/* the page being carved */
+	struct page_frag frag;
+	struct page *pages[ND_HPAGE_POOL_MAX];
+	int cur;
+	int nr;
+};
+
+struct page_frag *nd_hpage_pool_refill(struct nd_hpage_pool *pool, unsigned int sz,
+	gfp_t gfp);
+void nd_hpage_pool_destroy(struct nd_hpage_pool *pool);
+
+#endif /* _ND_HPAGE_POOL_H */
@@ -10,10 +10,73 @@
 #include "nd_hashtables.h"
 #include "nd_sock.h"
 #include "nd_target.h"
+#include "nd_pin_cache.h"
+#include "nd_hpage_pool.h"
 extern struct inet_hashinfo nd_hashinfo;
 extern struct nd_params nd_params;
 extern struct request_sock_ops nd_request_sock_ops;
 
+/* map sk_priority to a priority class */
+static inline int nd_prio_class(u32 sk_priority)
+{
+	int i;
+	for (i = nd_params.num_prio - 1; i > 0; i--) {
+		if(sk_priority >= nd_params.prio_min_skprio[i])
+			return i;
+	}
+	return 0;
+}
+
+/* channel index to priority class; channels outside every class range keep the
+ * old half split so both ends agree without extra signaling.
+ */
+static inline int nd_channel_prio(int idx)
+{
+	int i;
+	for (i = nd_params.num_prio - 1; i >= 0; i--) {
+		if(idx >= nd_params.prio_channel_idx[i] &&
+			idx < nd_params.prio_channel_idx[i] + nd_params.prio_num_channels[i])
+			return i;
+	}
+	return idx >= nd_params.total_channels / 2 ? nd_params.num_prio - 1 : 0;
+}
+
+static inline bool nd_prio_is_strict(int prio_class)
+{
+	return nd_params.prio_weight[prio_class] == 0;
+}
+
+/* credit a flow starts with; the grant scheduler hands out the rest */
+static inline u32 nd_grant_init_win(struct nd_sock *nsk)
+{
+	if (nd_params.grant_sched)
+		return min_t(u32, nsk->default_win, nd_params.grant_unsched);
+	return nsk->default_win;
+}
+
+/* receiver.grant_nxt only moves forward; the owner and the grant schedulers race on it */
+static inline bool nd_grant_nxt_advance(struct nd_sock *nsk, u32 grant_nxt)
+{
+	u32 cur = READ_ONCE(nsk->receiver.grant_nxt), old;
+
+	while (after(grant_nxt, cur)) {
+		old = cmpxchg(&nsk->receiver.grant_nxt, cur, grant_nxt);
+		if (old == cur)
+			return true;
+		cur = old;
+	}
+	return false;
+}
+
+/* a grant may move sd_grant_nxt forward by up to the receiver's window, which
+ * moderate_buf grows independently of ours, but never past rmem_max
+ */
+static inline bool nd_grant_acceptable(struct nd_sock *nsk, u32 grant_seq)
+{
+	return grant_seq - nsk->sender.sd_grant_nxt <=
+		max_t(u32, nsk->default_win, READ_ONCE(nd_params.rmem_max));
+}
+
 // extern struct xmit_core_table xmit_core_tab;
 // extern struct rcv_core_table rcv_core_tab;
 void* allocate_hash_table(const char *tablename,
@@ -28,6 +91,19 @@ void* allocate_hash_table(const char *tablename,
 int nd_dointvec(struct ctl_table *table, int write,
                 void __user *buffer, size_t *lenp, loff_t *ppos);
 void nd_sysctl_changed(struct nd_params *params);
+
+/*ND priority queue*/
+void nd_pq_init(struct nd_pq* pq, bool(*comp)(const struct rb_node*, const struct rb_node*));
+bool nd_pq_empty(struct nd_pq* pq);
+bool nd_pq_empty_lockless(struct nd_pq* pq);
+struct rb_node* nd_pq_peek_lockless(struct nd_pq* pq);
+int nd_pq_size(struct nd_pq* pq);
+void nd_pq_delete(struct nd_pq* pq, struct rb_node* node);
+struct rb_node* nd_pq_pop(struct nd_pq* pq);
+void nd_pq_push(struct nd_pq* pq, struct rb_node* node);
+struct rb_node* nd_pq_peek(struct nd_pq* pq);
+void nd_pq_bench_queue(int num);
+void nd_pq_bench_cancel(void);
 void nd_params_init(struct nd_params *params);
 
 /*ND incoming function*/
@@ -38,6 +114,7 @@ int pass_to_vs_layer(struct ndt_conn_queue *ndt_queue, struct sk_buff_head* queu
 int nd_handle_data_pkt(struct sk_buff *skb);
 // int nd_handle_flow_sync_pkt(struct sk_buff *skb);
 int nd_handle_sync_pkt(struct sk_buff *skb);
+int nd_handle_dgram_pkt(struct sk_buff *skb);
 // int nd_handle_sync_pkt(struct sk_buff *skb);
 int nd_handle_token_pkt(struct sk_buff *skb);
 int nd_handle_fin_pkt(struct sk_buff *skb);
@@ -45,6 +122,19 @@ int nd_handle_ack_pkt(struct sk_buff *skb);
 int nd_handle_sync_ack_pkt(struct sk_buff *skb);
 
 int nd_data_queue(struct sock *sk, struct sk_buff *skb);
+void nd_grant_sched_init(void);
+void nd_grant_sched_update(struct sock *sk);
+void nd_grant_sched_remove(struct sock *sk);
+bool nd_grant_credit(struct nd_sock *nsk, u32 budget);
+
+/*ND matching*/
+void nd_match_init(void);
+void nd_match_destroy(void);
+void nd_match_request(struct sock *sk);
+void nd_match_remove(struct sock *sk);
+int nd_handle_rts_pkt(struct sk_buff *skb);
+int nd_handle_grant_pkt(struct sk_buff *skb);
+int nd_handle_accept_pkt(struct sk_buff *skb);
 bool nd_add_backlog(struct sock *sk, struct sk_buff *skb, bool omit_check);
 int nd_v4_do_rcv(struct sock *sk, struct sk_buff *skb);
 
@@ -55,11 +145,12 @@ void nd_page_pool_recycle_pages(struct sk_buff *skb);
 // void nd_flow_wait_handler(struct sock *sk);
 
 /*ND outgoing function*/
-int nd_init_request(struct sock* sk, struct nd_conn_request *req);
+int nd_init_request(struct sock* sk, struct nd_conn_request *req, gfp_t gfp);
 struct nd_conn_request* construct_sync_req(struct sock* sk);
 struct nd_conn_request* construct_sync_ack_req(struct sock* sk);
 struct nd_conn_request* construct_fin_req(struct sock* sk);
 struct nd_conn_request* construct_ack_req(struct sock* sk, gfp_t flag);
+struct nd_conn_request* construct_match_req(struct sock* sk, int type, u32 tag, u32 remaining, gfp_t flag);
 
 // struct sk_buff* construct_flow_sync_pkt(struct sock* sk, __u64 message_id, 
 // 	uint32_t message_size, __u64 start_time);
@@ -74,6 +165,7 @@ int __nd4_lib_err(struct sk_buff *, u32, struct udp_table *);
 int nd_v4_get_port(struct sock *sk, unsigned short snum);
 void nd_v4_rehash(struct sock *sk);
 
+void nd_inherit_sockopts(struct sock *parent, struct sock *child);
 int nd_setsockopt(struct sock *sk, int level, int optname,
 		   char __user *optval, unsigned int optlen);
 int nd_getsockopt(struct sock *sk, int level, int optname,
@@ -87,7 +179,8 @@ int compat_nd_getsockopt(struct sock *sk, int level, int optname,
 #endif
 int nd_push(struct sock *sk, gfp_t flag);
 
-void nd_release_pages(struct bio_vec* bv_arr, bool mark_dirty, int max_segs);
+void nd_release_pages(struct bio_vec* bv_arr, struct nd_pin_region *region,
+	bool mark_dirty, int max_segs);
 int nd_recvmsg(struct sock *sk, struct msghdr *msg, size_t len, int noblock,
 		int flags, int *addr_len);
 /* new recvmsg syscall */
@@ -334,10 +334,10 @@ static inline void nd_send_grant(struct nd_sock *nsk, bool sync) {
 	
 	// printk("new grant nxt:%u\n", new_);
 	if(new_grant_nxt - nsk->receiver.grant_nxt <= nsk->default_win && new_grant_nxt != nsk->receiver.grant_nxt
-		&& new_grant_nxt - nsk->receiver.grant_nxt >= nsk->default_win / 16) {
+		&& new_grant_nxt - nsk->receiver.grant_nxt >= nsk->default_win / 16 &&
+		nd_grant_nxt_advance(nsk, new_grant_nxt)) {
 		/* send ack pkt for new window */
-		 nsk->receiver.grant_nxt = new_grant_nxt;
-		nd_conn_queue_request(construct_ack_req(sk, flag), nsk, sync, true, true);
+		nd_conn_queue_request(construct_ack_req(sk, flag), nsk, sync, true);
 		if(nd_params.nd_debug)
 			pr_info("grant next update:%u\n", nsk->receiver.grant_nxt);
 	} else {
@@ -348,6 +348,119 @@ static inline void nd_send_grant(struct nd_sock *nsk, bool sync) {
 		// }
 	}
 }
+/* receiver-driven grant scheduling: inbound flows wait in one queue ordered by
+ * the bytes their senders still have to deliver (SRPT); only the
+ * grant_overcommit shortest flows get new credit beyond grant_unsched.
+ */
+static struct nd_grant_sched {
+	spinlock_t lock;
+	struct nd_pq pq;
+} nd_grant_sched;
+
+static bool nd_grant_compare(const struct rb_node* node1, const struct rb_node* node2) {
+	struct nd_sock *e1 = rb_entry(node1, struct nd_sock, receiver.grant_link);
+	struct nd_sock *e2 = rb_entry(node2, struct nd_sock, receiver.grant_link);
+	/* ties keep arrival order */
+	return e1->receiver.grant_remaining >= e2->receiver.grant_remaining;
+}
+
+void nd_grant_sched_init(void)
+{
+	spin_lock_init(&nd_grant_sched.lock);
+	nd_pq_init(&nd_grant_sched.pq, nd_grant_compare);
+}
+
+/* extend the grant of a scheduled flow by at most @budget bytes. The scheduler
+ * does not hold the socket lock, so grant_nxt only moves forward by cmpxchg.
+ */
+bool nd_grant_credit(struct nd_sock *nsk, u32 budget)
+{
+	u32 adv_seq = READ_ONCE(nsk->receiver.adv_seq);
+	u32 grant_nxt = READ_ONCE(nsk->receiver.grant_nxt);
+	u32 new_grant_nxt = (u32)atomic_read(&nsk->receiver.rcv_nxt) + nd_window_size(nsk);
+
+	if (after(new_grant_nxt, adv_seq))
+		new_grant_nxt = adv_seq;
+	if (!after(new_grant_nxt, grant_nxt))
+		return false;
+	/* the sender drops grants that jump past its window */
+	budget = min_t(u32, budget, nsk->default_win);
+	if (new_grant_nxt - grant_nxt > budget)
+		new_grant_nxt = grant_nxt + budget;
+	/* batch small increments unless they finish the flow */
+	if (new_grant_nxt != adv_seq && new_grant_nxt - grant_nxt < nsk->default_win / 16)
+		return false;
+	return nd_grant_nxt_advance(nsk, new_grant_nxt);
+}
+
+/* reposition (or drop) @nsk in the SRPT queue and re-grant the head flows */
+static void __nd_grant_sched(struct nd_sock *nsk, bool active)
+{
+	struct nd_sock *grantees[ND_MAX_GRANT_OVERCOMMIT];
+	struct rb_node *popped[ND_MAX_GRANT_OVERCOMMIT];
+	struct rb_node *node;
+	struct nd_sock *entry;
+	int i, num_popped = 0, num_grants = 0;
+	u32 rcv_nxt;
+
+	spin_lock_bh(&nd_grant_sched.lock);
+	nd_pq_delete(&nd_grant_sched.pq, &nsk->receiver.grant_link);
+	rcv_nxt = (u32)atomic_read(&nsk->receiver.rcv_nxt);
+	if (active && after(READ_ONCE(nsk->receiver.adv_seq), rcv_nxt)) {
+		nsk->receiver.grant_remaining = READ_ONCE(nsk->receiver.adv_seq) - rcv_nxt;
+		nd_pq_push(&nd_grant_sched.pq, &nsk->receiver.grant_link);
+	}
+	while (num_popped < nd_params.grant_overcommit &&
+		(node = nd_pq_pop(&nd_grant_sched.pq)) != NULL) {
+		popped[num_popped++] = node;
+		entry = rb_entry(node, struct nd_sock, receiver.grant_link);
+		if (nd_grant_credit(entry, entry->default_win)) {
+			sock_hold((struct sock*)entry);
+			grantees[num_grants++] = entry;
+		}
+	}
+	for (i = 0; i < num_popped; i++)
+		nd_pq_push(&nd_grant_sched.pq, popped[i]);
+	spin_unlock_bh(&nd_grant_sched.lock);
+
+	for (i = 0; i < num_grants; i++) {
+		struct sock *sk = (struct sock*)grantees[i];
+
+		if (READ_ONCE(sk->sk_state) == ND_ESTABLISH) {
+			nd_conn_queue_ctrl_request(construct_ack_req(sk, GFP_ATOMIC), grantees[i]);
+			if(nd_params.nd_debug)
+				pr_info("sched grant next update:%u\n", grantees[i]->receiver.grant_nxt);
+		}
+		sock_put(sk);
+	}
+}
+
+/* called by the socket owner after rcv_nxt or the window moves */
+void nd_grant_sched_update(struct sock *sk)
+{
+	struct nd_sock *nsk = nd_sk(sk);
+	u32 rcv_nxt = (u32)atomic_read(&nsk->receiver.rcv_nxt);
+	int headroom = rcv_nxt + nd_window_size(nsk) - READ_ONCE(nsk->receiver.grant_nxt);
+
+	/* a queued flow that could not be granted a batch anyway keeps its place;
+	 * its rank is at most a batch stale, and the lock is taken once per batch
+	 * received instead of once per packet
+	 */
+	if (sk->sk_state == ND_ESTABLISH && !RB_EMPTY_NODE(&nsk->receiver.grant_link) &&
+		before(rcv_nxt, READ_ONCE(nsk->receiver.adv_seq)) &&
+		headroom < (int)(nsk->default_win / 16))
+		return;
+	__nd_grant_sched(nsk, sk->sk_state == ND_ESTABLISH);
+}
+
+/* a closing flow frees its slot for the next shortest one */
+void nd_grant_sched_remove(struct sock *sk)
+{
+	if (nd_params.grant_sched != ND_GRANT_SRPT && RB_EMPTY_NODE(&nd_sk(sk)->receiver.grant_link))
+		return;
+	__nd_grant_sched(nd_sk(sk), false);
+}
+
 static void nd_drop(struct sock *sk, struct sk_buff *skb)
 {
         sk_drops_add(sk, skb);
@@ -366,7 +479,8 @@ static void nd_v4_fill_cb(struct sk_buff *skb,
         ND_SKB_CB(skb)->seq = ntohl(dh->seq);
         // printk("skb len:%d\n", skb->len);
         // printk("segment length:%d\n", ntohl(dh->seg.segment_length));
-        ND_SKB_CB(skb)->end_seq = ND_SKB_CB(skb)->seq + skb->len - dh->doff / 4;
+        ND_SKB_CB(skb)->end_seq = ND_SKB_CB(skb)->seq + skb->len - __nd_hdrlen(dh);
+        ND_SKB_CB(skb)->eor = dh->doff & ND_DOFF_EOR;
         // TCP_SKB_CB(skb)->ack_seq = ntohl(th->ack_seq);
         // TCP_SKB_CB(skb)->tcp_flags = tcp_flag_byte(th);
         // TCP_SKB_CB(skb)->tcp_tw_isn = 0;
@@ -402,6 +516,9 @@ static bool nd_try_coalesce(struct sock *sk,
 	/* Its possible this segment overlaps with prior segment in queue */
 	if (ND_SKB_CB(from)->seq != ND_SKB_CB(to)->end_seq)
 		return false;
+	/* keep message boundaries at skb ends */
+	if (ND_SKB_CB(to)->eor)
+		return false;
 	// pr_info("to len: %d\n", to->len);
 	// pr_info("to truesize len: %d\n", to->truesize);
 
@@ -420,6 +537,7 @@ static bool nd_try_coalesce(struct sock *sk,
 	// sk_mem_charge(sk, delta);
 	// NET_INC_STATS(sock_net(sk), LINUX_MIB_TCPRCVCOALESCE);
 	ND_SKB_CB(to)->end_seq = ND_SKB_CB(from)->end_seq;
+	ND_SKB_CB(to)->eor = ND_SKB_CB(from)->eor;
 	// ND_SKB_CB(to)->ack_seq = ND_SKB_CB(from)->ack_seq;
 	// ND_SKB_CB(to)->tcp_flags |= ND_SKB_CB(from)->tcp_flags;
 
@@ -664,6 +782,9 @@ int nd_handle_sync_pkt(struct sk_buff *skb) {
 		// sk = __nd4_lib_lookup_skb(skb, fh->common.source, fh->common.dest, &nd_table);
 	// }
 	if(sk) {
+		/* datagram endpoints take no connections */
+		if(nd_sk(sk)->dgram)
+			goto drop;
 		child = nd_conn_request(sk, skb);
 		if(child) {
 			nsk = nd_sk(child);
@@ -677,7 +798,7 @@ int nd_handle_sync_pkt(struct sk_buff *skb) {
 			// }
 			/* currently assume at the target side */
 			/* ToDo: sync can be true; */
-			nd_conn_queue_request(construct_sync_ack_req(child), nsk, false, true, true);
+			nd_conn_queue_request(construct_sync_ack_req(child), nsk, false, true);
 		}
 	} else {
 		goto free;
@@ -694,6 +815,51 @@ free:
 	return 0;
 }
 
+/* a connectionless message: demux by the destination port and queue it whole;
+ * like udp, it is dropped when the endpoint's rcvbuf is full.
+ */
+int nd_handle_dgram_pkt(struct sk_buff *skb)
+{
+	struct ndhdr *dh;
+	struct sock *sk;
+	int sdif = inet_sdif(skb);
+	bool refcounted = false;
+
+	if (!pskb_may_pull(skb, sizeof(struct ndhdr)))
+		goto free;
+	dh = nd_hdr(skb);
+	sk = __nd_lookup_skb(&nd_hashinfo, skb, __nd_hdrlen(dh), dh->source,
+		dh->dest, sdif, &refcounted);
+	if (!sk)
+		goto free;
+	if (!nd_sk(sk)->dgram)
+		goto drop;
+	ND_SKB_CB(skb)->sport = dh->source;
+	ND_SKB_CB(skb)->saddr = ip_hdr(skb)->saddr;
+	bh_lock_sock(sk);
+	if (sk->sk_state != ND_LISTEN ||
+		atomic_read(&sk->sk_rmem_alloc) + skb->truesize > READ_ONCE(sk->sk_rcvbuf)) {
+		bh_unlock_sock(sk);
+		goto drop;
+	}
+	__skb_pull(skb, __nd_hdrlen(dh));
+	skb->sk = sk;
+	skb->destructor = nd_rfree;
+	atomic_add(skb->truesize, &sk->sk_rmem_alloc);
+	/* recvmsg dequeues under the queue lock without the bh lock */
+	skb_queue_tail(&sk->sk_receive_queue, skb);
+	skb = NULL;
+	if (!sock_flag(sk, SOCK_DEAD))
+		sk->sk_data_ready(sk);
+	bh_unlock_sock(sk);
+drop:
+	if (refcounted)
+		sock_put(sk);
+free:
+	kfree_skb(skb);
+	return 0;
+}
+
 // ktime_t start, end;
 // __u32 backlog_time = 0;
 int nd_handle_token_pkt(struct sk_buff *skb) {
@@ -786,7 +952,7 @@ int nd_handle_ack_pkt(struct sk_buff *skb) {
 		dsk = nd_sk(sk);
 	// 	// dsk->sender.snd_una = ah->grant_seq > dsk->sender.snd_una ? ah->rcv_nxt: dsk->sender.snd_una;
 		if (!sock_owned_by_user(sk)) {
-			if(ntohl(ah->grant_seq) - dsk->sender.sd_grant_nxt <= dsk->default_win) {
+			if(nd_grant_acceptable(dsk, ntohl(ah->grant_seq))) {
 				dsk->sender.sd_grant_nxt = ntohl(ah->grant_seq);
 				err = nd_push(sk, GFP_ATOMIC);
 				if(sk_stream_memory_free(sk)) {
@@ -818,6 +984,18 @@ int nd_handle_ack_pkt(struct sk_buff *skb) {
 }
 
 
+/* the SYNC_ACK carries the receiver's initial grant; a receiver with a larger
+ * window than ours lets us send past our own initial credit right away
+ */
+static void nd_sync_ack_grant(struct sock *sk, struct ndhdr *nh)
+{
+	struct nd_sock *nsk = nd_sk(sk);
+	u32 grant = ntohl(nh->grant_seq);
+
+	if (after(grant, nsk->sender.sd_grant_nxt) && nd_grant_acceptable(nsk, grant))
+		nsk->sender.sd_grant_nxt = grant;
+}
+
 int nd_handle_sync_ack_pkt(struct sk_buff *skb) {
 	// struct nd_sock *dsk;
 	// struct inet_sock *inet;
@@ -844,6 +1022,7 @@ int nd_handle_sync_ack_pkt(struct sk_buff *skb) {
 	if(sk) {
 		bh_lock_sock(sk);
 		if(!sock_owned_by_user(sk)) {
+			nd_sync_ack_grant(sk, nh);
 			sk->sk_state = ND_ESTABLISH;
 			sk->sk_data_ready(sk);
 			kfree_skb(skb);
@@ -1063,7 +1242,7 @@ bool nd_add_backlog(struct sock *sk, struct sk_buff *skb, bool omit_check)
 
 static void nd_handle_data_skb_new(struct sock* sk, struct sk_buff* skb) {
 		// pr_info("ND_SKB_CB(head)->seq = seq:%u core:%d \n", ND_SKB_CB(skb)->seq, raw_smp_processor_id());
-		__skb_pull(skb, nd_hdr(skb)->doff >> 2);
+		__skb_pull(skb, __nd_hdrlen(nd_hdr(skb)));
 		nd_data_queue(sk, skb);
 	return ;
 }
@@ -1077,6 +1256,8 @@ static void nd_handle_data_pkt_lock(struct sock *sk, struct sk_buff *skb) {
 		//  printk("put into the data queue\n");
 		nd_handle_data_skb_new(sk, skb);
 		// nd_send_grant(dsk, false);
+		if (nd_params.grant_sched == ND_GRANT_SRPT)
+			nd_grant_sched_update(sk);
 		if (!sock_flag(sk, SOCK_DEAD)) {
 			sk->sk_data_ready(sk);
 		}
@@ -1089,6 +1270,46 @@ static void nd_handle_data_pkt_lock(struct sock *sk, struct sk_buff *skb) {
 	}
 	return;
 }
+
+/* parked skbs are kept sorted by end_seq, so the ones that fit the window form a prefix */
+static void nd_hol_queue_insert(struct nd_sock *dsk, struct sk_buff *skb)
+{
+	struct sk_buff_head *list = &dsk->receiver.sk_hol_queue;
+	struct sk_buff *prev = skb_peek_tail(list);
+
+	/* arrivals are mostly in order; walk back from the tail */
+	while (prev && after(ND_SKB_CB(prev)->end_seq, ND_SKB_CB(skb)->end_seq))
+		prev = skb_queue_is_first(list, prev) ? NULL : prev->prev;
+	if (prev)
+		__skb_queue_after(list, prev, skb);
+	else
+		__skb_queue_head(list, skb);
+}
+
+static inline bool nd_hol_skb_fits(struct nd_sock *dsk, struct sk_buff *skb)
+{
+	/* this might underestimate the current buffer size if socket is handling its backlog */
+	return ND_SKB_CB(skb)->end_seq - (u32)atomic_read(&dsk->receiver.rcv_nxt) < nd_window_size(dsk);
+}
+
+/* drop the channel's HOL accounting for a parked skb; resume acks once the channel is clear */
+static void nd_hol_release(struct sk_buff *skb)
+{
+	struct ndt_conn_queue *queue = ND_SKB_CB(skb)->queue;
+	struct tcp_sock *tp = tcp_sk(queue->sock->sk);
+
+	atomic_sub(skb->truesize, &tp->hol_alloc);
+	atomic_sub(skb->len, &tp->hol_len);
+	ndt_hol_update_timeout(queue, ktime_us_delta(ktime_get(), skb->tstamp));
+	if(atomic_read(&tp->hol_alloc) == 0) {
+		queue_work_on(queue_cpu(queue), ndt_conn_prio_wq(queue), &queue->delay_ack_work);
+		if(hrtimer_active(&queue->hol_timer)) {
+			hrtimer_cancel(&queue->hol_timer);
+		}
+	}
+	ND_SKB_CB(skb)->queue = NULL;
+}
+
 /**
  * nd_data_pkt() - Handler for incoming DATA packets
  * @skb:     Incoming packet; size known to be large enough for the header.
@@ -1104,7 +1325,8 @@ int nd_handle_data_pkt(struct sk_buff *skb)
 	struct nd_sock *dsk;
 	struct ndhdr *dh;
 	struct sock *sk;
-	struct sk_buff *wait_skb, *tmp;
+	struct sk_buff *wait_skb;
+	struct ndt_conn_queue *queue;
 	struct iphdr *iph;
 	/* ToDo: get sdif value; now it is polluted by TCP layer */
 	// int sdif = inet_sdif(skb);
@@ -1146,29 +1368,16 @@ int nd_handle_data_pkt(struct sk_buff *skb)
 			bh_unlock_sock(sk);
 			goto drop;
 		}
-		/* To Do: check sk_hol_queue */
-		skb_queue_walk_safe(&dsk->receiver.sk_hol_queue, wait_skb, tmp) {
-			/* this might underestimate the current buffer size if socket is handling its backlog */
-			if(ND_SKB_CB(wait_skb)->end_seq - (u32)atomic_read(&dsk->receiver.rcv_nxt) >=  nd_window_size(dsk)) {
-				continue;
-			}
+		/* DATA carries the sender's write_seq in grant_seq */
+		if (after(ntohl(dh->grant_seq), dsk->receiver.adv_seq))
+			WRITE_ONCE(dsk->receiver.adv_seq, ntohl(dh->grant_seq));
+		/* only the prefix of sk_hol_queue can fit in the window */
+		while ((wait_skb = skb_peek(&dsk->receiver.sk_hol_queue)) != NULL) {
+			if(!nd_hol_skb_fits(dsk, wait_skb))
+				break;
 			__skb_unlink(wait_skb, &dsk->receiver.sk_hol_queue);
-			atomic_sub(wait_skb->truesize, &tcp_sk(ND_SKB_CB(wait_skb)->queue->sock->sk)->hol_alloc);
-			atomic_sub(wait_skb->len, &tcp_sk(ND_SKB_CB(wait_skb)->queue->sock->sk)->hol_len);
-			// printk("reduce hol alloc:%d\n", atomic_read(&tcp_sk(wait_skb->sk)->hol_alloc));
-			if(atomic_read(&tcp_sk(ND_SKB_CB(wait_skb)->queue->sock->sk)->hol_alloc) == 0) {
-				if(ndt_conn_is_latency(ND_SKB_CB(skb)->queue)) {
-					queue_work_on(queue_cpu(ND_SKB_CB(skb)->queue), ndt_conn_wq_lat, &ND_SKB_CB(skb)->queue->delay_ack_work);
-				} else {
-					queue_work_on(queue_cpu(ND_SKB_CB(skb)->queue), ndt_conn_wq, &ND_SKB_CB(skb)->queue->delay_ack_work);
-				}
-				if(hrtimer_active(&ND_SKB_CB(skb)->queue->hol_timer)) {
-					hrtimer_cancel(&ND_SKB_CB(skb)->queue->hol_timer);
-				}
-			}		
-			ND_SKB_CB(wait_skb)->queue = NULL;
+			nd_hol_release(wait_skb);
 			nd_handle_data_pkt_lock(sk, wait_skb);
-
 		}
         // ret = 0;
 		// printk("atomic backlog len:%d\n", atomic_read(&dsk->receiver.backlog_len));
@@ -1184,12 +1393,19 @@ int nd_handle_data_pkt(struct sk_buff *skb)
 			if(ND_SKB_CB(skb)->end_seq == (u32)atomic_read(&dsk->receiver.rcv_nxt)) {
 				WARN_ON(true);
 			}
+			queue = ND_SKB_CB(skb)->queue;
+			if(atomic_read(&tcp_sk(queue->sock->sk)->hol_len) + skb->len > queue->hol_budget) {
+				/* channel HOL budget is used up: overcommit this socket rather than stall the channel */
+				nd_handle_data_pkt_lock(sk, skb);
+				goto unlock;
+			}
 			/* increment hol_alloc size of tcp socket */
-			atomic_add(skb->truesize, &tcp_sk(ND_SKB_CB(skb)->queue->sock->sk)->hol_alloc);
-			atomic_add(skb->len, &tcp_sk(ND_SKB_CB(skb)->queue->sock->sk)->hol_len);
+			atomic_add(skb->truesize, &tcp_sk(queue->sock->sk)->hol_alloc);
+			atomic_add(skb->len, &tcp_sk(queue->sock->sk)->hol_len);
 
 			/* add to hol skb to the socket wait queue */
-			__skb_queue_tail(&dsk->receiver.sk_hol_queue, skb);
+			skb->tstamp = ktime_get();
+			nd_hol_queue_insert(dsk, skb);
 			/* add to wait queue flags */
 			test_and_set_bit(ND_WAIT_DEFERRED, &sk->sk_tsq_flags);
 			// printk("add hol alloc:%d  seq:%u rcv next:%u copied seq:%u core:%d\n", atomic_read(&tcp_sk(ND_SKB_CB(skb)->queue->sock->sk)->hol_alloc),
@@ -1199,6 +1415,7 @@ int nd_handle_data_pkt(struct sk_buff *skb)
 		
 
 		}
+unlock:
 		/* handle the current pkt */
         bh_unlock_sock(sk);
 	} else {
@@ -1257,6 +1474,8 @@ int nd_v4_do_rcv(struct sock *sk, struct sk_buff *skb) {
 	if(dh->type == DATA) {
 		nd_handle_data_skb_new(sk, skb);
 		// nd_send_grant(dsk, true);
+		if (nd_params.grant_sched == ND_GRANT_SRPT)
+			nd_grant_sched_update(sk);
 		if (!sock_flag(sk, SOCK_DEAD)) {
 			sk->sk_data_ready(sk);
 		}
@@ -1274,7 +1493,7 @@ int nd_v4_do_rcv(struct sock *sk, struct sk_buff *skb) {
 		// pr_info("backlog:%u\n", ntohl(dh->grant_seq));
 		// pr_info("receive ack in backlog\n");
 		// pr_info("handle ack in backlog\n");
-		if(ntohl(dh->grant_seq) - dsk->sender.sd_grant_nxt <= dsk->default_win) {
+		if(nd_grant_acceptable(dsk, ntohl(dh->grant_seq))) {
 			dsk->sender.sd_grant_nxt = ntohl(dh->grant_seq);
 		}
 		/*has to do nd push and check seq */
@@ -1289,6 +1508,7 @@ int nd_v4_do_rcv(struct sock *sk, struct sk_buff *skb) {
 			nd_conn_add_sleep_sock(dsk->nd_ctrl, dsk);
 		}
 	} else if (dh->type == SYNC_ACK) {
+		nd_sync_ack_grant(sk, dh);
 		sk->sk_state = ND_ESTABLISH;
 		sk->sk_data_ready(sk);
 	}
@@ -1322,7 +1542,7 @@ void nd_release_cb(struct sock *sk)
 {
 	unsigned long flags, nflags;
 	struct nd_sock* nsk = nd_sk(sk);
-	struct sk_buff *skb, *tmp;
+	struct sk_buff *skb;
 	/* perform an atomic operation only if at least one flag is set */
 	do {
 		flags = sk->sk_tsq_flags;
@@ -1361,27 +1581,12 @@ void nd_release_cb(struct sock *sk)
 	// }
 	/* handle pkts in the wait queue */
 	if (flags & NDF_WAIT_DEFERRED) {
-		skb_queue_walk_safe(&nsk->receiver.sk_hol_queue, skb, tmp) {
-			/* this might underestimate the current buffer size if socket is handling its backlog */
-			if(ND_SKB_CB(skb)->end_seq - (u32)atomic_read(&nsk->receiver.rcv_nxt) >= nd_window_size(nsk)) {
-				// printk("release cb hol pkt seq:%u mem:%u rcv nxt:%u \n",ND_SKB_CB(skb)->seq, atomic_read(&sk->sk_rmem_alloc),  nsk->receiver.rcv_nxt );
-				continue;
-			}
+		while ((skb = skb_peek(&nsk->receiver.sk_hol_queue)) != NULL) {
+			if(!nd_hol_skb_fits(nsk, skb))
+				break;
 			__skb_unlink(skb, &nsk->receiver.sk_hol_queue);
 			/* reduce the truesize of hol_alloc of tcp socket */
-			atomic_sub(skb->truesize, &tcp_sk(ND_SKB_CB(skb)->queue->sock->sk)->hol_alloc);
-			atomic_sub(skb->len, &tcp_sk(ND_SKB_CB(skb)->queue->sock->sk)->hol_len);
-			if(atomic_read(&tcp_sk(ND_SKB_CB(skb)->queue->sock->sk)->hol_alloc) == 0) {
-				if(ndt_conn_is_latency(ND_SKB_CB(skb)->queue)) {
-					queue_work_on(queue_cpu(ND_SKB_CB(skb)->queue), ndt_conn_wq_lat, &ND_SKB_CB(skb)->queue->delay_ack_work);
-				} else {
-					queue_work_on(queue_cpu(ND_SKB_CB(skb)->queue), ndt_conn_wq, &ND_SKB_CB(skb)->queue->delay_ack_work);
-				}
-				if(hrtimer_active(&ND_SKB_CB(skb)->queue->hol_timer)) {
-					hrtimer_cancel(&ND_SKB_CB(skb)->queue->hol_timer);
-				}
-			}
-			ND_SKB_CB(skb)->queue = NULL;
+			nd_hol_release(skb);
 			nd_handle_data_skb_new(sk, skb);
 
 			/* To Do: we might need to wake up the corresponding queue to send ack? */
@@ -1645,7 +1850,7 @@ int pass_to_vs_layer(struct ndt_conn_queue *ndt_queue, struct sk_buff_head* queu
 		// skb_dump(KERN_WARNING, skb, false);
 		// WARN_ON(nh->type != DATA && nh->type != SYNC);
 		/* this layer could do sort of GRO stuff later */
-		if(nh->type == DATA) {
+		if(nh->type == DATA || nh->type == DGRAM) {
 			if(!skb_has_frag_list(skb)) {
 				/* first time to handle the skb */
 				// skb_shinfo(head)->frag_list = NULL;
@@ -1692,8 +1897,11 @@ int pass_to_vs_layer(struct ndt_conn_queue *ndt_queue, struct sk_buff_head* queu
 		// WARN_ON(READ_ONCE(sk->sk_rx_dst) == NULL);
 		skb_dst_set_noref(skb, ndt_queue->dst);
 		/* To Do: add reference count for sk in the future */
-		if(nh->type == DATA)
+		if(nh->type == DATA) {
 			ND_SKB_CB(skb)->queue = ndt_queue;
+			/* the channel class is the sender's class for this payload */
+			ND_SKB_CB(skb)->prio_class = ndt_queue->prio_class;
+		}
 		// pr_info("ND_SKB_CB(skb)->total_len:%u\n", ND_SKB_CB(skb)->total_len);
 		// if(nh->type == DATA) {
 		// 	pr_info("receive skb:%u CORE:%d\n", ntohl(nh->seq), raw_smp_processor_id());
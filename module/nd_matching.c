@@ -0,0 +1,360 @@
+/* Copyright (c) 2019-2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* This file implements PIM-style matching between senders with a backlog
+ * and receivers (grant_sched = ND_GRANT_PIM). Time is cut into epochs of
+ * num_iters iterations, each iter_size ns long. In every iteration, blocked
+ * flows that are still unmatched send RTS; a receiver GRANTs the shortest
+ * requests it still has room for; a sender ACCEPTs the shortest grants it
+ * heard. An accepted flow gets an epoch's worth of credit through the usual
+ * ACK grant. Both sides match at most grant_overcommit flows per epoch, so a
+ * many-to-one burst is admitted a few senders at a time instead of all at once.
+ */
+
+#include "nd_host.h"
+#include "nd_impl.h"
+
+struct nd_match_tab {
+	spinlock_t lock;
+	struct hrtimer timer;
+	bool armed;
+	bool exiting;
+	/* local epoch, starting at 1, and the iteration within it */
+	u32 epoch;
+	int iter;
+	int rcv_matched;
+	int snd_matched;
+	/* sender: flows blocked on credit */
+	struct list_head rts_list;
+	/* receiver: RTS heard in this iteration */
+	struct nd_pq rts_q;
+	/* sender: GRANTs heard in this iteration */
+	struct nd_pq grant_q;
+};
+
+static struct nd_match_tab nd_match_tab;
+
+/* the wire tag keeps 24 bits of epoch and 8 bits of iteration */
+static inline u32 nd_match_tag(u32 epoch, int iter)
+{
+	return (epoch << 8) | (iter & 0xff);
+}
+
+static inline bool nd_match_tag_fresh(struct nd_match_tab *tab, u32 tag)
+{
+	/* an accept may cross our epoch boundary once */
+	return (tag >> 8) == (tab->epoch & 0xffffff) ||
+		(tag >> 8) == ((tab->epoch - 1) & 0xffffff);
+}
+
+/* bytes a matched flow may send in one epoch; bandwidth is in Gbps */
+static inline u32 nd_match_epoch_bytes(void)
+{
+	u64 bytes = (u64)nd_params.epoch_size * nd_params.bandwidth / 8;
+
+	return max_t(u64, bytes / nd_params.grant_overcommit, ND_MAX_SKB_LEN);
+}
+
+static bool nd_match_rts_compare(const struct rb_node* node1, const struct rb_node* node2) {
+	struct nd_sock *e1 = rb_entry(node1, struct nd_sock, receiver.match_node);
+	struct nd_sock *e2 = rb_entry(node2, struct nd_sock, receiver.match_node);
+	return e1->receiver.match_remaining >= e2->receiver.match_remaining;
+}
+
+static bool nd_match_grant_compare(const struct rb_node* node1, const struct rb_node* node2) {
+	struct nd_sock *e1 = rb_entry(node1, struct nd_sock, sender.match_node);
+	struct nd_sock *e2 = rb_entry(node2, struct nd_sock, sender.match_node);
+	return e1->sender.match_remaining >= e2->sender.match_remaining;
+}
+
+/* hold the table lock */
+static void nd_match_arm(struct nd_match_tab *tab)
+{
+	if (tab->armed || tab->exiting)
+		return;
+	tab->armed = true;
+	hrtimer_start(&tab->timer, ns_to_ktime(nd_params.iter_size), HRTIMER_MODE_REL_SOFT);
+}
+
+static void nd_match_send(struct nd_sock *nsk, int type, u32 tag, u32 remaining)
+{
+	struct sock *sk = (struct sock*)nsk;
+	struct nd_conn_request *req;
+
+	if (READ_ONCE(sk->sk_state) != ND_ESTABLISH)
+		return;
+	/* timer context: nothing of the socket's owner may be touched */
+	req = construct_match_req(sk, type, tag, remaining, GFP_ATOMIC);
+	nd_conn_queue_ctrl_request(req, nsk);
+}
+
+static enum hrtimer_restart nd_match_tick(struct hrtimer *timer)
+{
+	struct nd_match_tab *tab = container_of(timer, struct nd_match_tab, timer);
+	struct nd_sock *nsk, *tmp;
+	struct rb_node *node;
+	int granted = 0;
+	bool rearm;
+	u32 tag;
+
+	spin_lock_bh(&tab->lock);
+	if (++tab->iter >= nd_params.num_iters) {
+		tab->epoch++;
+		tab->iter = 0;
+		tab->rcv_matched = 0;
+		tab->snd_matched = 0;
+	}
+	tag = nd_match_tag(tab->epoch, tab->iter);
+
+	/* sender: accept the shortest grants heard in the last iteration */
+	while ((node = nd_pq_pop(&tab->grant_q)) != NULL) {
+		nsk = rb_entry(node, struct nd_sock, sender.match_node);
+		if (tab->snd_matched < nd_params.grant_overcommit &&
+			nsk->sender.match_epoch != tab->epoch) {
+			nsk->sender.match_epoch = tab->epoch;
+			tab->snd_matched++;
+			nd_match_send(nsk, ACCEPT, nsk->sender.match_tag, 0);
+		}
+		sock_put((struct sock*)nsk);
+	}
+
+	/* receiver: grant the shortest requests while there is room in this epoch */
+	while ((node = nd_pq_pop(&tab->rts_q)) != NULL) {
+		nsk = rb_entry(node, struct nd_sock, receiver.match_node);
+		if (granted < nd_params.grant_overcommit - tab->rcv_matched &&
+			nsk->receiver.match_epoch != tab->epoch) {
+			nd_match_send(nsk, GRANT, tag, nsk->receiver.match_remaining);
+			granted++;
+		}
+		sock_put((struct sock*)nsk);
+	}
+
+	/* sender: unmatched blocked flows ask again */
+	list_for_each_entry_safe(nsk, tmp, &tab->rts_list, sender.match_link) {
+		u32 write_seq = READ_ONCE(nsk->sender.write_seq);
+		u32 grant_nxt = READ_ONCE(nsk->sender.sd_grant_nxt);
+
+		if (READ_ONCE(((struct sock*)nsk)->sk_state) != ND_ESTABLISH ||
+			!after(write_seq, grant_nxt)) {
+			list_del_init(&nsk->sender.match_link);
+			sock_put((struct sock*)nsk);
+			continue;
+		}
+		if (nsk->sender.match_epoch == tab->epoch ||
+			tab->snd_matched >= nd_params.grant_overcommit)
+			continue;
+		nd_match_send(nsk, RTS, tag, write_seq - grant_nxt);
+	}
+
+	rearm = !tab->exiting && !list_empty(&tab->rts_list);
+	tab->armed = rearm;
+	spin_unlock_bh(&tab->lock);
+	if (!rearm)
+		return HRTIMER_NORESTART;
+	hrtimer_forward_now(timer, ns_to_ktime(nd_params.iter_size));
+	return HRTIMER_RESTART;
+}
+
+/* nd_push() found the flow blocked on credit */
+void nd_match_request(struct sock *sk)
+{
+	struct nd_match_tab *tab = &nd_match_tab;
+	struct nd_sock *nsk = nd_sk(sk);
+
+	spin_lock_bh(&tab->lock);
+	if (list_empty(&nsk->sender.match_link)) {
+		sock_hold(sk);
+		list_add_tail(&nsk->sender.match_link, &tab->rts_list);
+		nd_match_arm(tab);
+	}
+	spin_unlock_bh(&tab->lock);
+}
+
+void nd_match_remove(struct sock *sk)
+{
+	struct nd_match_tab *tab = &nd_match_tab;
+	struct nd_sock *nsk = nd_sk(sk);
+
+	spin_lock_bh(&tab->lock);
+	if (!list_empty(&nsk->sender.match_link)) {
+		list_del_init(&nsk->sender.match_link);
+		sock_put(sk);
+	}
+	if (!RB_EMPTY_NODE(&nsk->sender.match_node)) {
+		nd_pq_delete(&tab->grant_q, &nsk->sender.match_node);
+		sock_put(sk);
+	}
+	if (!RB_EMPTY_NODE(&nsk->receiver.match_node)) {
+		nd_pq_delete(&tab->rts_q, &nsk->receiver.match_node);
+		sock_put(sk);
+	}
+	spin_unlock_bh(&tab->lock);
+}
+
+static struct sock *nd_match_lookup(struct sk_buff *skb, bool *refcounted)
+{
+	struct ndhdr *mh;
+	int sdif = inet_sdif(skb);
+
+	if (!pskb_may_pull(skb, sizeof(struct ndhdr)))
+		return NULL;
+	mh = nd_hdr(skb);
+	return __nd_lookup_skb(&nd_hashinfo, skb, __nd_hdrlen(mh), mh->source,
+		mh->dest, sdif, refcounted);
+}
+
+/* receiver side: a blocked sender asks for credit */
+int nd_handle_rts_pkt(struct sk_buff *skb)
+{
+	struct nd_match_tab *tab = &nd_match_tab;
+	struct nd_sock *nsk;
+	struct sock *sk;
+	bool refcounted = false;
+	u32 remaining;
+
+	sk = nd_match_lookup(skb, &refcounted);
+	if (!sk)
+		goto drop;
+	if (sk->sk_state == ND_ESTABLISH) {
+		nsk = nd_sk(sk);
+		remaining = ntohl(nd_hdr(skb)->grant_seq);
+		/* the sender stops at our grant_nxt; this tells how far it wants to go.
+		 * adv_seq is written under the socket's bh lock only, as on DATA.
+		 */
+		bh_lock_sock(sk);
+		if (after(READ_ONCE(nsk->receiver.grant_nxt) + remaining, nsk->receiver.adv_seq))
+			WRITE_ONCE(nsk->receiver.adv_seq, READ_ONCE(nsk->receiver.grant_nxt) + remaining);
+		bh_unlock_sock(sk);
+		spin_lock_bh(&tab->lock);
+		if (nsk->receiver.match_epoch != tab->epoch &&
+			RB_EMPTY_NODE(&nsk->receiver.match_node)) {
+			nsk->receiver.match_remaining = remaining;
+			sock_hold(sk);
+			nd_pq_push(&tab->rts_q, &nsk->receiver.match_node);
+			nd_match_arm(tab);
+		}
+		spin_unlock_bh(&tab->lock);
+	}
+	if (refcounted)
+		sock_put(sk);
+drop:
+	kfree_skb(skb);
+	return 0;
+}
+
+/* sender side: a receiver offers a match */
+int nd_handle_grant_pkt(struct sk_buff *skb)
+{
+	struct nd_match_tab *tab = &nd_match_tab;
+	struct nd_sock *nsk;
+	struct sock *sk;
+	bool refcounted = false;
+
+	sk = nd_match_lookup(skb, &refcounted);
+	if (!sk)
+		goto drop;
+	if (sk->sk_state == ND_ESTABLISH) {
+		nsk = nd_sk(sk);
+		spin_lock_bh(&tab->lock);
+		if (nsk->sender.match_epoch != tab->epoch &&
+			RB_EMPTY_NODE(&nsk->sender.match_node)) {
+			nsk->sender.match_tag = ntohl(nd_hdr(skb)->seq);
+			nsk->sender.match_remaining = ntohl(nd_hdr(skb)->grant_seq);
+			sock_hold(sk);
+			nd_pq_push(&tab->grant_q, &nsk->sender.match_node);
+			nd_match_arm(tab);
+		}
+		spin_unlock_bh(&tab->lock);
+	}
+	if (refcounted)
+		sock_put(sk);
+drop:
+	kfree_skb(skb);
+	return 0;
+}
+
+/* receiver side: the sender took our grant; hand out this epoch's credit */
+int nd_handle_accept_pkt(struct sk_buff *skb)
+{
+	struct nd_match_tab *tab = &nd_match_tab;
+	struct nd_sock *nsk;
+	struct sock *sk;
+	bool refcounted = false;
+	bool grant = false;
+
+	sk = nd_match_lookup(skb, &refcounted);
+	if (!sk)
+		goto drop;
+	if (sk->sk_state == ND_ESTABLISH) {
+		nsk = nd_sk(sk);
+		spin_lock_bh(&tab->lock);
+		if (nd_match_tag_fresh(tab, ntohl(nd_hdr(skb)->seq)) &&
+			nsk->receiver.match_epoch != tab->epoch &&
+			tab->rcv_matched < nd_params.grant_overcommit) {
+			nsk->receiver.match_epoch = tab->epoch;
+			tab->rcv_matched++;
+			grant = nd_grant_credit(nsk, nd_match_epoch_bytes());
+		}
+		spin_unlock_bh(&tab->lock);
+		if (grant)
+			nd_conn_queue_ctrl_request(construct_ack_req(sk, GFP_ATOMIC), nsk);
+	}
+	if (refcounted)
+		sock_put(sk);
+drop:
+	kfree_skb(skb);
+	return 0;
+}
+
+void nd_match_init(void)
+{
+	struct nd_match_tab *tab = &nd_match_tab;
+
+	spin_lock_init(&tab->lock);
+	hrtimer_init(&tab->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	tab->timer.function = nd_match_tick;
+	tab->armed = false;
+	tab->exiting = false;
+	tab->epoch = 1;
+	tab->iter = 0;
+	tab->rcv_matched = 0;
+	tab->snd_matched = 0;
+	INIT_LIST_HEAD(&tab->rts_list);
+	nd_pq_init(&tab->rts_q, nd_match_rts_compare);
+	nd_pq_init(&tab->grant_q, nd_match_grant_compare);
+}
+
+void nd_match_destroy(void)
+{
+	struct nd_match_tab *tab = &nd_match_tab;
+	struct nd_sock *nsk, *tmp;
+	struct rb_node *node;
+
+	spin_lock_bh(&tab->lock);
+	tab->exiting = true;
+	spin_unlock_bh(&tab->lock);
+	hrtimer_cancel(&tab->timer);
+
+	spin_lock_bh(&tab->lock);
+	list_for_each_entry_safe(nsk, tmp, &tab->rts_list, sender.match_link) {
+		list_del_init(&nsk->sender.match_link);
+		sock_put((struct sock*)nsk);
+	}
+	while ((node = nd_pq_pop(&tab->grant_q)) != NULL)
+		sock_put((struct sock*)rb_entry(node, struct nd_sock, sender.match_node));
+	while ((node = nd_pq_pop(&tab->rts_q)) != NULL)
+		sock_put((struct sock*)rb_entry(node, struct nd_sock, receiver.match_node));
+	spin_unlock_bh(&tab->lock);
+}
@@ -63,7 +63,11 @@
 #include "nd_impl.h"
 
 
-int nd_init_request(struct sock* sk, struct nd_conn_request *req)
+/* @gfp without __GFP_DIRECT_RECLAIM means a caller other than the socket
+ * owner (softirq, the grant scheduler, the matching timer): its header comes
+ * from the per-cpu netdev frag cache instead of the socket's pf_cache.
+ */
+int nd_init_request(struct sock* sk, struct nd_conn_request *req, gfp_t gfp)
 {
 	// struct nd_conn_queue *queue = NULL;
 	// if(queue_id == -1) {
@@ -72,14 +76,21 @@ int nd_init_request(struct sock* sk, struct nd_conn_request *req)
 	// 	queue =  &nd_ctrl->queues[queue_id];
 	// }
 	struct nd_sock *nsk = nd_sk(sk);
-	req->hdr = page_frag_alloc(&nsk->pf_cache,
-		sizeof(struct ndhdr), GFP_KERNEL | __GFP_ZERO);
+	if (gfpflags_allow_blocking(gfp)) {
+		req->hdr = page_frag_alloc(&nsk->pf_cache,
+			sizeof(struct ndhdr), gfp | __GFP_ZERO);
+	} else {
+		/* freed with page_frag_free() all the same */
+		req->hdr = netdev_alloc_frag(sizeof(struct ndhdr));
+		if (req->hdr)
+			memset(req->hdr, 0, sizeof(struct ndhdr));
+	}
 	if (!req->hdr){
 		pr_warn("WARNING: fail to allocat page \n");
 		return -ENOMEM;
 	}
 	/* set up the req priority */
-	req->prio_class = sk->sk_priority == 0? 0 : 1;
+	req->prio_class = nd_prio_class(sk->sk_priority);
 
 	// req->queue = queue;
 	return 0;
@@ -119,7 +130,7 @@ struct nd_conn_request* construct_sync_req(struct sock* sk) {
 		WARN_ON(true);
 		return NULL;
 	}
-	nd_init_request(sk, req);
+	nd_init_request(sk, req, GFP_KERNEL);
 	req->state = ND_CONN_SEND_CMD_PDU;
 	sync = req->hdr;
 	// req->pdu_len = sizeof(struct ndhdr);
@@ -160,7 +171,7 @@ struct nd_conn_request* construct_sync_ack_req(struct sock* sk) {
 	if(unlikely(!req)) {
 		return NULL;
 	}
-	nd_init_request(sk, req);
+	nd_init_request(sk, req, GFP_KERNEL);
 	req->state = ND_CONN_SEND_CMD_PDU;
 	sync = req->hdr;
 	// req->pdu_len = sizeof(struct ndhdr);
@@ -172,6 +183,8 @@ struct nd_conn_request* construct_sync_ack_req(struct sock* sk) {
 	sync->type = SYNC_ACK;
 	sync->source = inet->inet_sport;
 	sync->dest = inet->inet_dport;
+	/* our initial grant, so that the sender need not share our window */
+	sync->grant_seq = htonl(nd_sk(sk)->receiver.grant_nxt);
 
 	// sync->check = 0;
 	sync->doff = (sizeof(struct ndhdr)) << 2;
@@ -200,7 +213,10 @@ struct nd_conn_request* construct_ack_req(struct sock* sk, gfp_t flag) {
 		WARN_ON(true);
 		return NULL;
 	}
-	nd_init_request(sk, req);
+	if (nd_init_request(sk, req, flag)) {
+		kfree(req);
+		return NULL;
+	}
 	req->state = ND_CONN_SEND_CMD_PDU;
 	ack = req->hdr;
 	// req->pdu_len = sizeof(struct ndhdr);
@@ -227,6 +243,36 @@ struct nd_conn_request* construct_ack_req(struct sock* sk, gfp_t flag) {
 	return req;
 }
 
+/* RTS/GRANT/ACCEPT ride the channels as a bare ndhdr: seq carries the
+ * epoch/iteration tag and grant_seq the bytes the flow still has to send.
+ */
+struct nd_conn_request* construct_match_req(struct sock* sk, int type, u32 tag, u32 remaining, gfp_t flag) {
+	struct inet_sock *inet = inet_sk(sk);
+	struct nd_conn_request* req = kzalloc(sizeof(*req), flag);
+	struct ndhdr* mh;
+
+	if(unlikely(!req)) {
+		WARN_ON(true);
+		return NULL;
+	}
+	if (nd_init_request(sk, req, flag)) {
+		kfree(req);
+		return NULL;
+	}
+	req->state = ND_CONN_SEND_CMD_PDU;
+	mh = req->hdr;
+	mh->len = 0;
+	mh->type = type;
+	mh->source = inet->inet_sport;
+	mh->dest = inet->inet_dport;
+	mh->doff = (sizeof(struct ndhdr)) << 2;
+	mh->seq = htonl(tag);
+	mh->grant_seq = htonl(remaining);
+	if(nd_params.nd_debug)
+		pr_info("match pkt type:%d tag:%u remaining:%u\n", type, tag, remaining);
+	return req;
+}
+
 struct nd_conn_request* construct_fin_req(struct sock* sk) {
 	// int extra_bytes = 0;
 	struct inet_sock *inet = inet_sk(sk);
@@ -240,7 +286,7 @@ struct nd_conn_request* construct_fin_req(struct sock* sk) {
 		WARN_ON(true);
 		return NULL;
 	}
-	nd_init_request(sk, req);
+	nd_init_request(sk, req, GFP_KERNEL);
 	req->state = ND_CONN_SEND_CMD_PDU;
 	sync = req->hdr;
 	// req->pdu_len = sizeof(struct ndhdr);
@@ -0,0 +1,342 @@
+/*
+ * Pinned user-page cache for remote data copy.
+ *
+ * Applications reuse the same send/recv buffers, so the pages pinned for
+ * one copy request are kept pinned and handed to the next request over the
+ * same range, skipping get_user_pages and the per-page put on release. Pages
+ * are still dirtied by every receive copy, since writeback may run before the
+ * region is dropped.
+ * An mmu notifier drops a range from the cache as soon as its mapping
+ * changes; requests already holding the region keep the old pages, exactly
+ * as they would with a plain get_user_pages.
+ *
+ * Cached pins outlive the request that made them, so they are long-term
+ * pins and are charged to the mm's pinned_vm against RLIMIT_MEMLOCK, as
+ * io_uring's registered buffers are; a range over the limit is left to the
+ * regular get_user_pages path.
+ */
+#include <linux/capability.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
+#include <linux/swap.h>
+#include <linux/workqueue.h>
+
+#include "nd_impl.h"
+#include "nd_pin_cache.h"
+
+/* regions are freed from process context; the notifier may not sleep */
+static LLIST_HEAD(nd_pin_free_list);
+static void nd_pin_free_work_fn(struct work_struct *w);
+static DECLARE_WORK(nd_pin_free_work, nd_pin_free_work_fn);
+
+static void nd_pin_region_free(struct nd_pin_region *region)
+{
+	release_pages(region->pages, region->nr_pages);
+	kfree(region);
+}
+
+static void nd_pin_free_work_fn(struct work_struct *w)
+{
+	struct llist_node *node = llist_del_all(&nd_pin_free_list);
+	struct nd_pin_region *region, *tmp;
+
+	llist_for_each_entry_safe(region, tmp, node, free_node)
+		nd_pin_region_free(region);
+}
+
+/* may sleep: the last put releases the pages */
+void nd_pin_region_put(struct nd_pin_region *region)
+{
+	if (refcount_dec_and_test(&region->ref))
+		nd_pin_region_free(region);
+}
+
+/* charge @nr_pages of cached pins to the current process */
+static bool nd_pin_account(struct mm_struct *mm, int nr_pages)
+{
+	s64 limit, cur, new;
+
+	if (capable(CAP_IPC_LOCK)) {
+		atomic64_add(nr_pages, &mm->pinned_vm);
+		return true;
+	}
+	limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+	cur = atomic64_read(&mm->pinned_vm);
+	do {
+		new = cur + nr_pages;
+		if (new > limit)
+			return false;
+	} while (!atomic64_try_cmpxchg(&mm->pinned_vm, &cur, new));
+	return true;
+}
+
+/* a racy peek, so a range that can't be cached doesn't pay for a pin first */
+static bool nd_pin_over_limit(struct mm_struct *mm, int nr_pages)
+{
+	if (capable(CAP_IPC_LOCK))
+		return false;
+	return atomic64_read(&mm->pinned_vm) + nr_pages >
+		rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+}
+
+static void nd_pin_unaccount(struct mm_struct *mm, int nr_pages)
+{
+	atomic64_sub(nr_pages, &mm->pinned_vm);
+}
+
+/* called with cache->lock held; returns true if the region has to be freed */
+static bool __nd_pin_region_unlink(struct nd_pin_cache *cache,
+	struct nd_pin_region *region)
+{
+	interval_tree_remove(&region->it, &cache->root);
+	list_del(&region->lru);
+	cache->nr_pages -= region->nr_pages;
+	/* the notifier holds a reference on the mm until free_notifier is done */
+	nd_pin_unaccount(cache->mn.mm, region->nr_pages);
+	if (!refcount_dec_and_test(&region->ref))
+		return false;
+	llist_add(&region->free_node, &nd_pin_free_list);
+	return true;
+}
+
+static bool __nd_pin_cache_evict(struct nd_pin_cache *cache,
+	unsigned long start, unsigned long last)
+{
+	struct interval_tree_node *it;
+	bool freed = false;
+
+	while ((it = interval_tree_iter_first(&cache->root, start, last)))
+		freed |= __nd_pin_region_unlink(cache,
+			container_of(it, struct nd_pin_region, it));
+	return freed;
+}
+
+static int nd_pin_invalidate_range_start(struct mmu_notifier *mn,
+	const struct mmu_notifier_range *range)
+{
+	struct nd_pin_cache *cache = container_of(mn, struct nd_pin_cache, mn);
+	bool freed;
+
+	spin_lock(&cache->lock);
+	cache->active_invalidate++;
+	cache->invalidate_seq++;
+	freed = __nd_pin_cache_evict(cache, range->start, range->end - 1);
+	spin_unlock(&cache->lock);
+	if (freed)
+		schedule_work(&nd_pin_free_work);
+	return 0;
+}
+
+static void nd_pin_invalidate_range_end(struct mmu_notifier *mn,
+	const struct mmu_notifier_range *range)
+{
+	struct nd_pin_cache *cache = container_of(mn, struct nd_pin_cache, mn);
+
+	spin_lock(&cache->lock);
+	cache->active_invalidate--;
+	spin_unlock(&cache->lock);
+}
+
+/* the mm is going away */
+static void nd_pin_release(struct mmu_notifier *mn, struct mm_struct *mm)
+{
+	struct nd_pin_cache *cache = container_of(mn, struct nd_pin_cache, mn);
+	bool freed;
+
+	spin_lock(&cache->lock);
+	freed = __nd_pin_cache_evict(cache, 0, ULONG_MAX);
+	spin_unlock(&cache->lock);
+	if (freed)
+		schedule_work(&nd_pin_free_work);
+}
+
+static struct mmu_notifier *nd_pin_alloc_notifier(struct mm_struct *mm)
+{
+	struct nd_pin_cache *cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+
+	if (!cache)
+		return ERR_PTR(-ENOMEM);
+	spin_lock_init(&cache->lock);
+	cache->root = RB_ROOT_CACHED;
+	INIT_LIST_HEAD(&cache->lru);
+	return &cache->mn;
+}
+
+/* the last socket of the mm dropped the cache; nobody else can reach it */
+static void nd_pin_free_notifier(struct mmu_notifier *mn)
+{
+	struct nd_pin_cache *cache = container_of(mn, struct nd_pin_cache, mn);
+
+	if (__nd_pin_cache_evict(cache, 0, ULONG_MAX))
+		schedule_work(&nd_pin_free_work);
+	kfree(cache);
+}
+
+static const struct mmu_notifier_ops nd_pin_mn_ops = {
+	.invalidate_range_start = nd_pin_invalidate_range_start,
+	.invalidate_range_end	= nd_pin_invalidate_range_end,
+	.release		= nd_pin_release,
+	.alloc_notifier		= nd_pin_alloc_notifier,
+	.free_notifier		= nd_pin_free_notifier,
+};
+
+/* called with the socket lock held */
+static struct nd_pin_cache *nd_pin_cache_get(struct sock *sk)
+{
+	struct nd_sock *nsk = nd_sk(sk);
+	struct mmu_notifier *mn;
+
+	if (!READ_ONCE(nd_params.pin_cache_pages) || !current->mm)
+		return NULL;
+	if (!nsk->pin_cache) {
+		mn = mmu_notifier_get(&nd_pin_mn_ops, current->mm);
+		if (IS_ERR(mn))
+			return NULL;
+		nsk->pin_cache = container_of(mn, struct nd_pin_cache, mn);
+	}
+	/* the socket is used by another process, e.g. after fork */
+	if (nsk->pin_cache->mn.mm != current->mm)
+		return NULL;
+	return nsk->pin_cache;
+}
+
+static struct nd_pin_region *nd_pin_cache_lookup(struct nd_pin_cache *cache,
+	unsigned long start, unsigned long last, bool write)
+{
+	struct interval_tree_node *it;
+	struct nd_pin_region *region;
+
+	spin_lock(&cache->lock);
+	for (it = interval_tree_iter_first(&cache->root, start, last); it;
+	     it = interval_tree_iter_next(it, start, last)) {
+		region = container_of(it, struct nd_pin_region, it);
+		if (it->start > start || it->last < last ||
+			(write && !region->writable))
+			continue;
+		refcount_inc(&region->ref);
+		list_move(&region->lru, &cache->lru);
+		spin_unlock(&cache->lock);
+		return region;
+	}
+	spin_unlock(&cache->lock);
+	return NULL;
+}
+
+static struct nd_pin_region *nd_pin_cache_pin(struct nd_pin_cache *cache,
+	unsigned long start, int nr_pages, bool write)
+{
+	struct nd_pin_region *region;
+	unsigned long seq;
+	bool freed = false;
+	int pinned;
+
+	/* over RLIMIT_MEMLOCK: leave the range to the regular path */
+	if (nd_pin_over_limit(cache->mn.mm, nr_pages))
+		return NULL;
+	region = kmalloc(struct_size(region, pages, nr_pages), GFP_KERNEL);
+	if (!region)
+		return NULL;
+	spin_lock(&cache->lock);
+	seq = cache->invalidate_seq;
+	spin_unlock(&cache->lock);
+
+	pinned = get_user_pages_fast(start, nr_pages,
+		FOLL_LONGTERM | (write ? FOLL_WRITE : 0), region->pages);
+	if (pinned < nr_pages) {
+		/* let the regular path deal with partial pins */
+		while (pinned > 0)
+			put_page(region->pages[--pinned]);
+		kfree(region);
+		return NULL;
+	}
+	region->it.start = start;
+	region->it.last = start + ((unsigned long)nr_pages << PAGE_SHIFT) - 1;
+	region->writable = write;
+	region->nr_pages = nr_pages;
+	INIT_LIST_HEAD(&region->lru);
+	refcount_set(&region->ref, 1);
+
+	/* over RLIMIT_MEMLOCK: use the pages once only */
+	if (!nd_pin_account(cache->mn.mm, nr_pages))
+		return region;
+	spin_lock(&cache->lock);
+	/* the pages may predate an invalidation in flight: use them once only */
+	if (cache->active_invalidate || cache->invalidate_seq != seq) {
+		spin_unlock(&cache->lock);
+		nd_pin_unaccount(cache->mn.mm, nr_pages);
+		return region;
+	}
+	refcount_inc(&region->ref);
+	interval_tree_insert(&region->it, &cache->root);
+	list_add(&region->lru, &cache->lru);
+	cache->nr_pages += nr_pages;
+	while (cache->nr_pages > READ_ONCE(nd_params.pin_cache_pages))
+		freed |= __nd_pin_region_unlink(cache,
+			list_last_entry(&cache->lru, struct nd_pin_region, lru));
+	spin_unlock(&cache->lock);
+	if (freed)
+		schedule_work(&nd_pin_free_work);
+	return region;
+}
+
+/**
+ * nd_pin_cache_get_pages() - pinned pages for the head of a user iovec
+ * @pages:  set to the page holding the first byte
+ * @bytes:  in: bytes wanted; out: bytes covered, never crossing an iovec
+ *          segment nor more than @max_segs pages
+ * @offset: set to the offset of the first byte in its page
+ *
+ * Return: a region reference the caller drops with nd_pin_region_put(), or
+ * NULL if the cache is off or can't cover the range; the caller then falls
+ * back to iov_iter_get_pages(). @iter is not advanced.
+ */
+struct nd_pin_region *nd_pin_cache_get_pages(struct sock *sk, struct iov_iter *iter,
+	struct page ***pages, size_t *bytes, size_t *offset, int max_segs)
+{
+	struct nd_pin_cache *cache;
+	struct nd_pin_region *region;
+	unsigned long addr, start, last;
+	bool write = iov_iter_rw(iter) == READ;
+	size_t len;
+
+	if (!iter_is_iovec(iter) || !iov_iter_count(iter))
+		return NULL;
+	cache = nd_pin_cache_get(sk);
+	if (!cache)
+		return NULL;
+	addr = (unsigned long)iter->iov->iov_base + iter->iov_offset;
+	*offset = offset_in_page(addr);
+	len = min_t(size_t, *bytes, iter->iov->iov_len - iter->iov_offset);
+	len = min_t(size_t, len, max_segs * PAGE_SIZE - *offset);
+	if (!len)
+		return NULL;
+	start = addr & PAGE_MASK;
+	last = PAGE_ALIGN(addr + len) - 1;
+	region = nd_pin_cache_lookup(cache, start, last, write);
+	if (!region)
+		region = nd_pin_cache_pin(cache, start,
+			(last - start + 1) >> PAGE_SHIFT, write);
+	if (!region)
+		return NULL;
+	*pages = region->pages + ((start - region->it.start) >> PAGE_SHIFT);
+	*bytes = len;
+	return region;
+}
+
+/* drop the socket's reference on the cache of its mm */
+void nd_pin_cache_release(struct sock *sk)
+{
+	struct nd_sock *nsk = nd_sk(sk);
+
+	if (nsk->pin_cache) {
+		mmu_notifier_put(&nsk->pin_cache->mn);
+		nsk->pin_cache = NULL;
+	}
+}
+
+void nd_pin_cache_exit(void)
+{
+	/* wait for pending free_notifier callbacks, then for their frees */
+	mmu_notifier_synchronize();
+	flush_work(&nd_pin_free_work);
+}
@@ -0,0 +1,45 @@
+#ifndef _ND_PIN_CACHE_H
+#define _ND_PIN_CACHE_H
+
+#include <linux/mm.h>
+#include <linux/mmu_notifier.h>
+#include <linux/interval_tree.h>
+#include <linux/llist.h>
+#include <linux/refcount.h>
+#include <linux/spinlock.h>
+#include <linux/uio.h>
+#include <net/sock.h>
+
+/* a user range whose pages stay pinned across sendmsg/recvmsg calls */
+struct nd_pin_region {
+	/* start/last are the first and last byte of the pinned pages */
+	struct interval_tree_node it;
+	struct list_head lru;
+	struct llist_node free_node;
+	/* one for the cache while linked, one per copy request using it */
+	refcount_t ref;
+	bool writable;
+	int nr_pages;
+	struct page *pages[];
+};
+
+/* one per mm, shared by all nd sockets of the process */
+struct nd_pin_cache {
+	struct mmu_notifier mn;
+	spinlock_t lock;
+	struct rb_root_cached root;
+	/* least recently used at the tail */
+	struct list_head lru;
+	int nr_pages;
+	/* pins racing with an invalidation are not cached */
+	int active_invalidate;
+	unsigned long invalidate_seq;
+};
+
+struct nd_pin_region *nd_pin_cache_get_pages(struct sock *sk, struct iov_iter *iter,
+	struct page ***pages, size_t *bytes, size_t *offset, int max_segs);
+void nd_pin_region_put(struct nd_pin_region *region);
+void nd_pin_cache_release(struct sock *sk);
+void nd_pin_cache_exit(void);
+
+#endif /* _ND_PIN_CACHE_H */
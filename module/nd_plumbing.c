@@ -148,6 +148,13 @@ static struct ctl_table nd_ctl_table[] = {
                 .mode           = 0644,
                 .proc_handler   = nd_dointvec
         },
+        {
+                .procname       = "pq_bench",
+                .data           = &nd_params.pq_bench,
+                .maxlen         = sizeof(int),
+                .mode           = 0644,
+                .proc_handler   = nd_dointvec
+        },
         {
                 .procname       = "rmem_default",
                 .data           = &nd_params.rmem_default,
@@ -162,6 +169,118 @@ static struct ctl_table nd_ctl_table[] = {
                 .mode           = 0644,
                 .proc_handler   = nd_dointvec
         },
+        {
+                .procname       = "moderate_buf",
+                .data           = &nd_params.moderate_buf,
+                .maxlen         = sizeof(int),
+                .mode           = 0644,
+                .proc_handler   = nd_dointvec
+        },
+        {
+                .procname       = "rmem_max",
+                .data           = &nd_params.rmem_max,
+                .maxlen         = sizeof(int),
+                .mode           = 0644,
+                .proc_handler   = nd_dointvec
+        },
+        {
+                .procname       = "wmem_max",
+                .data           = &nd_params.wmem_max,
+                .maxlen         = sizeof(int),
+                .mode           = 0644,
+                .proc_handler   = nd_dointvec
+        },
+        {
+                .procname       = "zero_rtt",
+                .data           = &nd_params.zero_rtt,
+                .maxlen         = sizeof(int),
+                .mode           = 0644,
+                .proc_handler   = nd_dointvec
+        },
+        {
+                .procname       = "grant_sched",
+                .data           = &nd_params.grant_sched,
+                .maxlen         = sizeof(int),
+                .mode           = 0644,
+                .proc_handler   = nd_dointvec
+        },
+        {
+                .procname       = "grant_unsched",
+                .data           = &nd_params.grant_unsched,
+                .maxlen         = sizeof(int),
+                .mode           = 0644,
+                .proc_handler   = nd_dointvec
+        },
+        {
+                .procname       = "grant_overcommit",
+                .data           = &nd_params.grant_overcommit,
+                .maxlen         = sizeof(int),
+                .mode           = 0644,
+                .proc_handler   = nd_dointvec
+        },
+        {
+                .procname       = "copy_engine",
+                .data           = &nd_params.copy_engine,
+                .maxlen         = sizeof(int),
+                .mode           = 0644,
+                .proc_handler   = nd_dointvec
+        },
+        {
+                .procname       = "copy_nt_thresh",
+                .data           = &nd_params.copy_nt_thresh,
+                .maxlen         = sizeof(int),
+                .mode           = 0644,
+                .proc_handler   = nd_dointvec
+        },
+        {
+                .procname       = "pin_cache_pages",
+                .data           = &nd_params.pin_cache_pages,
+                .maxlen         = sizeof(int),
+                .mode           = 0644,
+                .proc_handler   = nd_dointvec
+        },
+        {
+                .procname       = "reuseport_cpu",
+                .data           = &nd_params.reuseport_cpu,
+                .maxlen         = sizeof(int),
+                .mode           = 0644,
+                .proc_handler   = nd_dointvec
+        },
+        {
+                .procname       = "dcopy_quantum",
+                .data           = &nd_params.dcopy_quantum,
+                .maxlen         = sizeof(int),
+                .mode           = 0644,
+                .proc_handler   = nd_dointvec
+        },
+        {
+                .procname       = "dcopy_release",
+                .data           = &nd_params.dcopy_release,
+                .maxlen         = sizeof(int),
+                .mode           = 0644,
+                .proc_handler   = nd_dointvec
+        },
+        {
+                .procname       = "hpage_pool",
+                .data           = &nd_params.hpage_pool,
+                .maxlen         = sizeof(int),
+                .mode           = 0644,
+                .proc_handler   = nd_dointvec
+        },
+        {
+                .procname       = "num_iters",
+                .data           = &nd_params.num_iters,
+                .maxlen         = sizeof(int),
+                .mode           = 0644,
+                .proc_handler   = nd_dointvec
+        },
+        {
+                .procname       = "iter_size",
+                .data           = &nd_params.iter_size,
+                .maxlen         = sizeof(int),
+                .mode           = 0644,
+                .proc_handler   = nd_dointvec
+        },
         {
                 .procname       = "short_flow_size",
                 .data           = &nd_params.short_flow_size,
@@ -218,20 +337,62 @@ static struct ctl_table nd_ctl_table[] = {
                 .mode           = 0644,
                 .proc_handler   = nd_dointvec
         },
+        {
+                .procname       = "flowlet_gap_us",
+                .data           = &nd_params.flowlet_gap_us,
+                .maxlen         = sizeof(int),
+                .mode           = 0644,
+                .proc_handler   = nd_dointvec
+        },
         {
                 .procname       = "num_thpt_channels",
-                .data           = &nd_params.num_thpt_channels,
+                .data           = &nd_params.prio_num_channels[0],
                 .maxlen         = sizeof(int),
                 .mode           = 0644,
                 .proc_handler   = nd_dointvec
         },
         {
                 .procname       = "num_lat_channels",
-                .data           = &nd_params.num_lat_channels,
+                .data           = &nd_params.prio_num_channels[1],
+                .maxlen         = sizeof(int),
+                .mode           = 0644,
+                .proc_handler   = nd_dointvec
+        },
+        {
+                .procname       = "num_prio",
+                .data           = &nd_params.num_prio,
                 .maxlen         = sizeof(int),
                 .mode           = 0644,
                 .proc_handler   = nd_dointvec
         },
+        {
+                .procname       = "prio_channel_idx",
+                .data           = &nd_params.prio_channel_idx,
+                .maxlen         = sizeof(nd_params.prio_channel_idx),
+                .mode           = 0644,
+                .proc_handler   = nd_dointvec
+        },
+        {
+                .procname       = "prio_num_channels",
+                .data           = &nd_params.prio_num_channels,
+                .maxlen         = sizeof(nd_params.prio_num_channels),
+                .mode           = 0644,
+                .proc_handler   = nd_dointvec
+        },
+        {
+                .procname       = "prio_min_skprio",
+                .data           = &nd_params.prio_min_skprio,
+                .maxlen         = sizeof(nd_params.prio_min_skprio),
+                .mode           = 0644,
+                .proc_handler   = nd_dointvec
+        },
+        {
+                .procname       = "prio_weight",
+                .data           = &nd_params.prio_weight,
+                .maxlen         = sizeof(nd_params.prio_weight),
+                .mode           = 0644,
+                .proc_handler   = nd_dointvec
+        },
         {}
 };
 
@@ -262,11 +423,20 @@ struct request_sock_ops nd_request_sock_ops __read_mostly = {
 /* Used to remove sysctl values when the module is unloaded. */
 static struct ctl_table_header *nd_ctl_header;
 
+/* matching epoch in ns, saturated instead of overflowing int */
+static int nd_epoch_size(const struct nd_params *params)
+{
+    u64 size = (u64)params->num_iters * params->iter_size * params->alpha;
+
+    return min_t(u64, size, INT_MAX);
+}
+
 void nd_params_init(struct nd_params* params) {
     params->nd_add_host = 0;
     params->nd_num_queue = 1;
     params->nd_num_dc_thread = 1;
     params->nd_host_added = 0;
+    params->pq_bench = 0;
     params->nd_debug = 0;
     params->nr_cpus = num_online_cpus();
     params->nr_nodes = num_online_nodes();
@@ -290,24 +460,55 @@ void nd_params_init(struct nd_params* params) {
 
     params->data_cpy_core = 0;
     params->total_channels = 16;
-    /* start index of latency channel index */
-    params->lat_channel_idx = 8;
-    params->num_lat_channels = 4;
-    /* start index of thpt channel index */
-    params->thpt_channel_idx = 4;
-    params->num_thpt_channels = 4;
+    /* class 0: throughput channels; class 1: latency channels.
+     * a third tier, e.g. interactive RPC, is enabled with num_prio = 3.
+     */
+    params->num_prio = 2;
+    params->prio_channel_idx[0] = 4;
+    params->prio_num_channels[0] = 4;
+    params->prio_min_skprio[0] = 0;
+    params->prio_weight[0] = 1;
+    params->prio_channel_idx[1] = 8;
+    params->prio_num_channels[1] = 4;
+    params->prio_min_skprio[1] = 1;
+    params->prio_weight[1] = 0;
+    params->prio_channel_idx[2] = 12;
+    params->prio_num_channels[2] = 4;
+    params->prio_min_skprio[2] = 6;
+    params->prio_weight[2] = 0;
+    params->prio_channel_idx[3] = 0;
+    params->prio_num_channels[3] = 4;
+    params->prio_min_skprio[3] = 7;
+    params->prio_weight[3] = 0;
     params->alpha = 2;
     params->beta = 5;
     params->min_iter = 1;
     params->num_iters = 5;
-    params->iter_size = params->beta * params->control_pkt_rtt * 1000;
-    params->epoch_size = params->num_iters * params->iter_size * params->alpha;
+    params->iter_size = min_t(u64, (u64)params->beta * params->control_pkt_rtt * 1000,
+        ND_MAX_ITER_SIZE);
+    params->epoch_size = nd_epoch_size(params);
     params->rmem_default = 6289600;
     params->wmem_default = 589600;
+    params->moderate_buf = 0;
+    params->rmem_max = 16777216;
+    params->wmem_max = 4194304;
+    params->zero_rtt = 1;
     params->short_flow_size = params->bdp;
     params->control_pkt_bdp = params->control_pkt_rtt * params->bandwidth * 1000 / 8;
+    params->grant_sched = ND_GRANT_WINDOW;
+    params->grant_unsched = params->control_pkt_bdp;
+    params->grant_overcommit = 2;
+    params->copy_engine = ND_COPY_ENGINE_AUTO;
+    params->copy_nt_thresh = 0;
+    params->pin_cache_pages = 0;
+    params->reuseport_cpu = 0;
+    params->dcopy_quantum = 65536;
+    params->dcopy_release = 0;
+    params->hpage_pool = 0;
     params->data_budget = 1000000;
     params->nd_default_sche_policy = SCHE_SRC_PORT;
+    /* channels share the same path; skew is bounded by one rtt of queueing */
+    params->flowlet_gap_us = params->rtt;
     printk("params->control_pkt_bdp:%d\n", params->control_pkt_bdp);
 }
 /**
@@ -341,6 +542,60 @@ int nd_dointvec(struct ctl_table *table, int write,
 void nd_sysctl_changed(struct nd_params *params)
 {
         // __u64 tmp;
+    int i;
+
+    if(params->num_prio < 1)
+        params->num_prio = 1;
+    if(params->num_prio > ND_MAX_PRIO)
+        params->num_prio = ND_MAX_PRIO;
+    /* every class owns at least one channel inside [0, total_channels) */
+    for (i = 0; i < ND_MAX_PRIO; i++) {
+        if(params->prio_channel_idx[i] < 0 ||
+            params->prio_channel_idx[i] >= params->total_channels)
+            params->prio_channel_idx[i] = 0;
+        if(params->prio_num_channels[i] < 1)
+            params->prio_num_channels[i] = 1;
+        if(params->prio_num_channels[i] > params->total_channels - params->prio_channel_idx[i])
+            params->prio_num_channels[i] = params->total_channels - params->prio_channel_idx[i];
+        if(params->prio_weight[i] < 0)
+            params->prio_weight[i] = 0;
+    }
+    if(params->grant_sched < ND_GRANT_WINDOW || params->grant_sched > ND_GRANT_PIM)
+        params->grant_sched = ND_GRANT_WINDOW;
+    /* the iteration travels in 8 bits of the matching tag */
+    if(params->num_iters < 1)
+        params->num_iters = 1;
+    if(params->num_iters > 255)
+        params->num_iters = 255;
+    if(params->iter_size < 1000)
+        params->iter_size = 1000;
+    if(params->iter_size > ND_MAX_ITER_SIZE)
+        params->iter_size = ND_MAX_ITER_SIZE;
+    if(params->alpha < 1)
+        params->alpha = 1;
+    params->epoch_size = nd_epoch_size(params);
+    /* less than one skb of unscheduled credit stalls a flow before its first grant */
+    if(params->grant_unsched < ND_MAX_SKB_LEN)
+        params->grant_unsched = ND_MAX_SKB_LEN;
+    if(params->grant_overcommit < 1)
+        params->grant_overcommit = 1;
+    if(params->grant_overcommit > ND_MAX_GRANT_OVERCOMMIT)
+        params->grant_overcommit = ND_MAX_GRANT_OVERCOMMIT;
+    params->copy_engine = nd_copy_engine_select(params->copy_engine);
+    if(params->copy_nt_thresh < 0)
+        params->copy_nt_thresh = 0;
+    if(params->pin_cache_pages < 0)
+        params->pin_cache_pages = 0;
+    if(params->dcopy_quantum < PAGE_SIZE)
+        params->dcopy_quantum = PAGE_SIZE;
+    if(params->hpage_pool < 0)
+        params->hpage_pool = 0;
+    if(params->hpage_pool > ND_HPAGE_POOL_MAX)
+        params->hpage_pool = ND_HPAGE_POOL_MAX;
+    if(params->pq_bench > 0) {
+        nd_pq_bench_queue(params->pq_bench);
+        params->pq_bench = 0;
+    }
     if(params->nd_add_host == 1 && params->nd_host_added == 0) {
         // sock_release(nd_match_table.sock);
         // nd_match_table.sock = NULL;
@@ -384,6 +639,8 @@ static int __init nd_load(void) {
         nd_params_init(&nd_params);
 
         nd_init();
+        nd_grant_sched_init();
+        nd_match_init();
         // nd_mattab_init(&nd_match_table, NULL);
 
         status = proto_register(&nd_prot, 1);
@@ -477,8 +734,10 @@ static void __exit nd_unload(void) {
         // hrtimer_cancel(&hrtimer);
         // proc_remove(metrics_dir_entry);
         
+        nd_match_destroy();
         /* clean up data copy */
         nd_dcopy_exit();
+        nd_pin_cache_exit();
         /* clean up the target side logic */
         ndt_conn_exit();
         /* clean up the host side logic */
@@ -491,6 +750,7 @@ static void __exit nd_unload(void) {
         // nd_epoch_destroy(&nd_epoch);
         unregister_net_sysctl_table(nd_ctl_header);
         printk("unregister sysctl table\n");
+        nd_pq_bench_cancel();
         // rcv_core_table_destory(&rcv_core_tab);
         // xmit_core_table_destory(&xmit_core_tab);
 
@@ -19,74 +19,70 @@
 
 #include "nd_impl.h"
 
-void nd_pq_init(struct nd_pq* pq, bool(*comp)(const struct list_head*, const struct list_head*)) {
-	// spin_lock_init(&pq->lock);
-	INIT_LIST_HEAD(&pq->list);
+/* The queue is an rbtree with a cached leftmost node, so push, pop and delete
+ * are O(log n) and peek is O(1). Nodes that are not queued are kept cleared
+ * (RB_CLEAR_NODE) so that delete can be called on them.
+ */
+void nd_pq_init(struct nd_pq* pq, bool(*comp)(const struct rb_node*, const struct rb_node*)) {
+	pq->root = RB_ROOT_CACHED;
 	pq->count = 0;
 	pq->comp = comp;
 }
 
 bool nd_pq_empty(struct nd_pq* pq) {
-	// spin_lock_bh(&pq->lock);
-	// spin_unlock_bh(&pq->lock);
 	return pq->count == 0;
 }
 
+/* the head is only a hint without the owner's lock */
 bool nd_pq_empty_lockless(struct nd_pq* pq) {
-	return READ_ONCE(pq->list.next) == (const struct list_head *) (&pq->list);
+	return READ_ONCE(pq->root.rb_leftmost) == NULL;
+}
+
+struct rb_node* nd_pq_peek_lockless(struct nd_pq* pq) {
+	return READ_ONCE(pq->root.rb_leftmost);
 }
+
 int nd_pq_size(struct nd_pq* pq) {
 	return pq->count;
 }
-void nd_pq_delete(struct nd_pq* pq, struct list_head* node) {
-	// spin_lock_bh(&pq->lock);
-	/* list empty use is not traditional use of the function; 
-	it is checked whether this node has already been removed before */
-	if(pq->count > 0 && !list_empty(node)) {
-		list_del_init(node);
-		pq->count--;
-	}
-	if(pq->count == 0) {
-		INIT_LIST_HEAD(&pq->list);
-	}
-	// spin_unlock_bh(&pq->lock);
-	return; 
+
+void nd_pq_delete(struct nd_pq* pq, struct rb_node* node) {
+	/* the node might have been removed before */
+	if(RB_EMPTY_NODE(node))
+		return;
+	rb_erase_cached(node, &pq->root);
+	RB_CLEAR_NODE(node);
+	pq->count--;
 }
-struct list_head* nd_pq_pop(struct nd_pq* pq) {
-	struct list_head *head = NULL;
-	// spin_lock_bh(&pq->lock);
-	if(pq->count > 0) {
-		head = pq->list.next;
-		list_del_init(head);
-		pq->count--;
-	}
-	if(pq->count == 0) {
-		INIT_LIST_HEAD(&pq->list);
-	}
-	// spin_unlock_bh(&pq->lock);
+
+struct rb_node* nd_pq_pop(struct nd_pq* pq) {
+	struct rb_node *head = rb_first_cached(&pq->root);
+
+	if(head)
+		nd_pq_delete(pq, head);
 	return head;
 }
 
-void nd_pq_push(struct nd_pq* pq, struct list_head* node) {
-	// spin_lock_bh(&pq->lock);
-	struct list_head* pos;
-	list_for_each(pos, &pq->list) {
-		if(!pq->comp(node, pos)) {
-			list_add_tail(node, pos);
-			pq->count++;
-			return;
+void nd_pq_push(struct nd_pq* pq, struct rb_node* node) {
+	struct rb_node **p = &pq->root.rb_root.rb_node;
+	struct rb_node *parent = NULL;
+	bool leftmost = true;
+
+	while(*p) {
+		parent = *p;
+		/* equal keys go right and keep the arrival order */
+		if(pq->comp(node, parent)) {
+			p = &parent->rb_right;
+			leftmost = false;
+		} else {
+			p = &parent->rb_left;
 		}
 	}
-	list_add_tail(node, &pq->list);
+	rb_link_node(node, parent, p);
+	rb_insert_color_cached(node, &pq->root, leftmost);
 	pq->count++;
-	// spin_unlock_bh(&pq->lock);
-	return;
 }
 
-struct list_head* nd_pq_peek(struct nd_pq* pq) {
-	if(pq->count == 0)
-		return NULL;
-	return pq->list.next;
+struct rb_node* nd_pq_peek(struct nd_pq* pq) {
+	return rb_first_cached(&pq->root);
 }
-
-
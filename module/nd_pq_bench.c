@@ -0,0 +1,225 @@
+/*
+ * nd_pq microbenchmark, queued to a work item by writing an element count to
+ * the pq_bench sysctl: the cached-rbtree nd_pq against the sorted list it
+ * replaced.
+ *
+ * Both queues see the same keys in the same order, first pushed and popped
+ * in full, then in the grant scheduler's pattern: a queued element is
+ * deleted and pushed back with a new key, and the head is peeked.
+ */
+#include <linux/ktime.h>
+#include <linux/random.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+#include "nd_impl.h"
+
+/* larger runs keep a kworker busy for seconds on the list side */
+#define ND_PQ_BENCH_MAX		(1 << 16)
+
+/* the list-based nd_pq as it was, under its own names */
+struct nd_pq_list {
+	struct list_head list;
+	int count;
+	bool (*comp)(const struct list_head*, const struct list_head*);
+};
+
+static void nd_pq_list_init(struct nd_pq_list* pq, bool(*comp)(const struct list_head*, const struct list_head*)) {
+	INIT_LIST_HEAD(&pq->list);
+	pq->count = 0;
+	pq->comp = comp;
+}
+
+static void nd_pq_list_delete(struct nd_pq_list* pq, struct list_head* node) {
+	if(pq->count > 0 && !list_empty(node)) {
+		list_del_init(node);
+		pq->count--;
+	}
+	if(pq->count == 0) {
+		INIT_LIST_HEAD(&pq->list);
+	}
+}
+
+static struct list_head* nd_pq_list_pop(struct nd_pq_list* pq) {
+	struct list_head *head = NULL;
+	if(pq->count > 0) {
+		head = pq->list.next;
+		list_del_init(head);
+		pq->count--;
+	}
+	if(pq->count == 0) {
+		INIT_LIST_HEAD(&pq->list);
+	}
+	return head;
+}
+
+static void nd_pq_list_push(struct nd_pq_list* pq, struct list_head* node) {
+	struct list_head* pos;
+	list_for_each(pos, &pq->list) {
+		if(!pq->comp(node, pos)) {
+			list_add_tail(node, pos);
+			pq->count++;
+			return;
+		}
+	}
+	list_add_tail(node, &pq->list);
+	pq->count++;
+}
+
+static struct list_head* nd_pq_list_peek(struct nd_pq_list* pq) {
+	if(pq->count == 0)
+		return NULL;
+	return pq->list.next;
+}
+
+struct nd_pq_bench_elem {
+	u32 value;
+	struct rb_node rb;
+	struct list_head list;
+};
+
+static bool nd_pq_bench_rb_comp(const struct rb_node* node1, const struct rb_node* node2) {
+	return rb_entry(node1, struct nd_pq_bench_elem, rb)->value >=
+		rb_entry(node2, struct nd_pq_bench_elem, rb)->value;
+}
+
+static bool nd_pq_bench_list_comp(const struct list_head* node1, const struct list_head* node2) {
+	return list_entry(node1, struct nd_pq_bench_elem, list)->value >=
+		list_entry(node2, struct nd_pq_bench_elem, list)->value;
+}
+
+/* pop everything; false if the keys did not come out in order */
+static bool nd_pq_bench_drain_rb(struct nd_pq *pq)
+{
+	struct rb_node *node;
+	u32 prev = 0, v;
+	bool sorted = true;
+
+	while ((node = nd_pq_pop(pq)) != NULL) {
+		v = rb_entry(node, struct nd_pq_bench_elem, rb)->value;
+		sorted &= v >= prev;
+		prev = v;
+	}
+	return sorted;
+}
+
+static bool nd_pq_bench_drain_list(struct nd_pq_list *pq)
+{
+	struct list_head *node;
+	u32 prev = 0, v;
+	bool sorted = true;
+
+	while ((node = nd_pq_list_pop(pq)) != NULL) {
+		v = list_entry(node, struct nd_pq_bench_elem, list)->value;
+		sorted &= v >= prev;
+		prev = v;
+	}
+	return sorted;
+}
+
+/**
+ * nd_pq_bench() - time both queues with @num random keys and log the result
+ * @num: elements, clamped to ND_PQ_BENCH_MAX
+ *
+ * Process context only; the list side is quadratic.
+ */
+static void nd_pq_bench(int num)
+{
+	struct nd_pq_bench_elem *elems;
+	struct nd_pq_list lpq;
+	struct nd_pq pq;
+	u32 *keys, *moves;
+	u64 start, list_fill, list_churn, rb_fill, rb_churn;
+	bool list_ok, rb_ok;
+	int i, j;
+
+	num = clamp(num, 1, ND_PQ_BENCH_MAX);
+	elems = vmalloc(sizeof(*elems) * num);
+	keys = vmalloc(sizeof(*keys) * num * 3);
+	if (!elems || !keys)
+		goto out;
+	moves = keys + num;
+	for (i = 0; i < num; i++) {
+		keys[i] = prandom_u32();
+		moves[2 * i] = prandom_u32() % num;
+		moves[2 * i + 1] = prandom_u32();
+	}
+
+	nd_pq_list_init(&lpq, nd_pq_bench_list_comp);
+	for (i = 0; i < num; i++) {
+		elems[i].value = keys[i];
+		INIT_LIST_HEAD(&elems[i].list);
+	}
+	start = ktime_get_ns();
+	for (i = 0; i < num; i++)
+		nd_pq_list_push(&lpq, &elems[i].list);
+	list_ok = nd_pq_bench_drain_list(&lpq);
+	list_fill = ktime_get_ns() - start;
+
+	for (i = 0; i < num; i++)
+		nd_pq_list_push(&lpq, &elems[i].list);
+	start = ktime_get_ns();
+	for (i = 0; i < num; i++) {
+		j = moves[2 * i];
+		nd_pq_list_delete(&lpq, &elems[j].list);
+		elems[j].value = moves[2 * i + 1];
+		nd_pq_list_push(&lpq, &elems[j].list);
+		nd_pq_list_peek(&lpq);
+	}
+	list_churn = ktime_get_ns() - start;
+	list_ok &= nd_pq_bench_drain_list(&lpq);
+	cond_resched();
+
+	nd_pq_init(&pq, nd_pq_bench_rb_comp);
+	for (i = 0; i < num; i++) {
+		elems[i].value = keys[i];
+		RB_CLEAR_NODE(&elems[i].rb);
+	}
+	start = ktime_get_ns();
+	for (i = 0; i < num; i++)
+		nd_pq_push(&pq, &elems[i].rb);
+	rb_ok = nd_pq_bench_drain_rb(&pq);
+	rb_fill = ktime_get_ns() - start;
+
+	for (i = 0; i < num; i++)
+		nd_pq_push(&pq, &elems[i].rb);
+	start = ktime_get_ns();
+	for (i = 0; i < num; i++) {
+		j = moves[2 * i];
+		nd_pq_delete(&pq, &elems[j].rb);
+		elems[j].value = moves[2 * i + 1];
+		nd_pq_push(&pq, &elems[j].rb);
+		nd_pq_peek(&pq);
+	}
+	rb_churn = ktime_get_ns() - start;
+	rb_ok &= nd_pq_bench_drain_rb(&pq);
+
+	pr_info("nd_pq bench %d elements: fill+drain list %llu ns rbtree %llu ns; "
+		"reposition list %llu ns rbtree %llu ns%s\n", num, list_fill, rb_fill,
+		list_churn, rb_churn, list_ok && rb_ok ? "" : " (ORDER MISMATCH)");
+out:
+	vfree(keys);
+	vfree(elems);
+}
+
+static int nd_pq_bench_num;
+
+static void nd_pq_bench_work(struct work_struct *work)
+{
+	nd_pq_bench(READ_ONCE(nd_pq_bench_num));
+}
+
+static DECLARE_WORK(nd_pq_bench_wk, nd_pq_bench_work);
+
+/* run the benchmark off the sysctl writer; a run already queued takes the new count */
+void nd_pq_bench_queue(int num)
+{
+	WRITE_ONCE(nd_pq_bench_num, num);
+	schedule_work(&nd_pq_bench_wk);
+}
+
+/* wait out a running benchmark, once the sysctl can no longer queue one */
+void nd_pq_bench_cancel(void)
+{
+	cancel_work_sync(&nd_pq_bench_wk);
+}
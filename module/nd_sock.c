@@ -534,6 +534,8 @@ int nd_v4_connect(struct sock *sk, struct sockaddr *uaddr, int addr_len)
     //   (uint32_t)usin->sin_zero[3];
     if(sk->sk_state == ND_ESTABLISH)
 	return 0;
+	if (nsk->dgram)
+		return -EISCONN;
 	//WARN_ON(sk->sk_state != TCP_CLOSE);
     if (addr_len < sizeof(struct sockaddr_in))
 		return -EINVAL;
@@ -651,7 +653,7 @@ int nd_v4_connect(struct sock *sk, struct sockaddr *uaddr, int addr_len)
 	/*find the nd ctrl */
 	nsk->nd_ctrl = nd_conn_find_nd_ctrl(inet->inet_daddr);
 	/* send sync request */
-    nd_conn_queue_request(construct_sync_req(sk), nsk, true, true, true);
+    nd_conn_queue_request(construct_sync_req(sk), nsk, true, true);
 	nd_set_state(sk, ND_SYNC_SENT);
 
 	// nd_xmit_control(construct_sync_pkt(sk, 0, flow_len, 0), sk, inet->inet_dport); 
@@ -723,6 +725,9 @@ int nd_listen(struct socket *sock, int backlog)
 
 	if (sock->state != SS_UNCONNECTED || sock->type != SOCK_DGRAM)
 		goto out;
+	/* ND_DGRAM endpoints already sit in the listening hash */
+	if (nd_sk(sk)->dgram)
+		goto out;
 
 	old_state = sk->sk_state;
 	if (!((1 << old_state) & (TCPF_CLOSE | NDF_LISTEN)))
@@ -1009,6 +1014,9 @@ struct sock *nd_sk_clone_lock(const struct sock *sk,
 		struct nd_sock *dsk = nd_sk(newsk);
 
 		dsk->icsk_bind_hash = NULL;
+		/* the cache reference belongs to the parent */
+		dsk->pin_cache = NULL;
+		dsk->hpool = NULL;
 
 		inet_sk(newsk)->inet_dport = inet_rsk(req)->ir_rmt_port;
 		inet_sk(newsk)->inet_num = inet_rsk(req)->ir_num;
@@ -1120,9 +1128,10 @@ struct sock *nd_create_con_sock(struct sock *sk, struct sk_buff *skb,
 	newsk = nd_create_openreq_child(sk, req, skb);
 
 	/* this init function may be used later */
-	nd_init_sock(newsk);
 	if (!newsk)
 		goto exit_nonewsk;
+	nd_init_sock(newsk);
+	nd_inherit_sockopts(sk, newsk);
  	if(!dst) {
  		dst = nd_sk_route_child_sock(sk, newsk, req);
 	    if (!dst)
@@ -1145,7 +1154,6 @@ struct sock *nd_create_con_sock(struct sock *sk, struct sk_buff *skb,
 	/* set up flow ID and flow size */
 	dsk = nd_sk(newsk);
 	// dsk->flow_id = fhdr->flow_id;
-	dsk->core_id = nd_sk(sk)->core_id;
 	// dsk->total_length = 1000000000;
 	set_max_grant_batch(dst, dsk);
 	/* set up max gso segment */
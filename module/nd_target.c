@@ -106,7 +106,7 @@ int ndt_tcp_read_sock(struct ndt_conn_queue* queue, read_descriptor_t *desc,
 		} else {
 			/* setup a hrtimer */
 			if(!hrtimer_active(&queue->hol_timer)) {
-				hrtimer_start(&queue->hol_timer, ns_to_ktime(queue->hol_timeout_us *
+				hrtimer_start(&queue->hol_timer, ns_to_ktime(READ_ONCE(queue->hol_timeout_us) *
 					NSEC_PER_USEC), HRTIMER_MODE_REL_PINNED_SOFT);
 			}
 		}
@@ -126,7 +126,26 @@ void ndt_conn_schedule_release_queue(struct ndt_conn_queue *queue)
 
 inline bool ndt_conn_is_latency(struct ndt_conn_queue *queue)
 {
-	return queue->prio_class == 1;
+	return queue->prio_class > 0;
+}
+
+/* strict classes run on the high-priority pool; weighted classes share the normal one */
+struct workqueue_struct *ndt_conn_prio_wq(struct ndt_conn_queue *queue)
+{
+	return nd_prio_is_strict(queue->prio_class) ? ndt_conn_wq_lat : ndt_conn_wq;
+}
+
+/* called when a parked skb is released after waiting wait_us; srtt-style 1/8 gain */
+void ndt_hol_update_timeout(struct ndt_conn_queue *queue, s64 wait_us)
+{
+	int drain = READ_ONCE(queue->hol_drain_us);
+
+	wait_us = clamp_t(s64, wait_us, 0, NDT_HOL_TIMEOUT_MAX_US);
+	drain = drain ? drain + ((int)wait_us - drain) / 8 : (int)wait_us;
+	WRITE_ONCE(queue->hol_drain_us, drain);
+	/* wait twice the usual drain time before forcing the delayed ack */
+	WRITE_ONCE(queue->hol_timeout_us, clamp_t(int, 2 * drain,
+		NDT_HOL_TIMEOUT_MIN_US, NDT_HOL_TIMEOUT_MAX_US));
 }
 void ndt_conn_accept_work(struct work_struct *w)
 {
@@ -309,11 +328,7 @@ void ndt_conn_data_ready(struct sock *sk)
 	// }
 	if (likely(queue)) {
 		// pr_info("conn data ready\n");
-		if(ndt_conn_is_latency(queue)) {
-			queue_work_on(queue_cpu(queue), ndt_conn_wq_lat, &queue->io_work);
-		} else {
-			queue_work_on(queue_cpu(queue), ndt_conn_wq, &queue->io_work);
-		}
+		queue_work_on(queue_cpu(queue), ndt_conn_prio_wq(queue), &queue->io_work);
 	}
 	read_unlock_bh(&sk->sk_callback_lock);
 }
@@ -334,11 +349,7 @@ void ndt_conn_write_space(struct sock *sk)
 
 	if (sk_stream_is_writeable(sk)) {
 		clear_bit(SOCK_NOSPACE, &sk->sk_socket->flags);
-		if(ndt_conn_is_latency(queue)) {
-			queue_work_on(queue_cpu(queue), ndt_conn_wq_lat, &queue->io_work);
-		} else {
-			queue_work_on(queue_cpu(queue), ndt_conn_wq, &queue->io_work);
-		}
+		queue_work_on(queue_cpu(queue), ndt_conn_prio_wq(queue), &queue->io_work);
 	}
 out:
 	read_unlock_bh(&sk->sk_callback_lock);
@@ -613,6 +624,9 @@ void ndt_conn_io_work(struct work_struct *w)
 		container_of(w, struct ndt_conn_queue, io_work);
 	bool pending, hol = false;
 	int ret, ops = 0;
+	/* weighted classes sharing a cpu take turns in proportion to their weight */
+	int budget = nd_prio_is_strict(queue->prio_class) ? NDT_CONN_IO_WORK_BUDGET :
+		NDT_CONN_IO_WORK_BUDGET * nd_params.prio_weight[queue->prio_class];
 
 	int optlen, bufsize;
 	sock_rps_record_flow(queue->sock->sk);
@@ -641,7 +655,7 @@ void ndt_conn_io_work(struct work_struct *w)
 	}
 	do {
 		pending = false;
-		ret = ndt_conn_try_recv(queue, NDT_CONN_IO_WORK_BUDGET - ops, &ops);
+		ret = ndt_conn_try_recv(queue, budget - ops, &ops);
 		if (ret > 0) {
 			pending = true;
 		} 
@@ -660,7 +674,7 @@ void ndt_conn_io_work(struct work_struct *w)
 		// else if (ret < 0)
 			// return;
 
-	} while (pending && ops < NDT_CONN_IO_WORK_BUDGET);
+	} while (pending && ops < budget);
 	// ret = kernel_getsockopt(queue->sock, SOL_SOCKET, SO_RCVBUF,
 	// 	(char *)&bufsize, &optlen);
 	// pr_info("ret value:%d\n", ret);
@@ -670,11 +684,7 @@ void ndt_conn_io_work(struct work_struct *w)
 	//  */
 	if (pending) {
 		// pr_info("pending is true\n");
-		if(ndt_conn_is_latency(queue)) {
-			queue_work_on(queue_cpu(queue), ndt_conn_wq_lat, &queue->io_work);
-		} else {
-			queue_work_on(queue_cpu(queue), ndt_conn_wq, &queue->io_work);
-		}
+		queue_work_on(queue_cpu(queue), ndt_conn_prio_wq(queue), &queue->io_work);
 	}
 }
 
@@ -694,7 +704,7 @@ void ndt_delay_ack_work(struct work_struct *w) {
 	release_sock(sock->sk);
 	if(atomic_read(&tcp_sk(sock->sk)->hol_alloc) != 0) {
 		// if(!hrtimer_active(&queue->hol_timer))
-			hrtimer_start(&queue->hol_timer, ns_to_ktime(queue->hol_timeout_us *
+			hrtimer_start(&queue->hol_timer, ns_to_ktime(READ_ONCE(queue->hol_timeout_us) *
 					NSEC_PER_USEC), HRTIMER_MODE_REL_PINNED_SOFT);
 		return;
 	}
@@ -717,11 +727,7 @@ enum hrtimer_restart ndt_hol_timer_handler(struct hrtimer *timer)
 // resume_channel:
 
  	/* send the delay ack */
-	if(ndt_conn_is_latency(queue)) {
-		queue_work_on(queue_cpu(queue), ndt_conn_wq_lat, &queue->delay_ack_work);
-	} else {
-		queue_work_on(queue_cpu(queue), ndt_conn_wq, &queue->delay_ack_work);
-	}
+	queue_work_on(queue_cpu(queue), ndt_conn_prio_wq(queue), &queue->delay_ack_work);
 	return HRTIMER_NORESTART;
 }
 
@@ -747,7 +753,8 @@ int ndt_conn_alloc_queue(struct ndt_conn_port *port,
 	hrtimer_init(&queue->hol_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED_SOFT);
 	queue->hol_timer.function = &ndt_hol_timer_handler;
 	queue->hol_skb = NULL;
-	queue->hol_timeout_us = 1000;
+	queue->hol_timeout_us = NDT_HOL_TIMEOUT_INIT_US;
+	queue->hol_drain_us = 0;
 	INIT_WORK(&queue->delay_ack_work, ndt_delay_ack_work);
 	// INIT_LIST_HEAD(&queue->hol_list);
 	// queue->nr_cmds = 0;
@@ -763,12 +770,10 @@ int ndt_conn_alloc_queue(struct ndt_conn_port *port,
 		ret = queue->idx;
 		goto out_free_queue;
 	}
-	if (queue->idx >= nd_params.total_channels / 2) {
-		/* latency-sensitive channel */
-		queue->prio_class = 1;
-	} else
-		/* throughput-bound i10-lanes */
-		queue->prio_class = 0;
+	/* channel ids repeat per remote host */
+	queue->prio_class = nd_channel_prio(queue->idx % nd_params.total_channels);
+	/* a slow reader must not hold back latency traffic sharing the channel */
+	queue->hol_budget = ndt_conn_is_latency(queue) ? NDT_HOL_BUDGET_LAT : nd_params.bdp;
 
 	// ret = nvmet_tcp_alloc_cmd(queue, &queue->connect);
 	// if (ret)
@@ -791,11 +796,7 @@ int ndt_conn_alloc_queue(struct ndt_conn_port *port,
 	// hard code for now
 	queue->io_cpu = (cur_io_cpu * nd_params.nr_nodes) % nd_params.nr_cpus;
 	cur_io_cpu += 1;
-	if(ndt_conn_is_latency(queue)) {
-		queue_work_on(queue_cpu(queue), ndt_conn_wq_lat, &queue->io_work);
-	} else {
-		queue_work_on(queue_cpu(queue), ndt_conn_wq, &queue->io_work);
-	}
+	queue_work_on(queue_cpu(queue), ndt_conn_prio_wq(queue), &queue->io_work);
 
 	return 0;
 out_destroy_sq:
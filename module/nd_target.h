@@ -14,6 +14,13 @@
 #include <crypto/hash.h>
 #include "uapi_linux_nd.h"
 // #include "nd_host.h"
+/* HOL timeout adapts to how fast parked skbs drain; bounded to keep acks flowing */
+#define NDT_HOL_TIMEOUT_INIT_US	1000
+#define NDT_HOL_TIMEOUT_MIN_US	50
+#define NDT_HOL_TIMEOUT_MAX_US	4000
+/* payload a latency channel may hold back for slow readers */
+#define NDT_HOL_BUDGET_LAT	(4 * ND_MAX_SKB_LEN)
+
 /* ND Connection Listerning Port */
 extern struct workqueue_struct *ndt_conn_wq;
 extern struct workqueue_struct *ndt_conn_wq_lat;
@@ -86,6 +93,10 @@ struct ndt_conn_queue {
 	/* handle the HOL timer */
 	struct hrtimer		hol_timer;
 	int hol_timeout_us;
+	/* EWMA of park-to-release latency of HOL skbs on this channel */
+	int hol_drain_us;
+	/* beyond this many parked bytes, skbs are pushed to the socket anyway */
+	int hol_budget;
 	struct sk_buff *hol_skb;
 	spinlock_t		hol_lock;
 	struct work_struct	delay_ack_work;
@@ -106,6 +117,8 @@ struct ndt_channel_entry {
 };
 
 inline bool ndt_conn_is_latency(struct ndt_conn_queue *queue);
+struct workqueue_struct *ndt_conn_prio_wq(struct ndt_conn_queue *queue);
+void ndt_hol_update_timeout(struct ndt_conn_queue *queue, s64 wait_us);
 inline int queue_cpu(struct ndt_conn_queue *queue);
 void ndt_conn_remove_port(struct ndt_conn_port *port);
 int ndt_conn_alloc_queue(struct ndt_conn_port *port,
@@ -54,6 +54,13 @@ struct nd_skb_cb {
 	struct sk_buff* tail; /* tail of skb's fraglist */
 	struct ndt_conn_queue *queue;
 	__u8 		has_old_frag_list;
+	/* priority class of the payload; picks the channel class */
+	__u8		prio_class;
+	/* the last byte ends a message (MSG_EOR); such skbs are never coalesced onto */
+	__u8		eor;
+	/* DGRAM: the sender's port and address, for msg_name */
+	__be16		sport;
+	__be32		saddr;
 // 	union {
 // 		struct inet_skb_parm	h4;
 // #if IS_ENABLED(CONFIG_IPV6)
@@ -89,12 +96,12 @@ static inline uint32_t nd_window_size(struct nd_sock *nsk) {
 		uint32_t win;
 		struct sock *sk = (struct sock*) nsk;
 		win = READ_ONCE(sk->sk_rcvbuf) - ((u32)atomic_read(&nsk->receiver.rcv_nxt) - (u32)atomic_read(&nsk->receiver.copied_seq))
-			 - (u32)atomic_read(&nsk->receiver.in_flight_copy_bytes);
+			 - (u32)nd_rcv_inflight_approx(nsk);
 		if(win > READ_ONCE(sk->sk_rcvbuf)) {
 			pr_info("win: %d\n", win);
 			pr_info("READ_ONCE(sk->sk_rcvbuf):%d\n", READ_ONCE(sk->sk_rcvbuf));
 			pr_info("grant nxt:%u\n", nsk->receiver.grant_nxt);
-			pr_info("(u32)atomic_read(&nsk->receiver.in_flight_copy_bytes:%u\n", atomic_read(&nsk->receiver.in_flight_copy_bytes));
+			pr_info("in flight copy bytes:%d\n", nd_rcv_inflight_approx(nsk));
 			pr_info("nsk->receiver.rcv_nxt:%u\n", (u32)atomic_read(&nsk->receiver.rcv_nxt));
 			pr_info("nsk->receiver.copied_seq:%u\n", (u32)atomic_read(&nsk->receiver.copied_seq));
 			// WARN_ON(true);
@@ -112,7 +119,7 @@ static inline uint32_t nd_free_space(struct nd_sock *nsk) {
 		if(buf > READ_ONCE(sk->sk_rcvbuf)) {
 			pr_info("READ_ONCE(sk->sk_rcvbuf):%d\n", READ_ONCE(sk->sk_rcvbuf));
 			pr_info("atomic_read(&sk->sk_rmem_alloc):%u\n",atomic_read(&sk->sk_rmem_alloc));
-			pr_info("(u32)atomic_read(&nsk->receiver.in_flight_copy_bytes:%u\n", atomic_read(&nsk->receiver.in_flight_copy_bytes));
+			pr_info("in flight copy bytes:%d\n", nd_rcv_inflight_approx(nsk));
 			pr_info("nsk->receiver.rcv_nxt:%u\n", (u32)atomic_read(&nsk->receiver.rcv_nxt));
 			pr_info("nsk->receiver.copied_seq:%u\n", (u32)atomic_read(&nsk->receiver.copied_seq));
 			pr_info("sk->sk_backlog.len:%u\n", sk->sk_backlog.len);
@@ -519,7 +526,7 @@ static inline void nd_lib_close(struct sock *sk, long timeout)
 
 static inline int nd_rqueue_get(struct sock *sk)
 {
-	return sk_rmem_alloc_get(sk) - READ_ONCE(nd_sk(sk)->forward_deficit);
+	return sk_rmem_alloc_get(sk);
 }
 
 static inline bool nd_sk_bound_dev_eq(struct net *net, int bound_dev_if,
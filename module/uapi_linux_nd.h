@@ -45,6 +45,8 @@ enum nd_packet_type {
 	ACCEPT			   = 28,
 
 	FIN              = 29,
+	/* connectionless message, framed like DATA */
+	DGRAM            = 30,
 };
 
 // struct vs_hdr {
@@ -90,6 +92,7 @@ struct ndhdr {
 	 * @doff: High order 4 bits holds the number of 4-byte chunks in a
 	 * data_header (low-order bits unused). Used only for DATA packets;
 	 * must be in the same position as the data offset in a TCP header.
+	 * DATA uses the low-order bits for ND_DOFF_* flags.
 	 */
 	__u8 doff;
 
@@ -227,6 +230,36 @@ enum {
 #define ND_NO_CHECK6_RX 102	/* Disable accpeting checksum for ND6 */
 #define ND_SEGMENT	103	/* Set GSO segmentation size */
 #define ND_GRO		104	/* This socket can receive ND GRO packets */
+#define ND_PRIO		105	/* sendmsg cmsg: priority class of the bytes in this call */
+#define ND_SCHE_POLICY	106	/* channel scheduling policy (SCHE_RR, SCHE_SRC_PORT, SCHE_FLOWLET) */
+#define ND_COPY_MODE	107	/* data copy offload, one of ND_COPY_* */
+#define ND_PDU_SIZE	108	/* max payload bytes per request; ND_MIN_PDU_SIZE..ND_MAX_SKB_LEN */
+#define ND_GRANT_WIN	109	/* grant window in bytes; before connect/listen only */
+#define ND_CHANNELS	110	/* pin to a channel range, struct nd_channel_set; count 0 unpins */
+#define ND_DGRAM	111	/* connectionless message endpoint on the bound port; before connect/listen only */
+#define ND_MSG_MODE	112	/* recvmsg returns at most one MSG_EOR-delimited message; sendmsg w/o MSG_MORE ends one */
+
+/* sendmsg flag, a bit the socket core leaves alone: return once the copies
+ * are queued. The n-th such call on a socket reports on the error queue,
+ * as a SO_EE_ORIGIN_ZEROCOPY notification with ee_info = ee_data = n, when
+ * its buffer may be reused.
+ */
+#define MSG_ND_ASYNC	0x1000000
+
+/* ndhdr doff flags */
+#define ND_DOFF_EOR	0x01	/* the last byte of this DATA ends a message */
+
+/* ND_COPY_MODE values */
+#define ND_COPY_AUTO	0	/* offload to dcopy threads past the inflight thresholds */
+#define ND_COPY_LOCAL	1	/* always copy in the calling context */
+#define ND_COPY_REMOTE	2	/* always offload when a dcopy thread is available */
+
+#define ND_MIN_PDU_SIZE	4096
+
+struct nd_channel_set {
+	int first;
+	int count;
+};
 
 /* ND encapsulation types */
 #define ND_ENCAP_ESPINND_NON_IKE	1 /* draft-ietf-ipsec-nat-t-ike-00/01 */
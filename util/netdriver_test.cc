@@ -18,6 +18,8 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <inttypes.h>
+#include <linux/errqueue.h>
+#include <algorithm>
 #include <vector>
 #include <thread>
 
@@ -334,6 +336,83 @@ void test_ndstream(int fd, struct sockaddr *dest, char* buffer)
 	}
 }
 
+/**
+ * reap_async() - Collect MSG_ND_ASYNC completions off the error queue.
+ * @fd:     Socket the sends were issued on.
+ * @block:  Wait for at least one completion.
+ *
+ * Return: number of sendmsg calls reported complete.
+ */
+int reap_async(int fd, bool block)
+{
+	char control[128];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *serr;
+	struct pollfd pfd = {fd, 0, 0};
+	int done = 0;
+
+	if (block)
+		poll(&pfd, 1, -1);
+	while (1) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			serr = (struct sock_extended_err *) CMSG_DATA(cm);
+			if (serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+				done += serr->ee_data - serr->ee_info + 1;
+		}
+	}
+	return done;
+}
+
+/**
+ * test_ndstream_async() - Stream with MSG_ND_ASYNC: keep up to 8 sends in
+ * flight, each from its own slice of @buffer, so one thread keeps several
+ * dcopy cores busy.
+ */
+void test_ndstream_async(int fd, struct sockaddr *dest, char* buffer)
+{
+	const int depth = 8;
+	int slice = std::min(length, 8000000 / depth);
+	int64_t bytes_sent;
+	uint64_t start_cycles, issued = 0, completed = 0;
+	double elapsed, rate;
+
+	if (connect(fd, dest, sizeof(struct sockaddr_in)) == -1) {
+		printf("Couldn't connect to dest %s\n", strerror(errno));
+		exit(1);
+	}
+	std::chrono::steady_clock::time_point start_clock = std::chrono::steady_clock::now();
+	while (std::chrono::steady_clock::now() - start_clock < std::chrono::seconds(60)) {
+		bytes_sent = 0;
+		start_cycles = rdtsc();
+		for (int i = 0; i < count; i++) {
+			/* a slice is reused only after its send is reported */
+			while (issued - completed >= (uint64_t) depth)
+				completed += reap_async(fd, true);
+			int result = send(fd, buffer + (issued % depth) * slice,
+				slice, MSG_ND_ASYNC);
+			if (result < 0) {
+				printf("Socket write failed: %s %d\n", strerror(errno), result);
+				return;
+			}
+			issued++;
+			bytes_sent += result;
+			completed += reap_async(fd, false);
+		}
+		elapsed = to_seconds(rdtsc() - start_cycles);
+		rate = ((double) bytes_sent) / elapsed;
+		printf("ND async throughput using %d byte buffers: %.2f Gb/sec\n",
+			slice, rate * 1e-09 * 8);
+	}
+	while (issued != completed)
+		completed += reap_async(fd, true);
+}
+
 void test_ndping(int fd, struct sockaddr *dest, char* buffer)
 {
 	//struct sockaddr_in* in = (struct sockaddr_in*) dest;
@@ -800,6 +879,8 @@ int main(int argc, char** argv)
 				test_udpstream(host, port);
 			} else if (strcmp(argv[nextArg], "ndstream") == 0) {
 				test_ndstream(fd, dest, buffer);
+			} else if (strcmp(argv[nextArg], "ndstream_async") == 0) {
+				test_ndstream_async(fd, dest, buffer);
 			} else if (strcmp(argv[nextArg], "ndping") == 0) {
 				//printf("call ndping\n");
 				test_ndping(fd, dest, buffer);
@@ -22,6 +22,7 @@
 #include <inttypes.h>
 #include <vector>
 #include <queue>
+#include <algorithm>
 #include <thread>
 #include <mutex>          // std::mutex
 #include <condition_variable> // std::condition_variable
@@ -88,6 +89,8 @@ void print_help(const char *name)
 		"--count      Number of times to repeat a test (default: 1000)\n"
 		"--length     Size of messages, in bytes (default: 100)\n"
 		"--sp       src port of connection \n"
+		"--rounds     Number of synchronized bursts for ndincast (default: 100)\n"
+		"--batch      RPCs per sendmmsg/recvmmsg for ndmmsg (default: 8)\n"
 		"--seed       Used to compute message contents (default: 12345)\n",
 		name);
 }
@@ -659,6 +662,216 @@ close:
 	return;
 }
 
+/**
+ * test_nddgram() - 4096-byte rpcs over a connectionless ND_DGRAM socket
+ * against pingpong_server --dgram_port: no connect, no per-flow state.
+ * @fd:     Bound ND socket of this flow.
+ * @dest:   Server address.
+ * @id:     Index of this flow.
+ */
+void test_nddgram(int fd, struct sockaddr *dest, int id)
+{
+	int times = 90;
+	int optval = 1;
+	char buffer[5000];
+	std::ofstream file;
+	std::vector<double> latency;
+	uint64_t start_time;
+
+	if (setsockopt(fd, SOL_VIRTUAL_SOCK, ND_DGRAM, &optval, sizeof(optval))) {
+		printf("Couldn't set ND_DGRAM: %s\n", strerror(errno));
+		exit(1);
+	}
+	file.open("result_nd_dgram_"+ std::to_string(id));
+	start_time = rdtsc();
+	while (1) {
+		uint64_t start = rdtsc(), end;
+		if (sendto(fd, buffer, 4096, 0, dest, sizeof(struct sockaddr_in)) != 4096) {
+			printf("sendto failed: %s\n", strerror(errno));
+			break;
+		}
+		if (recvfrom(fd, buffer, sizeof(buffer), 0, NULL, NULL) != 4096) {
+			printf("recvfrom failed: %s\n", strerror(errno));
+			break;
+		}
+		end = rdtsc();
+		latency.push_back(to_seconds(end-start));
+		if(to_seconds(end-start_time) > times)
+			break;
+	}
+	for(uint32_t i = 0; i < latency.size(); i++) {
+		file << "finish time: " << latency[i] << "\n";
+	}
+	file.close();
+	close(fd);
+}
+
+/* ndmmsg: --batch rpcs per syscall */
+int batch = 8;
+
+/**
+ * test_ndmmsg() - 4096-byte rpcs in ND_MSG_MODE against pingpong_server
+ * --msg_mode: each round moves --batch rpcs with one sendmmsg and collects
+ * the echoes with recvmmsg, one message per entry, without framing loops.
+ * @fd:     ND socket of this flow.
+ * @dest:   Server address.
+ * @id:     Index of this flow.
+ */
+void test_ndmmsg(int fd, struct sockaddr *dest, int id)
+{
+	int times = 90;
+	int optval = 1;
+	char *buffer = (char*)malloc(batch * 4096);
+	std::vector<struct mmsghdr> msgs(batch);
+	std::vector<struct iovec> iovs(batch);
+	std::ofstream file;
+	std::vector<double> latency;
+	uint64_t start_time;
+
+	if (setsockopt(fd, SOL_VIRTUAL_SOCK, ND_MSG_MODE, &optval, sizeof(optval))) {
+		printf("Couldn't set ND_MSG_MODE: %s\n", strerror(errno));
+		exit(1);
+	}
+	if (connect(fd, dest, sizeof(struct sockaddr_in)) == -1) {
+		printf("Couldn't connect to dest %s\n", strerror(errno));
+		exit(1);
+	}
+	file.open("result_nd_mmsg_"+ std::to_string(id));
+	start_time = rdtsc();
+	while (1) {
+		uint64_t start = rdtsc(), end;
+		int done = 0;
+
+		for (int i = 0; i < batch; i++) {
+			iovs[i].iov_base = buffer + i * 4096;
+			iovs[i].iov_len = 4096;
+			memset(&msgs[i], 0, sizeof(msgs[i]));
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		while (done < batch) {
+			int result = sendmmsg(fd, &msgs[done], batch - done, 0);
+			if (result <= 0) {
+				printf("sendmmsg failed: %s\n", strerror(errno));
+				goto close;
+			}
+			done += result;
+		}
+		for (done = 0; done < batch; ) {
+			int result = recvmmsg(fd, &msgs[done], batch - done,
+				MSG_WAITFORONE, NULL);
+			if (result <= 0) {
+				printf("recvmmsg failed: %s\n", strerror(errno));
+				goto close;
+			}
+			for (int i = done; i < done + result; i++) {
+				if (msgs[i].msg_len != 4096 ||
+						!(msgs[i].msg_hdr.msg_flags & MSG_EOR)) {
+					printf("short rpc: %u bytes\n", msgs[i].msg_len);
+					goto close;
+				}
+			}
+			done += result;
+		}
+		end = rdtsc();
+		latency.push_back(to_seconds(end-start));
+		if(to_seconds(end-start_time) > times)
+			break;
+	}
+close:
+	for(uint32_t i = 0; i < latency.size(); i++) {
+		file << "finish time: " << latency[i] << "\n";
+	}
+	file.close();
+	free(buffer);
+	close(fd);
+}
+
+/* ndincast: all --count flows fire a --length burst at the same time */
+int rounds = 100;
+std::mutex incast_mtx;
+std::condition_variable incast_cv;
+int incast_waiting = 0;
+int incast_generation = 0;
+
+void incast_barrier()
+{
+	std::unique_lock<std::mutex> lck(incast_mtx);
+	int generation = incast_generation;
+	if (++incast_waiting == count) {
+		incast_waiting = 0;
+		incast_generation++;
+		incast_cv.notify_all();
+		return;
+	}
+	incast_cv.wait(lck, [generation] {return generation != incast_generation;});
+}
+
+/**
+ * test_ndincast() - Many-to-one burst against pingpong_server: every round,
+ * all flows write --length bytes at once and wait for the echo. Run it once
+ * with the default grant_sched and once with grant_sched=2 (matching) to
+ * compare the burst completion times.
+ * @fd:     ND socket of this flow.
+ * @dest:   Server address.
+ * @id:     Index of this flow.
+ */
+void test_ndincast(int fd, struct sockaddr *dest, int id)
+{
+	/* the server echoes in 4096-byte rpcs */
+	int burst = (length + 4095) / 4096 * 4096;
+	char *buffer = (char*)malloc(burst);
+	std::ofstream file;
+	std::vector<double> latency;
+	int r = 0;
+
+	file.open("result_nd_incast_"+ std::to_string(id));
+	if (connect(fd, dest, sizeof(struct sockaddr_in)) == -1) {
+		printf("Couldn't connect to dest %s\n", strerror(errno));
+		exit(1);
+	}
+	for (; r < rounds; ) {
+		int copied = 0;
+		incast_barrier();
+		r++;
+		uint64_t start = rdtsc();
+		while (copied < burst) {
+			int result = write(fd, buffer + copied, burst - copied);
+			if (result <= 0) {
+				printf("goto close\n");
+				goto close;
+			}
+			copied += result;
+		}
+		copied = 0;
+		while (copied < burst) {
+			int result = read(fd, buffer + copied, burst - copied);
+			if (result <= 0) {
+				printf("goto close2\n");
+				goto close;
+			}
+			copied += result;
+		}
+		latency.push_back(to_seconds(rdtsc() - start));
+	}
+close:
+	for(uint32_t i = 0; i < latency.size(); i++) {
+		file << "finish time: " << latency[i] << "\n";
+	}
+	file.close();
+	if (!latency.empty()) {
+		std::sort(latency.begin(), latency.end());
+		printf("flow %d incast %d bytes x %d: p50 %.1f us p99 %.1f us\n", id, burst,
+			count, latency[latency.size() / 2] * 1e6,
+			latency[latency.size() * 99 / 100] * 1e6);
+	}
+	free(buffer);
+	close(fd);
+	/* a flow that failed must not hang the others */
+	for (; r < rounds; r++)
+		incast_barrier();
+}
+
 /**
  * tcp_ping() - Send a request on a TCP socket and wait for the
  * corresponding response.
@@ -897,6 +1110,24 @@ int main(int argc, char** argv)
 			nextArg++;
 			limit = get_int(argv[nextArg],
 				"Bad limit %s; must be positive integer\n");
+		} else if (strcmp(argv[nextArg], "--rounds") == 0) {
+			if (nextArg == (argc-1)) {
+				printf("No value provided for %s option\n",
+					argv[nextArg]);
+				exit(1);
+			}
+			nextArg++;
+			rounds = get_int(argv[nextArg],
+				"Bad rounds %s; must be positive integer\n");
+		} else if (strcmp(argv[nextArg], "--batch") == 0) {
+			if (nextArg == (argc-1)) {
+				printf("No value provided for %s option\n",
+					argv[nextArg]);
+				exit(1);
+			}
+			nextArg++;
+			batch = get_int(argv[nextArg],
+				"Bad batch %s; must be positive integer\n");
 		} else {
 			printf("Unknown option %s; type '%s --help' for help\n",
 				argv[nextArg], argv[0]);
@@ -993,6 +1224,12 @@ int main(int argc, char** argv)
 				// CPU_SET(i % 2  * 4, &cpuset);
 				// pthread_setaffinity_np(workers[workers.size() - 1].native_handle(),
 				// 								sizeof(cpu_set_t), &cpuset);
+			} else if (strcmp(argv[nextArg], "ndincast") == 0) {
+				workers.push_back(std::thread(test_ndincast, fd, dest, i));
+			} else if (strcmp(argv[nextArg], "nddgram") == 0) {
+				workers.push_back(std::thread(test_nddgram, fd, dest, i));
+			} else if (strcmp(argv[nextArg], "ndmmsg") == 0) {
+				workers.push_back(std::thread(test_ndmmsg, fd, dest, i));
 			} else if (strcmp(argv[nextArg], "tcppingpong") == 0) {
 				fd = socket(AF_INET, SOCK_STREAM, 0);
 				optval = 6;
@@ -28,12 +28,17 @@
 bool verbose = false;
 
 int port = 4000;
+/* listeners sharing the port through SO_REUSEPORT, one accept loop each */
+int accept_threads = 1;
 
 /* True that a specific format is expected for incoming messages, and we
  * should check that incoming messages conform to it.
  */
 bool validate = false;
 
+/* Set ND_MSG_MODE on the ND listener; accepted sockets inherit it. */
+bool msg_mode = false;
+
 void nd_pingpong_async(int fd, struct sockaddr_in source);
 
 struct Agg_Stats {
@@ -178,6 +183,10 @@ void print_help(const char *name)
 		"--help       Print this message and exit\n"
 		"--port       (First) port number to use (default: 4000)\n"
 		"--num_ports  Number of ports to open (default: 1)\n"
+		"--accept_threads  Number of SO_REUSEPORT listeners on the ND port, each\n"
+		"             accepting on its own core (default: 1)\n"
+		"--dgram_port Also echo connectionless ND_DGRAM messages on this port (default: off)\n"
+		"--msg_mode   Set ND_MSG_MODE on ND connections, one rpc per message (default: false)\n"
 		"--validate   Validate contents of incoming messages (default: false\n"
 		"--verbose    Log events as they happen (default: false)\n",
 		name);
@@ -582,9 +591,10 @@ void nd_pingpong_async(int fd, struct sockaddr_in source) {
 }
 /**
  * nd_server()
- *
+ * @core: cpu the accept loop (and the connections it spawns) runs on when
+ *        the port is sharded over several listeners.
  */
-void nd_server(int port)
+void nd_server(int port, int core)
 {
 	// char buffer[1000000];
 	// int result = 0;
@@ -606,6 +616,19 @@ void nd_server(int port)
 			strerror(errno));
 		exit(1);
 	}
+	if (accept_threads > 1) {
+		cpu_set_t cpuset;
+
+		if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &option_value,
+				sizeof(option_value)) != 0) {
+			printf("Couldn't set SO_REUSEPORT on listen socket: %s",
+				strerror(errno));
+			exit(1);
+		}
+		CPU_ZERO(&cpuset);
+		CPU_SET(core % std::thread::hardware_concurrency(), &cpuset);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+	}
 	struct sockaddr_in addr;
 	addr.sin_family = AF_INET;
 	addr.sin_port = htons(port);
@@ -615,6 +638,11 @@ void nd_server(int port)
 		printf("Couldn't bind to port %d: %s\n", port, strerror(errno));
 		exit(1);
 	}
+	if (msg_mode && setsockopt(listen_fd, SOL_VIRTUAL_SOCK, ND_MSG_MODE,
+			&option_value, sizeof(option_value)) != 0) {
+		printf("Couldn't set ND_MSG_MODE: %s\n", strerror(errno));
+		exit(1);
+	}
 	// struct timeval tv;
 	// tv.tv_usec = 100 * 1000;
 	// if (setsockopt(listen_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
@@ -681,9 +709,55 @@ void nd_server(int port)
 
 }
 
+/**
+ * nd_dgram_server() - Echo every message on one connectionless ND_DGRAM
+ * socket back to its sender.
+ * @port:  Port number on which to receive.
+ */
+void nd_dgram_server(int port)
+{
+	char buffer[65536];
+	int option_value = 1;
+	struct sockaddr_in addr;
+	int fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_VIRTUAL_SOCK);
+
+	if (fd == -1) {
+		printf("Couldn't open server socket: %s\n", strerror(errno));
+		exit(1);
+	}
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = INADDR_ANY;
+	if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1) {
+		printf("Couldn't bind to port %d: %s\n", port, strerror(errno));
+		exit(1);
+	}
+	if (setsockopt(fd, SOL_VIRTUAL_SOCK, ND_DGRAM, &option_value,
+			sizeof(option_value)) != 0) {
+		printf("Couldn't set ND_DGRAM: %s\n", strerror(errno));
+		exit(1);
+	}
+	while (1) {
+		struct sockaddr_in client_addr;
+		socklen_t addr_len = sizeof(client_addr);
+		int result = recvfrom(fd, buffer, sizeof(buffer), 0,
+			reinterpret_cast<sockaddr *>(&client_addr), &addr_len);
+
+		if (result < 0) {
+			printf("Read error on socket: %s\n", strerror(errno));
+			exit(1);
+		}
+		if (sendto(fd, buffer, result, 0,
+				reinterpret_cast<sockaddr *>(&client_addr), addr_len) < 0 && verbose)
+			printf("Echo to %s failed: %s\n", print_address(&client_addr),
+				strerror(errno));
+	}
+}
+
 int main(int argc, char** argv) {
 	int next_arg;
 	int num_ports = 1;
+	int dgram_port = 0;
 	std::string ip;
 	if ((argc >= 2) && (strcmp(argv[1], "--help") == 0)) {
 		print_help(argv[0]);
@@ -712,6 +786,16 @@ int main(int argc, char** argv) {
 			next_arg++;
 			ip = std::string(argv[next_arg]);
 		} 
+		else if (strcmp(argv[next_arg], "--accept_threads") == 0) {
+			if (next_arg == (argc-1)) {
+				printf("No value provided for %s option\n",
+					argv[next_arg]);
+				exit(1);
+			}
+			next_arg++;
+			accept_threads = get_int(argv[next_arg],
+				"Bad accept_threads %s; must be positive integer\n");
+		}
 		else if (strcmp(argv[next_arg], "--num_ports") == 0) {
 			if (next_arg == (argc-1)) {
 				printf("No value provided for %s option\n",
@@ -721,6 +805,17 @@ int main(int argc, char** argv) {
 			next_arg++;
 			num_ports = get_int(argv[next_arg],
 				"Bad num_ports %s; must be positive integer\n");
+		} else if (strcmp(argv[next_arg], "--dgram_port") == 0) {
+			if (next_arg == (argc-1)) {
+				printf("No value provided for %s option\n",
+					argv[next_arg]);
+				exit(1);
+			}
+			next_arg++;
+			dgram_port = get_int(argv[next_arg],
+				"Bad dgram_port %s; must be positive integer\n");
+		} else if (strcmp(argv[next_arg], "--msg_mode") == 0) {
+			msg_mode = true;
 		} else if (strcmp(argv[next_arg], "--validate") == 0) {
 			validate = true;
 		} else if (strcmp(argv[next_arg], "--verbose") == 0) {
@@ -735,7 +830,10 @@ int main(int argc, char** argv) {
 
 	workers.push_back(std::thread(tcp_server, port));
 	workers.push_back(std::thread(udp_server, port));
-	workers.push_back(std::thread(nd_server, port));
+	for (int i = 0; i < accept_threads; i++)
+		workers.push_back(std::thread(nd_server, port, i));
+	if (dgram_port)
+		workers.push_back(std::thread(nd_dgram_server, dgram_port));
 	//workers.push_back(std::thread(aggre_thread, &agg_stats));
 	for(int i = 0; i < num_ports; i++) {
 		workers[i].join();
@@ -25,6 +25,8 @@
 bool verbose = false;
 
 int port = 4000;
+/* listeners sharing the port through SO_REUSEPORT, one accept loop each */
+int accept_threads = 1;
 
 /* True that a specific format is expected for incoming messages, and we
  * should check that incoming messages conform to it.
@@ -77,6 +79,8 @@ void print_help(const char *name)
 		"--help       Print this message and exit\n"
 		"--port       (First) port number to use (default: 4000)\n"
 		"--num_ports  Number of ports to open (default: 1)\n"
+		"--accept_threads  Number of SO_REUSEPORT listeners on the ND port, each\n"
+		"             accepting on its own core (default: 1)\n"
 		"--validate   Validate contents of incoming messages (default: false\n"
 		"--verbose    Log events as they happen (default: false)\n",
 		name);
@@ -570,9 +574,10 @@ void udp_server(int port)
 
 /**
  * nd_server()
- *
+ * @core: cpu the accept loop (and the connections it spawns) runs on when
+ *        the port is sharded over several listeners.
  */
-void nd_server(int port)
+void nd_server(int port, int core)
 {
 	// char buffer[1000000];
 	// int result = 0;
@@ -594,6 +599,27 @@ void nd_server(int port)
 			strerror(errno));
 		exit(1);
 	}
+	if (accept_threads > 1) {
+		cpu_set_t cpuset;
+
+		if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &option_value,
+				sizeof(option_value)) != 0) {
+			printf("Couldn't set SO_REUSEPORT on listen socket: %s",
+				strerror(errno));
+			exit(1);
+		}
+		CPU_ZERO(&cpuset);
+		CPU_SET(core % std::thread::hardware_concurrency(), &cpuset);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+		/* SYNCs handled on this core are steered to this listener */
+		option_value = core % std::thread::hardware_concurrency();
+		if (setsockopt(listen_fd, SOL_SOCKET, SO_INCOMING_CPU, &option_value,
+				sizeof(option_value)) != 0) {
+			printf("Couldn't set SO_INCOMING_CPU on listen socket: %s",
+				strerror(errno));
+			exit(1);
+		}
+	}
 	struct sockaddr_in addr;
 	addr.sin_family = AF_INET;
 	addr.sin_port = htons(port);
@@ -696,6 +722,16 @@ int main(int argc, char** argv) {
 			next_arg++;
 			ip = std::string(argv[next_arg]);
 		} 
+		else if (strcmp(argv[next_arg], "--accept_threads") == 0) {
+			if (next_arg == (argc-1)) {
+				printf("No value provided for %s option\n",
+					argv[next_arg]);
+				exit(1);
+			}
+			next_arg++;
+			accept_threads = get_int(argv[next_arg],
+				"Bad accept_threads %s; must be positive integer\n");
+		}
 		else if (strcmp(argv[next_arg], "--num_ports") == 0) {
 			if (next_arg == (argc-1)) {
 				printf("No value provided for %s option\n",
@@ -719,7 +755,8 @@ int main(int argc, char** argv) {
 
 	workers.push_back(std::thread(tcp_server, port));
 	workers.push_back(std::thread(udp_server, port));
-	workers.push_back(std::thread(nd_server, port));
+	for (int i = 0; i < accept_threads; i++)
+		workers.push_back(std::thread(nd_server, port, i));
 //	workers.push_back(std::thread(aggre_thread, &agg_stats));
 	for(int i = 0; i < num_ports; i++) {
 		workers[i].join();
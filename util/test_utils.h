@@ -10,6 +10,14 @@ extern "C"
 	
 #define sizeof32(type) static_cast<int>(sizeof(type))
 
+/* ND socket options, see module/uapi_linux_nd.h */
+#ifndef SOL_VIRTUAL_SOCK
+#define SOL_VIRTUAL_SOCK 19
+#endif
+#define ND_DGRAM 111
+#define ND_MSG_MODE 112
+#define MSG_ND_ASYNC 0x1000000
+
 extern int     check_buffer(void *buffer, size_t length);
 extern double  get_cycles_per_sec();
 extern int     get_int(const char *s, const char *msg);